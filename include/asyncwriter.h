@@ -17,6 +17,7 @@
 #ifndef _ASYNCWRITER_H
 #define _ASYNCWRITER_H
 
+#include <stdint.h>
 #include <ireaderwriter.h>
 
 namespace htoolbox {
@@ -28,21 +29,47 @@ namespace htoolbox {
  *
  * A call to close() will block until all the data has been written.
  *
- * Important note: the buffer given to write will still be in use by the writer
- * thread after write() has returned, so you should use two buffers
- * alternatively when using this module.
+ * Buffers are queued in a ring of slots, so the caller can get as many buffers
+ * ahead of the underlying stream as there are slots.  What happens to the
+ * buffer given to put() depends on the mode:
+ * - borrow: the buffer will still be in use by the writer thread after put()
+ *   has returned, so you should use (number of slots + 1) buffers alternatively
+ *   when using this mode;
+ * - copy: the data is copied into a buffer owned by the slot, so the buffer
+ *   can be re-used as soon as put() has returned;
+ * - donate: the buffer must have been allocated with malloc(), and will be
+ *   freed by the writer thread once written (or on failure).
  */
 class AsyncWriter : public IReaderWriter {
   struct         Private;
   Private* const _d;
   static void* _write_thread(void* data);
 public:
+  enum Mode {
+    borrow,
+    copy,
+    donate
+  };
+  //! \brief Activity counters
+  struct Stats {
+    size_t        slots;            //!< number of slots in the ring
+    size_t        used;             //!< slots currently in use
+    size_t        max_used;         //!< highest number of slots used at once
+    uint64_t      puts;             //!< buffers queued
+    uint64_t      producer_waits;   //!< times put() had to wait for a slot
+    uint64_t      producer_wait_us; //!< total time put() waited for a slot
+    uint64_t      consumer_waits;   //!< times the thread had to wait for data
+    uint64_t      consumer_wait_us; //!< total time the thread waited for data
+  };
   //! \brief Constructor
   /*!
    * \param child        underlying stream to write to
    * \param delete_child whether to also delete child at destruction
+   * \param slots        number of buffers that can be queued
+   * \param mode         what to do with the buffers given to put()
   */
-  AsyncWriter(IReaderWriter* child, bool delete_child);
+  AsyncWriter(IReaderWriter* child, bool delete_child, size_t slots = 1,
+    Mode mode = borrow);
   ~AsyncWriter();
   int open();
   int close();
@@ -51,6 +78,11 @@ public:
   //! \brief Always fails to get, as this is a writer
   ssize_t get(void* buffer, size_t size);
   ssize_t put(const void* buffer, size_t size);
+  //! \brief Get activity counters, which are reset by open()
+  /*!
+   * \param stats       structure to fill in
+  */
+  void getStats(Stats* stats) const;
 };
 
 };
@@ -0,0 +1,76 @@
+/*
+    Copyright (C) 2011  Hervé Fache
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 3.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _CHUNKER_H
+#define _CHUNKER_H
+
+#include <ireaderwriter.h>
+#include <hasher.h>
+
+namespace htoolbox {
+
+//! \brief Content-defined chunker
+/*!
+ * Reading/writing from/to this stream will read/write to the underlying
+ * stream, with no modification to the data.
+ *
+ * The data is cut into chunks where its contents say so, using a Gear rolling
+ * hash as FastCDC does, so inserting or removing data only changes the chunks
+ * around the change.  Each chunk is hashed, and given with its offset and
+ * size to the callback function as soon as it ends.  The last chunk is given
+ * at close().
+ */
+class Chunker : public IReaderWriter {
+  struct         Private;
+  Private* const _d;
+  Chunker(const Chunker&);
+  const Chunker& operator=(const Chunker&);
+public:
+  //! \brief Function called for each chunk
+  /*!
+   * \param offset       offset of the chunk in the stream
+   * \param size         size of the chunk
+   * \param hash         hash of the chunk
+   * \param user         user data given to the constructor
+   * \return             negative number to fail the read/write, 0 otherwise
+  */
+  typedef int (*chunk_cb_f)(int64_t offset, size_t size, const char* hash,
+    void* user);
+  //! \brief Constructor
+  /*!
+   * \param child        underlying stream to read from or write to
+   * \param delete_child whether to also delete child at destruction
+   * \param digest       digest to hash chunks with
+   * \param callback     function to call for each chunk
+   * \param user         user data to give to the callback
+   * \param min_size     minimum chunk size, at least 64
+   * \param avg_size     average chunk size, rounded to a power of two
+   * \param max_size     maximum chunk size
+  */
+  Chunker(IReaderWriter* child, bool delete_child, Hasher::Digest digest,
+    chunk_cb_f callback, void* user, size_t min_size = 2048,
+    size_t avg_size = 8192, size_t max_size = 65536);
+  ~Chunker();
+  int open();
+  int close();
+  ssize_t read(void* buffer, size_t size);
+  ssize_t get(void* buffer, size_t size);
+  ssize_t put(const void* buffer, size_t size);
+};
+
+};
+
+#endif // _CHUNKER_H
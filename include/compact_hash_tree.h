@@ -0,0 +1,430 @@
+/*
+     Copyright (C) 2011  Hervé Fache
+
+     This program is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License version 2 as
+     published by the Free Software Foundation.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program; if not, write to the Free Software
+     Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+#ifndef _COMPACT_HASH_TREE_H
+#define _COMPACT_HASH_TREE_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#include <new>
+
+#include <report.h>
+
+namespace htoolbox {
+
+// Same as HashTree, but with a much smaller memory footprint:
+// * nodes only hold pointers to the children that exist, in index order,
+//   found by counting the bits set in their mask;
+// * nodes have no parent pointer nor level, these are known when walking;
+// * a node that would be left with a single object is replaced by it;
+// * nodes are allocated from pools of slabs, one per node capacity.
+// The class T must implement the following operator for this to work:
+//   operator const char*() const { return hash; }
+
+template<class T>
+class CompactHashTree {
+  struct Node {
+    uint16_t  mask;         // Bit mask: 1 means child exists
+    uint16_t  leaves;       // Bit mask: 1 means child is hobj
+    uint8_t   size_class;   // Capacity is 2 << size_class
+    void*     children[1];  // Children that exist, in index order
+    int count() const {
+      return __builtin_popcount(mask);
+    }
+    int position(int i) const {
+      return __builtin_popcount(mask & ((1 << i) - 1));
+    }
+    bool has(int i) const     { return (mask & (1 << i)) != 0; }
+    bool isLeaf(int i) const  { return (leaves & (1 << i)) != 0; }
+    void* get(int i) const    { return children[position(i)]; }
+  };
+  enum {
+    SIZE_CLASSES = 4,           // 2, 4, 8 and 16 children
+    SLAB_SIZE = 65536
+  };
+  struct Slab {
+    Slab*     next;
+  };
+  // Node allocation
+  Slab*       _slabs;
+  void*       _free[SIZE_CLASSES];  // Freed nodes, linked through first word
+  char*       _slab_pos[SIZE_CLASSES];
+  char*       _slab_end[SIZE_CLASSES];
+  size_t      _memory;
+  // Contents
+  Node*       _root;
+  size_t      _size;
+  static size_t nodeSize(int size_class) {
+    return sizeof(Node) + ((2 << size_class) - 1) * sizeof(void*);
+  }
+  static int getIndex(char c) {
+    return c >= 'a' ? c - 'a' + 10: c >= 'A' ? c - 'A' + 10 : c != '-' ? c - '0' : 0;
+  }
+  static const char* hashOf(const void* hobj) {
+    return static_cast<const char*>(*static_cast<const T*>(hobj));
+  }
+  Node* allocNode(int size_class);
+  void freeNode(Node* node) {
+    int size_class = node->size_class;
+    *reinterpret_cast<void**>(node) = _free[size_class];
+    _free[size_class] = node;
+  }
+  Node* insert(Node* node, int i, void* child, bool leaf);
+  Node* erase(Node* node, int i);
+  Node* split(T* a, T* b, int level);
+  T* first(const Node* node) const;
+  T* after(const Node* node, const char* hash, int level) const;
+  void deleteObjects(Node* node);
+  void show(const Node* node, int level) const;
+  CompactHashTree(const CompactHashTree&);
+  const CompactHashTree& operator=(const CompactHashTree&);
+public:
+  CompactHashTree() : _slabs(NULL), _memory(0), _root(NULL), _size(0) {
+    for (int i = 0; i < SIZE_CLASSES; ++i) {
+      _free[i] = NULL;
+      _slab_pos[i] = NULL;
+      _slab_end[i] = NULL;
+    }
+  }
+  // Deletes all objects
+  ~CompactHashTree() {
+    if (_root != NULL) {
+      deleteObjects(_root);
+    }
+    while (_slabs != NULL) {
+      Slab* next = _slabs->next;
+      free(_slabs);
+      _slabs = next;
+    }
+  }
+  // Return existing leaf
+  T* add(T* hobj);
+  T* find(const char* hash) const;
+  T* find(const T* hobj) const {
+    return this->find(static_cast<const char*>(*hobj));
+  }
+  T* remove(const char* hash);
+  T* remove(const T* hobj) {
+    return this->remove(static_cast<const char*>(*hobj));
+  }
+  // First object after hash, or first object if hash is NULL
+  T* next(const char* hash) const;
+  T* next(const T* hobj) const {
+    return this->next(hobj == NULL ? NULL : static_cast<const char*>(*hobj));
+  }
+  // Number of objects
+  size_t size() const { return _size; }
+  // Memory allocated for nodes
+  size_t memory() const { return _memory; }
+  void show() const {
+    if (_root != NULL) {
+      show(_root, 0);
+    }
+  }
+};
+
+template<class T>
+typename CompactHashTree<T>::Node* CompactHashTree<T>::allocNode(
+    int size_class) {
+  Node* node;
+  if (_free[size_class] != NULL) {
+    node = static_cast<Node*>(_free[size_class]);
+    _free[size_class] = *static_cast<void**>(_free[size_class]);
+  } else {
+    size_t size = nodeSize(size_class);
+    if (static_cast<size_t>(_slab_end[size_class] - _slab_pos[size_class]) <
+        size) {
+      Slab* slab = static_cast<Slab*>(malloc(SLAB_SIZE));
+      if (slab == NULL) {
+        throw std::bad_alloc();
+      }
+      slab->next = _slabs;
+      _slabs = slab;
+      _memory += SLAB_SIZE;
+      _slab_pos[size_class] = reinterpret_cast<char*>(slab) + sizeof(Slab);
+      _slab_end[size_class] = reinterpret_cast<char*>(slab) + SLAB_SIZE;
+    }
+    node = reinterpret_cast<Node*>(_slab_pos[size_class]);
+    _slab_pos[size_class] += size;
+  }
+  node->mask = 0;
+  node->leaves = 0;
+  node->size_class = static_cast<uint8_t>(size_class);
+  return node;
+}
+
+// Returns the node, which may have moved to make room
+template<class T>
+typename CompactHashTree<T>::Node* CompactHashTree<T>::insert(
+    Node* node, int i, void* child, bool leaf) {
+  int count = node->count();
+  int pos = node->position(i);
+  if (count == (2 << node->size_class)) {
+    Node* bigger = allocNode(node->size_class + 1);
+    bigger->mask = node->mask;
+    bigger->leaves = node->leaves;
+    memcpy(bigger->children, node->children, count * sizeof(void*));
+    freeNode(node);
+    node = bigger;
+  }
+  memmove(&node->children[pos + 1], &node->children[pos],
+    (count - pos) * sizeof(void*));
+  node->children[pos] = child;
+  node->mask = static_cast<uint16_t>(node->mask | (1 << i));
+  if (leaf) {
+    node->leaves = static_cast<uint16_t>(node->leaves | (1 << i));
+  }
+  return node;
+}
+
+// Returns the node, or NULL if it was freed because empty
+template<class T>
+typename CompactHashTree<T>::Node* CompactHashTree<T>::erase(
+    Node* node, int i) {
+  int count = node->count();
+  int pos = node->position(i);
+  memmove(&node->children[pos], &node->children[pos + 1],
+    (count - pos - 1) * sizeof(void*));
+  node->mask = static_cast<uint16_t>(node->mask & ~(1 << i));
+  node->leaves = static_cast<uint16_t>(node->leaves & ~(1 << i));
+  if (node->mask == 0) {
+    freeNode(node);
+    return NULL;
+  }
+  return node;
+}
+
+// Create the node(s) needed to tell both objects apart
+template<class T>
+typename CompactHashTree<T>::Node* CompactHashTree<T>::split(
+    T* a, T* b, int level) {
+  Node* node = allocNode(0);
+  int ia = getIndex(static_cast<const char*>(*a)[level]);
+  int ib = getIndex(static_cast<const char*>(*b)[level]);
+  if (ia == ib) {
+    node->mask = static_cast<uint16_t>(1 << ia);
+    node->children[0] = split(a, b, level + 1);
+  } else {
+    node->mask = static_cast<uint16_t>((1 << ia) | (1 << ib));
+    node->leaves = node->mask;
+    node->children[ia < ib ? 0 : 1] = a;
+    node->children[ia < ib ? 1 : 0] = b;
+  }
+  return node;
+}
+
+template<class T>
+T* CompactHashTree<T>::add(T* hobj) {
+  const char* hash = static_cast<const char*>(*hobj);
+  if (_root == NULL) {
+    _root = allocNode(0);
+  }
+  // Where the current node's pointer is stored, in case it moves
+  Node** node_p = &_root;
+  int level = 0;
+  while (true) {
+    Node* node = *node_p;
+    int i = getIndex(hash[level]);
+    if (! node->has(i)) {
+      *node_p = insert(node, i, hobj, true);
+      ++_size;
+      return NULL;
+    }
+    void** child_p = &node->children[node->position(i)];
+    if (node->isLeaf(i)) {
+      T* leaf = static_cast<T*>(*child_p);
+      if (strcasecmp(static_cast<const char*>(*leaf), hash) == 0) {
+        return leaf;
+      }
+      *child_p = split(leaf, hobj, level + 1);
+      node->leaves = static_cast<uint16_t>(node->leaves & ~(1 << i));
+      ++_size;
+      return NULL;
+    }
+    node_p = reinterpret_cast<Node**>(child_p);
+    ++level;
+  }
+}
+
+template<class T>
+T* CompactHashTree<T>::find(const char* hash) const {
+  const Node* node = _root;
+  if (node == NULL) {
+    return NULL;
+  }
+  int level = 0;
+  while (true) {
+    int i = getIndex(hash[level]);
+    if (! node->has(i)) {
+      return NULL;
+    }
+    void* child = node->get(i);
+    if (node->isLeaf(i)) {
+      T* leaf = static_cast<T*>(child);
+      return strcasecmp(static_cast<const char*>(*leaf), hash) == 0 ?
+        leaf : NULL;
+    }
+    node = static_cast<const Node*>(child);
+    ++level;
+  }
+}
+
+template<class T>
+T* CompactHashTree<T>::remove(const char* hash) {
+  if (_root == NULL) {
+    return NULL;
+  }
+  // Path from the root, as pointers to where each node's pointer is stored
+  Node** path[128];
+  int level = 0;
+  path[0] = &_root;
+  T* obsolete = NULL;
+  int i;
+  while (true) {
+    Node* node = *path[level];
+    i = getIndex(hash[level]);
+    if (! node->has(i)) {
+      return NULL;
+    }
+    void** child_p = &node->children[node->position(i)];
+    if (node->isLeaf(i)) {
+      obsolete = static_cast<T*>(*child_p);
+      if (strcasecmp(static_cast<const char*>(*obsolete), hash) != 0) {
+        return NULL;
+      }
+      break;
+    }
+    if (level == 127) {
+      return NULL;
+    }
+    path[++level] = reinterpret_cast<Node**>(child_p);
+  }
+  --_size;
+  Node* node = erase(*path[level], i);
+  *path[level] = node;
+  // Empty or single leaf nodes are replaced by what they hold (root excepted)
+  while (level > 0) {
+    Node* parent = *path[level - 1];
+    int pi = getIndex(hash[level - 1]);
+    if (node == NULL) {
+      node = erase(parent, pi);
+      *path[--level] = node;
+    } else
+    if ((node->count() == 1) && (node->leaves == node->mask)) {
+      *reinterpret_cast<void**>(path[level]) = node->children[0];
+      parent->leaves = static_cast<uint16_t>(parent->leaves | (1 << pi));
+      freeNode(node);
+      node = parent;
+      --level;
+    } else {
+      break;
+    }
+  }
+  return obsolete;
+}
+
+template<class T>
+T* CompactHashTree<T>::first(const Node* node) const {
+  while (node != NULL) {
+    int i = __builtin_ctz(node->mask);
+    if (node->isLeaf(i)) {
+      return static_cast<T*>(node->children[0]);
+    }
+    node = static_cast<const Node*>(node->children[0]);
+  }
+  return NULL;
+}
+
+template<class T>
+T* CompactHashTree<T>::after(const Node* node, const char* hash,
+    int level) const {
+  int i = getIndex(hash[level]);
+  if (node->has(i)) {
+    void* child = node->get(i);
+    if (node->isLeaf(i)) {
+      T* leaf = static_cast<T*>(child);
+      if (strcasecmp(static_cast<const char*>(*leaf), hash) > 0) {
+        return leaf;
+      }
+    } else {
+      T* found = after(static_cast<const Node*>(child), hash, level + 1);
+      if (found != NULL) {
+        return found;
+      }
+    }
+  }
+  // First child after i
+  uint16_t later = static_cast<uint16_t>(node->mask & ~((2 << i) - 1));
+  if (later == 0) {
+    return NULL;
+  }
+  int j = __builtin_ctz(later);
+  void* child = node->get(j);
+  if (node->isLeaf(j)) {
+    return static_cast<T*>(child);
+  }
+  return first(static_cast<const Node*>(child));
+}
+
+template<class T>
+T* CompactHashTree<T>::next(const char* hash) const {
+  if (_root == NULL) {
+    return NULL;
+  }
+  if (hash == NULL) {
+    return first(_root);
+  }
+  return after(_root, hash, 0);
+}
+
+template<class T>
+void CompactHashTree<T>::deleteObjects(Node* node) {
+  int count = node->count();
+  for (int i = 0, pos = 0; pos < count; ++i) {
+    if (node->has(i)) {
+      if (node->isLeaf(i)) {
+        delete static_cast<T*>(node->children[pos]);
+      } else {
+        deleteObjects(static_cast<Node*>(node->children[pos]));
+      }
+      ++pos;
+    }
+  }
+}
+
+template<class T>
+void CompactHashTree<T>::show(const Node* node, int level) const {
+  ++level;
+  for (int i = 0; i < 16; ++i) {
+    if (node->has(i)) {
+      if (node->isLeaf(i)) {
+        hlog_verbose_arrow(level, "[%x] %s", i, hashOf(node->get(i)));
+      } else {
+        hlog_verbose_arrow(level, "[%x] (node)", i);
+        show(static_cast<const Node*>(node->get(i)), level);
+      }
+    }
+  }
+}
+
+}
+
+#endif // _COMPACT_HASH_TREE_H
@@ -0,0 +1,518 @@
+/*
+     Copyright (C) 2011  Hervé Fache
+
+     This program is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License version 2 as
+     published by the Free Software Foundation.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program; if not, write to the Free Software
+     Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+#ifndef _CONCURRENT_HASH_TREE_H
+#define _CONCURRENT_HASH_TREE_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include <new>
+#include <vector>
+
+#include <report.h>
+
+namespace htoolbox {
+
+// HashTree for many readers and some writers:
+// * find() and next() take no lock: nodes are never modified, but for the
+//   pointers to their child nodes, so a writer copies the node it changes
+//   and then replaces the pointer to it;
+// * replaced nodes are only freed once all readers that may still see them
+//   are done, which readers announce using per-epoch counters;
+// * writers lock the sub-tree of the first hash character, so at most 16
+//   writers can work at the same time.
+// Objects removed from the tree are handed back at once, so they must only
+// be deleted after a call to synchronize().
+// The class T must implement the following operator for this to work:
+//   operator const char*() const { return hash; }
+
+template<class T>
+class ConcurrentHashTree {
+  // Never modified once published, but for pointers to child nodes
+  struct Node {
+    uint16_t  mask;         // Bit mask: 1 means child exists
+    uint16_t  leaves;       // Bit mask: 1 means child is hobj
+    void*     children[1];  // Children that exist, in index order
+    int count() const {
+      return __builtin_popcount(mask);
+    }
+    int position(int i) const {
+      return __builtin_popcount(mask & ((1 << i) - 1));
+    }
+    bool has(int i) const     { return (mask & (1 << i)) != 0; }
+    bool isLeaf(int i) const  { return (leaves & (1 << i)) != 0; }
+  };
+  enum {
+    READER_SLOTS = 64,      // Readers counters, to share cache lines less
+    RETIRED_MAX = 1024      // Number of replaced nodes that triggers freeing
+  };
+  struct ReaderSlot {
+    unsigned long count;
+    char          padding[64 - sizeof(unsigned long)];
+  };
+  // One sub-tree per first hash character
+  Node*               _roots[16];
+  pthread_mutex_t     _locks[16];
+  // Readers
+  unsigned long       _epoch;
+  ReaderSlot          _readers[2][READER_SLOTS];
+  // Replaced nodes
+  std::vector<Node*>  _retired;
+  pthread_mutex_t     _retired_lock;
+  pthread_mutex_t     _reclaim_lock;
+  static int getIndex(char c) {
+    return c >= 'a' ? c - 'a' + 10: c >= 'A' ? c - 'A' + 10 : c != '-' ? c - '0' : 0;
+  }
+  template<typename P>
+  static P load(P const* p) {
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+  }
+  template<typename P>
+  static void store(P* p, P v) {
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+  }
+  // Read-side critical sections
+  static size_t readerSlot();
+  unsigned long* enter() const;
+  static void leave(unsigned long* counter) {
+    __atomic_fetch_sub(counter, 1, __ATOMIC_SEQ_CST);
+  }
+  static Node* allocNode(int count) {
+    void* p = malloc(sizeof(Node) + (count > 0 ? count - 1 : 0) *
+      sizeof(void*));
+    if (p == NULL) {
+      throw std::bad_alloc();
+    }
+    return static_cast<Node*>(p);
+  }
+  // Copy of node with child i added, replaced or removed (child NULL)
+  static Node* copyNode(const Node* node, int i, void* child, bool leaf);
+  Node* split(T* a, T* b, int level);
+  void retire(Node* node);
+  T* first(const Node* node) const;
+  T* after(const Node* node, const char* hash, int level) const;
+  void deleteAll(Node* node);
+  void show(const Node* node, int level) const;
+  ConcurrentHashTree(const ConcurrentHashTree&);
+  const ConcurrentHashTree& operator=(const ConcurrentHashTree&);
+public:
+  ConcurrentHashTree() : _epoch(0) {
+    for (int i = 0; i < 16; ++i) {
+      _roots[i] = NULL;
+      pthread_mutex_init(&_locks[i], NULL);
+    }
+    for (int i = 0; i < READER_SLOTS; ++i) {
+      _readers[0][i].count = 0;
+      _readers[1][i].count = 0;
+    }
+    pthread_mutex_init(&_retired_lock, NULL);
+    pthread_mutex_init(&_reclaim_lock, NULL);
+  }
+  // Deletes all objects, no other thread may be using the tree
+  ~ConcurrentHashTree() {
+    for (int i = 0; i < 16; ++i) {
+      if (_roots[i] != NULL) {
+        deleteAll(_roots[i]);
+      }
+      pthread_mutex_destroy(&_locks[i]);
+    }
+    for (size_t i = 0; i < _retired.size(); ++i) {
+      free(_retired[i]);
+    }
+    pthread_mutex_destroy(&_reclaim_lock);
+    pthread_mutex_destroy(&_retired_lock);
+  }
+  // Return existing leaf
+  T* add(T* hobj);
+  T* find(const char* hash) const;
+  T* find(const T* hobj) const {
+    return this->find(static_cast<const char*>(*hobj));
+  }
+  T* remove(const char* hash);
+  T* remove(const T* hobj) {
+    return this->remove(static_cast<const char*>(*hobj));
+  }
+  // First object after hash, or first object if hash is NULL
+  T* next(const char* hash) const;
+  T* next(const T* hobj) const {
+    return this->next(hobj == NULL ? NULL : static_cast<const char*>(*hobj));
+  }
+  // Wait for all current readers to be done, and free replaced nodes
+  void synchronize();
+  // Not thread-safe
+  void show() const {
+    for (int i = 0; i < 16; ++i) {
+      if (_roots[i] != NULL) {
+        hlog_verbose_arrow(1, "[%x] (node)", i);
+        show(_roots[i], 1);
+      }
+    }
+  }
+};
+
+// Threads get slots in turn on their first read, so up to READER_SLOTS readers
+// never share a counter
+template<class T>
+size_t ConcurrentHashTree<T>::readerSlot() {
+  static size_t next = 0;
+  // 0 until assigned
+  static __thread size_t slot = 0;
+  if (slot == 0) {
+    slot = __atomic_add_fetch(&next, 1, __ATOMIC_RELAXED);
+  }
+  return (slot - 1) % READER_SLOTS;
+}
+
+template<class T>
+unsigned long* ConcurrentHashTree<T>::enter() const {
+  size_t slot = readerSlot();
+  ConcurrentHashTree<T>* self = const_cast<ConcurrentHashTree<T>*>(this);
+  while (true) {
+    unsigned long epoch = __atomic_load_n(&_epoch, __ATOMIC_SEQ_CST);
+    unsigned long* counter = &self->_readers[epoch & 1][slot].count;
+    __atomic_fetch_add(counter, 1, __ATOMIC_SEQ_CST);
+    // The epoch must not have changed meanwhile, or synchronize() may miss us
+    if (__atomic_load_n(&_epoch, __ATOMIC_SEQ_CST) == epoch) {
+      return counter;
+    }
+    leave(counter);
+  }
+}
+
+template<class T>
+typename ConcurrentHashTree<T>::Node* ConcurrentHashTree<T>::copyNode(
+    const Node* node, int i, void* child, bool leaf) {
+  int count = node->count();
+  int pos = node->position(i);
+  bool had = node->has(i);
+  int new_count = count + (child == NULL ? -1 : 0) + (had ? 0 : 1);
+  Node* copy = allocNode(new_count);
+  copy->mask = node->mask;
+  copy->leaves = static_cast<uint16_t>(node->leaves & ~(1 << i));
+  // Children before i
+  for (int j = 0; j < pos; ++j) {
+    copy->children[j] = load(&node->children[j]);
+  }
+  int from = had ? pos + 1 : pos;
+  int to = pos;
+  if (child != NULL) {
+    copy->children[to++] = child;
+    copy->mask = static_cast<uint16_t>(copy->mask | (1 << i));
+    if (leaf) {
+      copy->leaves = static_cast<uint16_t>(copy->leaves | (1 << i));
+    }
+  } else {
+    copy->mask = static_cast<uint16_t>(copy->mask & ~(1 << i));
+  }
+  // Children after i
+  for (; from < count; ++from, ++to) {
+    copy->children[to] = load(&node->children[from]);
+  }
+  return copy;
+}
+
+template<class T>
+typename ConcurrentHashTree<T>::Node* ConcurrentHashTree<T>::split(
+    T* a, T* b, int level) {
+  int ia = getIndex(static_cast<const char*>(*a)[level]);
+  int ib = getIndex(static_cast<const char*>(*b)[level]);
+  if (ia == ib) {
+    Node* node = allocNode(1);
+    node->mask = static_cast<uint16_t>(1 << ia);
+    node->leaves = 0;
+    node->children[0] = split(a, b, level + 1);
+    return node;
+  }
+  Node* node = allocNode(2);
+  node->mask = static_cast<uint16_t>((1 << ia) | (1 << ib));
+  node->leaves = node->mask;
+  node->children[ia < ib ? 0 : 1] = a;
+  node->children[ia < ib ? 1 : 0] = b;
+  return node;
+}
+
+template<class T>
+void ConcurrentHashTree<T>::retire(Node* node) {
+  pthread_mutex_lock(&_retired_lock);
+  _retired.push_back(node);
+  bool full = _retired.size() >= RETIRED_MAX;
+  pthread_mutex_unlock(&_retired_lock);
+  if (full) {
+    synchronize();
+  }
+}
+
+template<class T>
+void ConcurrentHashTree<T>::synchronize() {
+  pthread_mutex_lock(&_reclaim_lock);
+  // Nodes replaced so far, which readers from the current epoch may see
+  std::vector<Node*> retired;
+  pthread_mutex_lock(&_retired_lock);
+  retired.swap(_retired);
+  pthread_mutex_unlock(&_retired_lock);
+  unsigned long epoch = __atomic_fetch_add(&_epoch, 1, __ATOMIC_SEQ_CST);
+  // New readers use the other counters
+  for (int i = 0; i < READER_SLOTS; ++i) {
+    while (__atomic_load_n(&_readers[epoch & 1][i].count,
+        __ATOMIC_SEQ_CST) != 0) {
+      sched_yield();
+    }
+  }
+  pthread_mutex_unlock(&_reclaim_lock);
+  for (size_t i = 0; i < retired.size(); ++i) {
+    free(retired[i]);
+  }
+}
+
+template<class T>
+T* ConcurrentHashTree<T>::add(T* hobj) {
+  const char* hash = static_cast<const char*>(*hobj);
+  int s = getIndex(hash[0]);
+  pthread_mutex_lock(&_locks[s]);
+  // Where the current node's pointer is stored
+  Node** node_p = &_roots[s];
+  int level = 1;
+  T* found = NULL;
+  while (true) {
+    Node* node = *node_p;
+    int i = getIndex(hash[level]);
+    if (node == NULL) {
+      node = allocNode(1);
+      node->mask = static_cast<uint16_t>(1 << i);
+      node->leaves = node->mask;
+      node->children[0] = hobj;
+      store(node_p, node);
+      break;
+    }
+    if (! node->has(i)) {
+      store(node_p, copyNode(node, i, hobj, true));
+      retire(node);
+      break;
+    }
+    void** child_p = &node->children[node->position(i)];
+    if (node->isLeaf(i)) {
+      T* leaf = static_cast<T*>(*child_p);
+      if (strcasecmp(static_cast<const char*>(*leaf), hash) == 0) {
+        found = leaf;
+      } else {
+        store(node_p, copyNode(node, i, split(leaf, hobj, level + 1), false));
+        retire(node);
+      }
+      break;
+    }
+    node_p = reinterpret_cast<Node**>(child_p);
+    ++level;
+  }
+  pthread_mutex_unlock(&_locks[s]);
+  return found;
+}
+
+template<class T>
+T* ConcurrentHashTree<T>::find(const char* hash) const {
+  unsigned long* counter = enter();
+  const Node* node = load(&_roots[getIndex(hash[0])]);
+  int level = 1;
+  T* found = NULL;
+  while (node != NULL) {
+    int i = getIndex(hash[level]);
+    if (! node->has(i)) {
+      break;
+    }
+    void* child = load(&node->children[node->position(i)]);
+    if (node->isLeaf(i)) {
+      T* leaf = static_cast<T*>(child);
+      if (strcasecmp(static_cast<const char*>(*leaf), hash) == 0) {
+        found = leaf;
+      }
+      break;
+    }
+    node = static_cast<const Node*>(child);
+    ++level;
+  }
+  leave(counter);
+  return found;
+}
+
+template<class T>
+T* ConcurrentHashTree<T>::remove(const char* hash) {
+  int s = getIndex(hash[0]);
+  pthread_mutex_lock(&_locks[s]);
+  // Path from the sub-tree root, as where each node's pointer is stored
+  Node** path[128];
+  int level = 0;
+  path[0] = &_roots[s];
+  T* obsolete = NULL;
+  while (*path[level] != NULL) {
+    Node* node = *path[level];
+    int i = getIndex(hash[level + 1]);
+    if (! node->has(i)) {
+      break;
+    }
+    void** child_p = &node->children[node->position(i)];
+    if (node->isLeaf(i)) {
+      T* leaf = static_cast<T*>(*child_p);
+      if (strcasecmp(static_cast<const char*>(*leaf), hash) == 0) {
+        obsolete = leaf;
+      }
+      break;
+    }
+    if (level == 126) {
+      break;
+    }
+    path[++level] = reinterpret_cast<Node**>(child_p);
+  }
+  if (obsolete != NULL) {
+    // Replace the child by nothing, or a node by its single leaf
+    Node* replaced[128];
+    int replaced_count = 0;
+    void* child = NULL;
+    bool leaf = false;
+    while (true) {
+      Node* node = *path[level];
+      replaced[replaced_count++] = node;
+      Node* copy = NULL;
+      int i = getIndex(hash[level + 1]);
+      if ((child != NULL) || (node->count() > 1)) {
+        copy = copyNode(node, i, child, leaf);
+      }
+      if ((level > 0) && ((copy == NULL) ||
+          ((copy->count() == 1) && (copy->leaves == copy->mask)))) {
+        // Parent must change too
+        child = copy == NULL ? NULL : copy->children[0];
+        leaf = child != NULL;
+        free(copy);
+        --level;
+        continue;
+      }
+      store(path[level], copy);
+      break;
+    }
+    // Only now are they out of reach for new readers
+    for (int i = 0; i < replaced_count; ++i) {
+      retire(replaced[i]);
+    }
+  }
+  pthread_mutex_unlock(&_locks[s]);
+  return obsolete;
+}
+
+template<class T>
+T* ConcurrentHashTree<T>::first(const Node* node) const {
+  while (node != NULL) {
+    int i = __builtin_ctz(node->mask);
+    void* child = load(&node->children[0]);
+    if (node->isLeaf(i)) {
+      return static_cast<T*>(child);
+    }
+    node = static_cast<const Node*>(child);
+  }
+  return NULL;
+}
+
+template<class T>
+T* ConcurrentHashTree<T>::after(const Node* node, const char* hash,
+    int level) const {
+  int i = getIndex(hash[level]);
+  if (node->has(i)) {
+    void* child = load(&node->children[node->position(i)]);
+    if (node->isLeaf(i)) {
+      T* leaf = static_cast<T*>(child);
+      if (strcasecmp(static_cast<const char*>(*leaf), hash) > 0) {
+        return leaf;
+      }
+    } else {
+      T* found = after(static_cast<const Node*>(child), hash, level + 1);
+      if (found != NULL) {
+        return found;
+      }
+    }
+  }
+  // First child after i
+  uint16_t later = static_cast<uint16_t>(node->mask & ~((2 << i) - 1));
+  if (later == 0) {
+    return NULL;
+  }
+  int j = __builtin_ctz(later);
+  void* child = load(&node->children[node->position(j)]);
+  if (node->isLeaf(j)) {
+    return static_cast<T*>(child);
+  }
+  return first(static_cast<const Node*>(child));
+}
+
+template<class T>
+T* ConcurrentHashTree<T>::next(const char* hash) const {
+  unsigned long* counter = enter();
+  T* found = NULL;
+  int s = 0;
+  if (hash != NULL) {
+    s = getIndex(hash[0]);
+    const Node* node = load(&_roots[s]);
+    if (node != NULL) {
+      found = after(node, hash, 1);
+    }
+    ++s;
+  }
+  for (; (found == NULL) && (s < 16); ++s) {
+    found = first(load(&_roots[s]));
+  }
+  leave(counter);
+  return found;
+}
+
+template<class T>
+void ConcurrentHashTree<T>::deleteAll(Node* node) {
+  int count = node->count();
+  for (int i = 0, pos = 0; pos < count; ++i) {
+    if (node->has(i)) {
+      if (node->isLeaf(i)) {
+        delete static_cast<T*>(node->children[pos]);
+      } else {
+        deleteAll(static_cast<Node*>(node->children[pos]));
+      }
+      ++pos;
+    }
+  }
+  free(node);
+}
+
+template<class T>
+void ConcurrentHashTree<T>::show(const Node* node, int level) const {
+  ++level;
+  for (int i = 0, pos = 0; i < 16; ++i) {
+    if (node->has(i)) {
+      void* child = node->children[pos++];
+      if (node->isLeaf(i)) {
+        hlog_verbose_arrow(level, "[%x] %s", i,
+          static_cast<const char*>(*static_cast<const T*>(child)));
+      } else {
+        hlog_verbose_arrow(level, "[%x] (node)", i);
+        show(static_cast<const Node*>(child), level);
+      }
+    }
+  }
+}
+
+}
+
+#endif // _CONCURRENT_HASH_TREE_H
@@ -0,0 +1,73 @@
+/*
+    Copyright (C) 2011  Hervé Fache
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 3.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _DIR_READER_H
+#define _DIR_READER_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+namespace htoolbox {
+
+//! \brief Directory entries reader
+/*!
+  Reads all entries of a directory at once, using getdents64 into a buffer
+  that is kept for the next directory, and sorts them by name ('.' and '..'
+  are skipped).  Entries can then be stat'ed relative to the directory, so no
+  full path needs to be built.  Re-using the same object for many directories
+  avoids almost all heap allocations.
+*/
+class DirReader {
+  struct         Private;
+  Private* const _d;
+  DirReader(const DirReader&);
+  const DirReader& operator=(const DirReader&);
+public:
+  DirReader();
+  ~DirReader();
+  //! \brief Open directory and read its entries
+  /*!
+    \param path         the path of the directory
+    \return the number of entries on success, -1 on failure
+  */
+  int open(const char* path);
+  //! \brief Close directory, keeping the buffers
+  /*!
+    Entries names and types remain available until the next open().
+  */
+  int close();
+  //! \brief Number of entries read
+  size_t size() const;
+  //! \brief Name of given entry
+  const char* name(size_t index) const;
+  //! \brief Type of given entry, as for dirent's d_type
+  /*!
+    DT_UNKNOWN is returned when the filesystem does not provide it, so callers
+    which only need the type must then call stat().
+  */
+  unsigned char type(size_t index) const;
+  //! \brief Get metadata of given entry, not following links
+  /*!
+    This and readlink() need the directory to be open.
+  */
+  int stat(size_t index, struct stat64* metadata) const;
+  //! \brief Read target of given entry, which must be a symbolic link
+  ssize_t readlink(size_t index, char* buffer, size_t size) const;
+};
+
+}
+
+#endif // _DIR_READER_H
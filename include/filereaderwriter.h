@@ -42,8 +42,50 @@ public:
   ssize_t read(void* buffer, size_t size);
   ssize_t get(void* buffer, size_t size);
   ssize_t put(const void* buffer, size_t size);
+  //! \brief Read into several buffers, with as few readv() calls as possible
+  ssize_t getv(const struct iovec* iov, int count);
+  //! \brief Write several buffers, with as few writev() calls as possible
+  ssize_t putv(const struct iovec* iov, int count);
   const char* path() const;
   int64_t offset() const { return _offset; }
+  //! \brief Move to given offset
+  /*!
+   * If called before open(), the stream will be opened at the given offset,
+   * and a writer will then keep the data before it rather than truncate the
+   * file: this allows to resume an interrupted copy, see Hasher::resume().
+   * \param offset      offset from the start of the file
+   * \return            0 on success, -1 on failure
+  */
+  int seek(int64_t offset);
+  //! \brief Read through a memory mapping rather than with read()
+  /*!
+   * The file is mapped one window at a time, and peek() lends the mapped
+   * pages, so reading the file with peek()/advance() (e.g. through a Hasher)
+   * costs no copy from the page cache.  The file must not be truncated while
+   * being read.  Files that cannot be mapped (pipes, devices, files of no
+   * known size like those in /proc, or on filesystems without mmap support)
+   * are read with read().  Must be called before open(), ignored for writers.
+   * \param window_size size of the part of the file mapped at once, rounded up
+   *                    to whole pages, 0 to use read() (default)
+  */
+  void setMapped(size_t window_size);
+  //! \brief Write with O_DIRECT, bypassing the page cache
+  /*!
+   * The data is staged in an aligned buffer, written when full, and the last
+   * part is written without O_DIRECT at close().  reserve() lends the staging
+   * buffer.  If the filesystem refuses O_DIRECT, or the file is opened at an
+   * unaligned offset, the data is written through the page cache instead.
+   * Must be called before open(), ignored for readers.
+   * \param buffer_size size of the staging buffer, rounded up to whole 4 KiB
+   *                    blocks, 0 to write through the page cache (default)
+  */
+  void setDirect(size_t buffer_size);
+  //! \brief Lend data read into a buffer of this object's, or mapped
+  ssize_t peek(const void** buffer, size_t size);
+  ssize_t advance(size_t size);
+  //! \brief Lend a buffer of this object's, written to the file at commit()
+  ssize_t reserve(void** buffer, size_t size);
+  ssize_t commit(size_t size);
 };
 
 };
@@ -135,6 +135,7 @@ public:
         _link(NULL),
         _nodes(NULL) {
       _basename = basename(_path);
+      _hash[0] = '\0';
       if (_type == 'l') {
         _link = strdup(link_or_hash);
       } else
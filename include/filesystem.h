@@ -28,7 +28,34 @@
 
 namespace htoolbox {
 
+  class DirReader;
   struct FsNodeDir;
+  struct FsNodeIndex;
+
+  //! \brief Bump allocator for the nodes of a tree and their strings
+  /*!
+    Memory is only given back all at once, by release() or on destruction.
+    Allocations may be made from several threads: each fills its own chunk,
+    so only locks to get a new one.
+  */
+  class FsArena {
+    struct         Private;
+    Private* const _d;
+    FsArena(const FsArena&);
+    const FsArena& operator=(const FsArena&);
+  public:
+    FsArena();
+    ~FsArena();
+    //! \brief Allocate memory, aligned for any node
+    void* alloc(size_t size);
+    //! \brief Copy string
+    char* strdup(const char* string);
+    //! \brief Give back all memory
+    void release();
+    //! \brief Memory currently allocated from the system
+    size_t size() const;
+  };
+
   //! \brief Structure to hold a generic file metadata
   /*!
     Lists contents, using the given parameters as filters.
@@ -47,17 +74,24 @@ namespace htoolbox {
     ~FsNode();
     //! \brief Create root node
     /*!
-      \param name         the name/path of the root node, if relevant
+      With use_arena, the tree's nodes and strings are allocated from an
+      arena owned by the root node, and freed all at once when it is cleared
+      or deleted.
+      \param path         the name/path of the root node, if relevant
+      \param use_arena    whether to allocate the tree's nodes from an arena
       \return the node on success, NULL on failure
     */
-    static FsNodeDir* createRoot(const char* path = NULL);
+    static FsNodeDir* createRoot(const char* path = NULL,
+      bool use_arena = false);
     //! \brief Create node from filesystem path
     /*!
       \param path         the path on the filesystem
       \param dev          the device to check this file's against
+      \param arena        the arena to allocate from, if any
       \return the node on success, NULL on failure
     */
-    static FsNode* createNode(const char* path, dev_t dev = 0);
+    static FsNode* createNode(const char* path, dev_t dev = 0,
+      FsArena* arena = NULL);
     //! \brief Add child to directory
     /*!
       \param node         the node
@@ -73,29 +107,77 @@ namespace htoolbox {
     FsNode* createChild(const char* name, char type);
     //! \brief Get node from path
     /*!
+      Directories with many children get a hashed index as children are
+      added, so the time taken only depends on the depth of the path.  Look-ups
+      do not modify the tree, so may be made from several threads.
       \param path         file system path
+      \param create_missing create missing directories on the way
       \return the node on success, NULL on failure
     */
     FsNode* getNode(const char* path, bool create_missing = false);
     static const mode_t dev_changed_bit = 0200000;
     static const mode_t read_issue_bit = 0400000;
-    static const mode_t bits_mask = dev_changed_bit | read_issue_bit;
+    static const mode_t arena_bit = 01000000;
+    static const mode_t bits_mask = dev_changed_bit | read_issue_bit |
+      arena_bit;
+    //! \brief Mode as given by stat(), without the above bits
+    mode_t statMode() const { return mode & ~bits_mask; }
     bool deviceChanged() const { return (mode & dev_changed_bit) != 0; }
     bool readFailed() const { return (mode & read_issue_bit) != 0; }
     void show(int level = 0) const;
   protected:
-    FsNode(const char* name, mode_t mode = 0);
+    FsNode(const char* name, mode_t mode = 0, FsArena* arena = NULL);
   };
 
   //! \brief Structure to hold a directory metadata and the head of its list
   /*!
     Lists contents, using the given parameters as filters.
     \param children_head head of contained files list
+    \param arena        where to allocate children from, if not NULL
+    \param index        children hashed by name, if any
+    \param children     number of children
   */
   struct FsNodeDir : public FsNode {
     FsNode*       children_head;
-    FsNodeDir(const char* name): FsNode(name, S_IFDIR), children_head(NULL) {}
+    FsArena*      arena;
+    FsNodeIndex*  index;
+    size_t        children;
+    //! Number of children from which they get indexed, 0 for never
+    static size_t index_threshold;
+    FsNodeDir(const char* name, FsArena* a = NULL):
+      FsNode(name, S_IFDIR, a), children_head(NULL), arena(a), index(NULL),
+      children(0) {}
     int read(const char* path, dev_t dev = 0);
+    //! \brief Read directory using given reader
+    /*!
+      Same as above, but re-using the reader's buffers.
+      \param reader       the directory reader to use
+      \param path         the path of this directory on the filesystem
+      \param dev          the device to check this directory's entries against
+      \return 0 on success, -1 on failure
+    */
+    int read(DirReader& reader, const char* path, dev_t dev = 0);
+    //! \brief Read directory and all its sub-directories
+    /*!
+      Directories are read and their entries stat'ed by a pool of threads.
+      The resulting tree does not depend on the number of threads: each
+      directory's children are sorted by name, as per read().
+      Directories on another device than dev are flagged as for read() and
+      not descended into, those which cannot be read are flagged with
+      read_issue_bit and the scan goes on.
+      \param path         the path of this directory on the filesystem
+      \param dev          the device to stay on, 0 to cross devices
+      \param threads      number of threads to use, 0 for one per CPU
+      \return 0 on success, -1 if any directory could not be read
+    */
+    int readTree(const char* path, dev_t dev = 0, size_t threads = 0);
+    //! \brief Remove all children
+    /*!
+      Children must only be added using addChild() or createChild(), and
+      removed using clear(), for the index to remain valid.
+      Children allocated from an arena are only freed when the arena's owner,
+      the root, is cleared or deleted.
+    */
     void clear();
   };
 
@@ -108,8 +190,8 @@ namespace htoolbox {
   struct FsNodeNotDir : public FsNode {
     off_t           size;
     time_t          mtime;
-    FsNodeNotDir(const char* name, mode_t mode = 0):
-      FsNode(name, mode), size(0), mtime(0) {}
+    FsNodeNotDir(const char* name, mode_t mode = 0, FsArena* arena = NULL):
+      FsNode(name, mode, arena), size(0), mtime(0) {}
   };
 
   //! \brief Structure to hold a regular file metadata and contents hash
@@ -119,7 +201,8 @@ namespace htoolbox {
   */
   struct FsNodeFile : public FsNodeNotDir {
     char            hash[35];
-    FsNodeFile(const char* name): FsNodeNotDir(name, S_IFREG) {
+    FsNodeFile(const char* name, FsArena* arena = NULL):
+        FsNodeNotDir(name, S_IFREG, arena) {
       hash[0] = '\0';
     }
   };
@@ -131,7 +214,8 @@ namespace htoolbox {
   */
   struct FsNodeLink : public FsNodeNotDir {
     char*           string;
-    FsNodeLink(const char* name): FsNodeNotDir(name, S_IFLNK), string(NULL) {}
+    FsNodeLink(const char* name, FsArena* arena = NULL):
+      FsNodeNotDir(name, S_IFLNK, arena), string(NULL) {}
   };
 
 }
@@ -0,0 +1,114 @@
+/*
+     Copyright (C) 2011  Hervé Fache
+
+     This program is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License version 2 as
+     published by the Free Software Foundation.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program; if not, write to the Free Software
+     Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+#ifndef _HASH_INDEX_H
+#define _HASH_INDEX_H
+
+#include <stdint.h>
+
+namespace htoolbox {
+
+//! \brief Persistent hash index, mapped read-only
+/*!
+  The file holds a tree of hashes with the same shape as HashTree, where each
+  node and record refers to others by their offset in the file, so it can be
+  queried straight from the mapping without being loaded.  Each hash comes
+  with a string of data, and all hashes in one index have the same length.
+
+  The file is only ever appended to (see HashIndexWriter), so an index that
+  is open stays valid while the file is being updated, and shows the contents
+  as they were when it was opened.
+*/
+class HashIndex {
+  struct         Private;
+  Private* const _d;
+  HashIndex(const HashIndex&);
+  const HashIndex& operator=(const HashIndex&);
+public:
+  //! \brief Record of a hash and its data, as stored in the file
+  struct Record {
+    uint32_t    hash_size;
+    uint32_t    data_size;
+    char        strings[];    // hash, '\0', data, '\0'
+    const char* hash() const { return strings; }
+    const char* data() const { return &strings[hash_size + 1]; }
+    operator const char*() const { return strings; }
+  };
+  HashIndex();
+  ~HashIndex();
+  //! \brief Map given index file
+  /*!
+    \param path         the path of the index file
+    \return 0 on success, -1 on failure (EINVAL for a file of wrong format)
+  */
+  int open(const char* path);
+  //! \brief Unmap file, invalidating all records
+  int close();
+  //! \brief Number of hashes
+  size_t size() const;
+  //! \brief Find record for given hash
+  const Record* find(const char* hash) const;
+  //! \brief Get first record after given hash, or first record if NULL
+  const Record* next(const char* hash) const;
+  const Record* next(const Record* record) const {
+    return next(record == NULL ? NULL : record->hash());
+  }
+  //! \brief Show tree structure, for debug purposes
+  void show() const;
+};
+
+//! \brief Writer for HashIndex files
+/*!
+  Hashes are added to the tree in memory, and only the nodes they changed are
+  appended to the file by commit(), followed by an update of the file header
+  to point to the new root.  Adding in large batches thus keeps the file
+  small.  A file left with partly written data, after a crash, is truncated to
+  its last commit when opened again.
+*/
+class HashIndexWriter {
+  struct         Private;
+  Private* const _d;
+  HashIndexWriter(const HashIndexWriter&);
+  const HashIndexWriter& operator=(const HashIndexWriter&);
+public:
+  HashIndexWriter();
+  ~HashIndexWriter();
+  //! \brief Open given index file for appending, creating it if needed
+  /*!
+    \param path         the path of the index file
+    \return 0 on success, -1 on failure (EINVAL for a file of wrong format)
+  */
+  int open(const char* path);
+  //! \brief Commit and close file
+  int close();
+  //! \brief Add hash and its data
+  /*!
+    \param hash         the hash, of the same length as the others
+    \param data         the data string to store with the hash
+    \return 0 if added, 1 if already present, -1 on failure
+  */
+  int add(const char* hash, const char* data = "");
+  //! \brief Write changes to the file and make them visible to new readers
+  int commit();
+  //! \brief Number of hashes, including those not yet committed
+  size_t size() const;
+};
+
+}
+
+#endif // _HASH_INDEX_H
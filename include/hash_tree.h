@@ -19,32 +19,88 @@
 #ifndef _HASH_TREE_H
 #define _HASH_TREE_H
 
+#include <vector>
+
 namespace htoolbox {
 
+//! \brief Keys made of hexadecimal characters, in either case
+struct HashTreeHexKey {
+  enum {
+    PRINT_SIZE = 1    // No conversion needed
+  };
+  //! \brief Number of 4-bit levels in key
+  static int levels(const char* key) { return static_cast<int>(strlen(key)); }
+  //! \brief Index of child at given level
+  static int index(const char* key, int level) {
+    char c = key[level];
+    return c >= 'a' ? c - 'a' + 10: c >= 'A' ? c - 'A' + 10 : c != '-' ? c - '0' : 0;
+  }
+  static int compare(const char* a, const char* b) {
+    return strcasecmp(a, b);
+  }
+  //! \brief Whether key starts with the given number of levels of prefix
+  static bool match(const char* key, const char* prefix, int levels) {
+    return strncasecmp(key, prefix, levels) == 0;
+  }
+  static const char* print(const char* key, char*) { return key; }
+};
+
+//! \brief Keys made of SIZE raw bytes, each giving two levels
+template<int SIZE>
+struct HashTreeBinaryKey {
+  enum {
+    PRINT_SIZE = 2 * SIZE + 1
+  };
+  static int levels(const char*) { return 2 * SIZE; }
+  static int index(const char* key, int level) {
+    unsigned char byte = static_cast<unsigned char>(key[level >> 1]);
+    return (level & 1) != 0 ? byte & 0xf : byte >> 4;
+  }
+  static int compare(const char* a, const char* b) {
+    return memcmp(a, b, SIZE);
+  }
+  static bool match(const char* key, const char* prefix, int levels) {
+    if (memcmp(key, prefix, levels >> 1) != 0) {
+      return false;
+    }
+    return ((levels & 1) == 0) ||
+      (index(key, levels - 1) == index(prefix, levels - 1));
+  }
+  //! \brief Convert key to hexadecimal, buffer must be PRINT_SIZE long
+  static const char* print(const char* key, char* buffer) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < 2 * SIZE; ++i) {
+      buffer[i] = digits[index(key, i)];
+    }
+    buffer[2 * SIZE] = '\0';
+    return buffer;
+  }
+};
+
 // The class T must implement the following operator for this to work:
 //   operator const char*() const { return hash; }
+// The hash is a string of hexadecimal characters by default, or SIZE raw
+// bytes when K is HashTreeBinaryKey<SIZE>, which halves the size of the key
+// and avoids converting characters at each level.
 
-template<class T>
+template<class T, class K = HashTreeHexKey>
 class HashTree {
-  HashTree<T>*    _parent;
+  HashTree<T, K>*   _parent;
   union {
-    HashTree<T>*  nodes[16];
-    T*            hobjs[16];
+    HashTree<T, K>* nodes[16];
+    T*              hobjs[16];
   } child;
   int16_t _mask;      // Bit mask: 1 means child is hobj
   int16_t _level;
   int8_t size() const;
-  static int getIndex(char c) {
-    return c >= 'a' ? c - 'a' + 10: c >= 'A' ? c - 'A' + 10 : c != '-' ? c - '0' : 0;
-  }
 public:
-  HashTree<T>(HashTree<T>* parent = NULL, int16_t level = 0):
+  HashTree(HashTree<T, K>* parent = NULL, int16_t level = 0):
       _parent(parent), _mask(0), _level(level) {
     for (int i = 0; i < 16; ++i) {
       child.nodes[i] = NULL;
     }
   }
-  ~HashTree<T>() {
+  ~HashTree() {
     for (int i = 0; i < 16; ++i) {
       if (child.nodes[i] != NULL) {
         if ((_mask & (1 << i)) == 0) {
@@ -57,28 +113,204 @@ public:
   }
   // Return existing leaf
   T* add(T* hobj);
-  T* find(const char* hash, HashTree<T>** node = NULL);
-  T* find(const T* hobj, HashTree<T>** node = NULL) {
+  T* find(const char* hash, HashTree<T, K>** node = NULL);
+  T* find(const T* hobj, HashTree<T, K>** node = NULL) {
     return this->find(static_cast<const char*>(*hobj), node);
   }
   T* remove(const char* hash);
   T* remove(const T* hobj) {
     return this->remove(static_cast<const char*>(*hobj));
   }
-  T* next(const char* hash, HashTree<T>** hint = NULL);
-  T* next(const T* hobj, HashTree<T>** hint = NULL) {
+  T* next(const char* hash, HashTree<T, K>** hint = NULL);
+  T* next(const T* hobj, HashTree<T, K>** hint = NULL) {
     return this->next(static_cast<const char*>(*hobj), hint);
   }
   void show(int level = 0) const;
+  //! \brief Loader to build a tree from hashes given in order
+  /*!
+    Each object is put in place knowing only the previous one, so there is no
+    look-up from the root, and loading takes linear time.  The tree must be
+    empty to start with, and have no other changes made until finish().
+  */
+  class Loader {
+    HashTree<T, K>*              _root;
+    // Nodes leading to the previous object, indexed by level
+    std::vector<HashTree<T, K>*> _path;
+    T*                           _prev;
+    int                          _prev_common;
+    void put(T* hobj, int level);
+  public:
+    Loader(HashTree<T, K>& root) :
+        _root(&root), _prev(NULL), _prev_common(0) {
+      _path.push_back(_root);
+    }
+    ~Loader() { finish(); }
+    //! \brief Add object, which must come after the previous one
+    /*!
+      \return NULL if added, the object itself if it was not added because it
+      does not come after the previous one (or is the same)
+    */
+    T* add(T* hobj);
+    //! \brief Put the last object in place
+    void finish();
+  };
+  //! \brief Iterator over the objects which hashes start with given prefix
+  /*!
+    Objects are returned in order, going from one leaf to the next without
+    looking up from the root.  The tree must not be modified meanwhile.
+  */
+  class Iterator {
+    const HashTree<T, K>* _top;
+    const HashTree<T, K>* _node;
+    int                   _i;
+    T*                    _single;
+  public:
+    //! \brief Constructor
+    /*!
+      \param root         the tree to iterate over
+      \param prefix       the beginning of the hashes to list, NULL for all
+      \param levels       the length of the prefix in 4-bit levels, which is
+                          needed for binary keys (defaults to the whole key)
+    */
+    Iterator(const HashTree<T, K>& root, const char* prefix = NULL,
+      int levels = -1);
+    //! \brief Get next object, or NULL when done
+    T* next();
+  };
 };
 
-template<class T>
-T* HashTree<T>::add(T* hobj) {
-  HashTree<T>* node;
+template<class T, class K>
+void HashTree<T, K>::Loader::put(T* hobj, int level) {
+  const char* hash = *hobj;
+  // _path is valid up to where the hash differs from the previous one
+  for (int l = static_cast<int>(_path.size()); l <= level; ++l) {
+    HashTree<T, K>* parent = _path[l - 1];
+    HashTree<T, K>* node = new HashTree<T, K>(parent, static_cast<int16_t>(l));
+    parent->child.nodes[K::index(hash, l - 1)] = node;
+    _path.push_back(node);
+  }
+  HashTree<T, K>* node = _path[level];
+  int i = K::index(hash, level);
+  node->child.hobjs[i] = hobj;
+  node->_mask = static_cast<int16_t>(node->_mask | (1 << i));
+}
+
+template<class T, class K>
+T* HashTree<T, K>::Loader::add(T* hobj) {
+  if (_prev == NULL) {
+    _prev = hobj;
+    _prev_common = 0;
+    return NULL;
+  }
+  const char* prev = *_prev;
+  const char* hash = *hobj;
+  int prev_levels = K::levels(prev);
+  int levels = K::levels(hash);
+  int common = 0;
+  while ((common < prev_levels) && (common < levels) &&
+      (K::index(prev, common) == K::index(hash, common))) {
+    ++common;
+  }
+  if ((common == prev_levels) || (common == levels) ||
+      (K::index(prev, common) > K::index(hash, common))) {
+    return hobj;
+  }
+  // The previous object goes just below what it shares with either neighbour
+  int level = _prev_common > common ? _prev_common : common;
+  if (static_cast<int>(_path.size()) > _prev_common + 1) {
+    _path.resize(_prev_common + 1);
+  }
+  put(_prev, level);
+  _prev = hobj;
+  _prev_common = common;
+  return NULL;
+}
+
+template<class T, class K>
+void HashTree<T, K>::Loader::finish() {
+  if (_prev != NULL) {
+    if (static_cast<int>(_path.size()) > _prev_common + 1) {
+      _path.resize(_prev_common + 1);
+    }
+    put(_prev, _prev_common);
+    _prev = NULL;
+  }
+}
+
+template<class T, class K>
+HashTree<T, K>::Iterator::Iterator(const HashTree<T, K>& root,
+    const char* prefix, int levels) :
+    _top(&root), _node(&root), _i(0), _single(NULL) {
+  if (prefix == NULL) {
+    levels = 0;
+  } else
+  if (levels < 0) {
+    levels = K::levels(prefix);
+  }
+  for (int level = 0; level < levels; ++level) {
+    int i = K::index(prefix, level);
+    if (_node->child.nodes[i] == NULL) {
+      _node = NULL;
+      break;
+    } else
+    if ((_node->_mask & (1 << i)) != 0) {
+      // Only one object has the beginning of the prefix
+      T* hobj = _node->child.hobjs[i];
+      if (K::match(*hobj, prefix, levels)) {
+        _single = hobj;
+      }
+      _node = NULL;
+      break;
+    } else
+    {
+      _node = _node->child.nodes[i];
+    }
+  }
+  _top = _node;
+}
+
+template<class T, class K>
+T* HashTree<T, K>::Iterator::next() {
+  if (_single != NULL) {
+    T* hobj = _single;
+    _single = NULL;
+    return hobj;
+  }
+  while (_node != NULL) {
+    for (; _i < 16; ++_i) {
+      if (_node->child.nodes[_i] != NULL) {
+        break;
+      }
+    }
+    if (_i < 16) {
+      if ((_node->_mask & (1 << _i)) != 0) {
+        return _node->child.hobjs[_i++];
+      }
+      _node = _node->child.nodes[_i];
+      _i = 0;
+      continue;
+    }
+    // Done with this node, go up
+    if (_node == _top) {
+      _node = NULL;
+      break;
+    }
+    const HashTree<T, K>* parent = _node->_parent;
+    for (_i = 0; parent->child.nodes[_i] != _node; ++_i) ;
+    ++_i;
+    _node = parent;
+  }
+  return NULL;
+}
+
+template<class T, class K>
+T* HashTree<T, K>::add(T* hobj) {
+  HashTree<T, K>* node;
   T* found = find(*hobj, &node);
-  int i = getIndex((*hobj)[node->_level]);
+  int i = K::index(*hobj, node->_level);
+  char printable[K::PRINT_SIZE];
   hlog_regression("adding %s, i=%d, level=%d, found=%p node=%p this=%p",
-    static_cast<const char*>(*hobj), i, node->_level, found, node, this);
+    K::print(*hobj, printable), i, node->_level, found, node, this);
   // Not found, go on
   if (found == NULL) {
     // No child: easy, add it
@@ -87,8 +319,8 @@ T* HashTree<T>::add(T* hobj) {
       node->_mask |= static_cast<int16_t>(1 << i);
       hlog_regression("added, mask=%x", node->_mask);
     } else {
-      HashTree<T>* new_child =
-        new HashTree<T>(node, static_cast<int16_t>(node->_level + 1));
+      HashTree<T, K>* new_child =
+        new HashTree<T, K>(node, static_cast<int16_t>(node->_level + 1));
       new_child->add(node->child.hobjs[i]);
       new_child->add(hobj);
       node->child.nodes[i] = new_child;
@@ -98,19 +330,19 @@ T* HashTree<T>::add(T* hobj) {
   return found;
 }
 
-template<class T>
-T* HashTree<T>::find(const char* hash, HashTree<T>** node_p) {
+template<class T, class K>
+T* HashTree<T, K>::find(const char* hash, HashTree<T, K>** node_p) {
   if (node_p != NULL) {
     *node_p = this;
   }
-  int i = getIndex(hash[_level]);
+  int i = K::index(hash, _level);
   if (child.hobjs[i] == NULL) {
     return NULL;
   } else
   if ((_mask & (1 << i)) == 0) {
     return child.nodes[i]->find(hash, node_p);
   } else
-  if (strcasecmp(static_cast<const char*>(*child.hobjs[i]), hash) != 0) {
+  if (K::compare(*child.hobjs[i], hash) != 0) {
     return NULL;
   } else
   {
@@ -118,27 +350,27 @@ T* HashTree<T>::find(const char* hash, HashTree<T>** node_p) {
   }
 }
 
-template<class T>
-T* HashTree<T>::remove(const char* hash) {
-  HashTree<T>* node;
+template<class T, class K>
+T* HashTree<T, K>::remove(const char* hash) {
+  HashTree<T, K>* node;
   T* obsolete = find(hash, &node);
   if (obsolete == NULL) {
     return NULL;
   }
-  int i = getIndex(hash[node->_level]);
+  int i = K::index(hash, node->_level);
   node->child.nodes[i] = NULL;
   while ((node->_parent != NULL) && (node->size() == 0)) {
     node = node->_parent;
-    i = getIndex(hash[node->_level]);
+    i = K::index(hash, node->_level);
     delete node->child.nodes[i];
     node->child.nodes[i] = NULL;
   }
   return obsolete;
 }
 
-template<class T>
-T* HashTree<T>::next(const char* hash, HashTree<T>** hint) {
-  HashTree<T>* node = this;
+template<class T, class K>
+T* HashTree<T, K>::next(const char* hash, HashTree<T, K>** hint) {
+  HashTree<T, K>* node = this;
   if (hash == NULL) {
     hlog_regression("find first");
     do {
@@ -163,7 +395,8 @@ T* HashTree<T>::next(const char* hash, HashTree<T>** hint) {
     return NULL;
   }
   bool found;
-  hlog_regression("find next from %s", hash);
+  char printable[K::PRINT_SIZE];
+  hlog_regression("find next from %s", K::print(hash, printable));
   if (hint == NULL) {
     hlog_regression("hint invalid");
     // Find hint (leaf that contains/would contain the hash)
@@ -173,10 +406,11 @@ T* HashTree<T>::next(const char* hash, HashTree<T>** hint) {
     found = true;
   }
   // Find next
-  int i = getIndex(hash[node->_level]) + (found ? 1 : 0);
+  int i = K::index(hash, node->_level) + (found ? 1 : 0);
   do {
     for (; i < 16; ++i) {
-      hlog_regression("i=%d, level=%d, hash=%s", i, node->_level, hash);
+      hlog_regression("i=%d, level=%d, hash=%s", i, node->_level,
+        K::print(hash, printable));
       if (node->child.nodes[i] != NULL) {
         if ((node->_mask & (1 << i)) == 0) {
           node = node->child.nodes[i];
@@ -185,7 +419,7 @@ T* HashTree<T>::next(const char* hash, HashTree<T>** hint) {
           continue;
         } else {
           hlog_regression("found %s",
-            static_cast<const char*>(*node->child.hobjs[i]));
+            K::print(*node->child.hobjs[i], printable));
           if (hint != NULL) {
             *hint = node;
           }
@@ -195,15 +429,15 @@ T* HashTree<T>::next(const char* hash, HashTree<T>** hint) {
     }
     node = node->_parent;
     if (node != NULL) {
-      i = getIndex(hash[node->_level]) + 1;
+      i = K::index(hash, node->_level) + 1;
     }
     hlog_regression("sgo up, level=%d", node != NULL ? node->_level : -1);
   } while (node != NULL);
   return NULL;
 }
 
-template<class T>
-int8_t HashTree<T>::size() const {
+template<class T, class K>
+int8_t HashTree<T, K>::size() const {
   int8_t count = 0;
   for (int i = 0; i < 16; ++i) {
     if (child.nodes[i] != NULL) {
@@ -213,8 +447,9 @@ int8_t HashTree<T>::size() const {
   return count;
 }
 
-template<class T>
-void HashTree<T>::show(int level) const {
+template<class T, class K>
+void HashTree<T, K>::show(int level) const {
+  char printable[K::PRINT_SIZE];
   ++level;
   for (int i = 0; i < 16; ++i) {
     if (child.nodes[i] != NULL) {
@@ -223,7 +458,7 @@ void HashTree<T>::show(int level) const {
         child.nodes[i]->show(level);
       } else {
         hlog_verbose_arrow(level, "[%x] %s", i,
-          static_cast<const char*>(*child.hobjs[i]));
+          K::print(*child.hobjs[i], printable));
       }
     }
   }
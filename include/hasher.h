@@ -27,7 +27,8 @@ namespace htoolbox {
  * with no modificationto the data.
  *
  * The specified hash will be computed from the data on the fly, and will be
- * valid after close() has been called.
+ * valid after close() has been called.  Several hashes can be computed at
+ * once, so the data is only gone through once.
  */
 class Hasher : public IReaderWriter {
   struct         Private;
@@ -55,12 +56,118 @@ public:
    * \param hash         pre-allocated buffer where to store the resulting hash
   */
   Hasher(IReaderWriter* child, bool delete_child, Digest digest, char* hash);
+  //! \brief Constructor for several digests, computed in one pass
+  /*!
+   * \param child        underlying stream to read from or write to
+   * \param delete_child whether to also delete child at destruction
+   * \param digests      digests to compute
+   * \param hashes       pre-allocated buffers where to store the resulting
+   *                     hashes, in the same order as the digests
+   * \param count        number of digests
+  */
+  Hasher(IReaderWriter* child, bool delete_child, const Digest* digests,
+    char* const* hashes, size_t count);
   ~Hasher();
+  //! \brief Compute each digest in its own thread for large buffers
+  /*!
+   * The threads are started by open() and stopped by close(), so call this
+   * before open().
+   *
+   * \param min_size     size from which a buffer is given to one thread per
+   *                     digest, 0 to never do so (default)
+  */
+  void setThreaded(size_t min_size);
+  //! \brief Compute the digests so their state can be saved and resumed
+  /*!
+   * The digests are then computed with OpenSSL's low-level functions, which
+   * state is a plain structure, rather than through EVP.  Must be called
+   * before open() or resume().
+  */
+  void setResumable();
+  //! \brief Size of the buffer needed by saveState()
+  /*!
+   * \return             size, or 0 if not resumable or if one of the digests
+   *                     cannot be saved
+  */
+  size_t stateSize() const;
+  //! \brief Save the state of the computation, to resume it later
+  /*!
+   * Only valid between open() and close().  The state is the number of bytes
+   * hashed so far and the internal state of each digest, so it can be written
+   * to disk and given to resume() after an interruption.  It is only valid on
+   * the same architecture.  setResumable() must have been called, and md_null
+   * and sha cannot be saved.
+   * \param state        pre-allocated buffer of stateSize() bytes
+   * \return             size of the state, -1 on failure
+  */
+  ssize_t saveState(void* state) const;
+  //! \brief Resume the computation from a saved state at next open()
+  /*!
+   * The data hashed next must be that following the offset returned, e.g. by
+   * seeking the underlying FileReaderWriter to it.
+   * \param state        state given by saveState()
+   * \param size         size of the state
+   * \return             number of bytes hashed so far, -1 if the state does
+   *                     not match this hasher's digests
+  */
+  int64_t resume(const void* state, size_t size);
   int open();
   int close();
   ssize_t read(void* buffer, size_t size);
   ssize_t get(void* buffer, size_t size);
   ssize_t put(const void* buffer, size_t size);
+  ssize_t getv(const struct iovec* iov, int count);
+  ssize_t putv(const struct iovec* iov, int count);
+  //! \brief Borrow from the underlying stream, hashing data as it is consumed
+  ssize_t peek(const void** buffer, size_t size);
+  ssize_t advance(size_t size);
+  //! \brief Borrow from the underlying stream, hashing data as it is committed
+  ssize_t reserve(void** buffer, size_t size);
+  ssize_t commit(size_t size);
+};
+
+//! \brief Tree hash computer
+/*!
+ * Like Hasher, but the data is cut into chunks of fixed size, which are
+ * hashed in parallel by a pool of threads.  Their hashes are then combined
+ * two by two into a binary (Merkle) tree, which root is the resulting hash.
+ *
+ * A chunk's hash is that of a 0 byte followed by the chunk's data.  A node's
+ * hash is that of a 1 byte followed by the (binary) hashes of its two
+ * children.  A node left alone at the end of a level is moved up as it is.
+ *
+ * The chunks' hashes are kept, so parts of the data can be checked later.
+ */
+class TreeHasher : public IReaderWriter {
+  struct         Private;
+  Private* const _d;
+public:
+  //! \brief Constructor
+  /*!
+   * \param child        underlying stream to read from or write to
+   * \param delete_child whether to also delete child at destruction
+   * \param digest       digest to compute
+   * \param chunk_size   size of chunks
+   * \param hash         pre-allocated buffer where to store the resulting hash
+   * \param threads      number of threads, 0 for the number of CPUs
+  */
+  TreeHasher(IReaderWriter* child, bool delete_child, Hasher::Digest digest,
+    size_t chunk_size, char* hash, size_t threads = 0);
+  ~TreeHasher();
+  int open();
+  int close();
+  ssize_t read(void* buffer, size_t size);
+  ssize_t get(void* buffer, size_t size);
+  ssize_t put(const void* buffer, size_t size);
+  //! \brief Number of chunks, valid after close()
+  size_t chunks() const;
+  //! \brief Get hash of given chunk, valid after close()
+  /*!
+   * \param index        index of the chunk
+   * \param hash         pre-allocated buffer where to store the hash
+   * \return             0 on success, -1 if there is no such chunk
+  */
+  int chunkHash(size_t index, char* hash) const;
 };
 
 };
@@ -19,6 +19,8 @@
 
 #include <unistd.h>
 #include <stdint.h>
+#include <errno.h>
+#include <sys/uio.h>
 
 namespace htoolbox {
 
@@ -46,6 +48,17 @@ namespace htoolbox {
  *
  * The offset() method tries to return the offset of the underlying stream, if
  * any. Otherwise it must return -1.
+ *
+ * The putv() and getv() methods work on several buffers at once, to save on
+ * system calls.  They default to calling put() or get() for each buffer, and
+ * should be overridden where the underlying stream can do better.
+ *
+ * The peek()/advance() and reserve()/commit() methods are optional: they lend
+ * the module's own buffers, so data can go through a stack without being
+ * copied at each level.  Modules that do not support them fail with errno set
+ * to ENOTSUP, and the caller must then use read()/get() or put().  A module
+ * that only passes the data through (e.g. Hasher) should forward them to its
+ * child.
  */
 class IReaderWriter {
 protected:
@@ -108,6 +121,98 @@ public:
   virtual int64_t offset() const {
     return _child == NULL ? -1 : _child->offset();
   }
+  //! \brief Write all given buffers to stream, in order
+  /*!
+   * \param iov         buffers from which to read the data
+   * \param count       number of buffers
+   * \return            negative number on failure, bytes written on success
+  */
+  virtual ssize_t putv(const struct iovec* iov, int count) {
+    ssize_t total = 0;
+    for (int i = 0; i < count; ++i) {
+      ssize_t rc = put(iov[i].iov_base, iov[i].iov_len);
+      if (rc < 0) {
+        return -1;
+      }
+      total += rc;
+      if (static_cast<size_t>(rc) < iov[i].iov_len) {
+        break;
+      }
+    }
+    return total;
+  }
+  //! \brief Read into all given buffers, in order
+  /*!
+   * As get(), reads no less than asked unless the end of stream is reached.
+   * \param iov         buffers in which to store the data
+   * \param count       number of buffers
+   * \return            negative number on failure, bytes read on success
+  */
+  virtual ssize_t getv(const struct iovec* iov, int count) {
+    ssize_t total = 0;
+    for (int i = 0; i < count; ++i) {
+      ssize_t rc = get(iov[i].iov_base, iov[i].iov_len);
+      if (rc < 0) {
+        return -1;
+      }
+      total += rc;
+      if (static_cast<size_t>(rc) < iov[i].iov_len) {
+        break;
+      }
+    }
+    return total;
+  }
+  //! \brief Borrow the next bytes to read, without copying them
+  /*!
+   * The data is not consumed: use advance() for that.  It remains valid until
+   * the next call to any method of this stream other than advance().
+   * \param buffer      where to store the address of the data
+   * \param size        maximum number of bytes wanted
+   * \return            negative number on failure, bytes available on success,
+   *                    which may be less than asked, 0 at end of stream
+  */
+  virtual ssize_t peek(const void** buffer, size_t size) {
+    (void) buffer;
+    (void) size;
+    errno = ENOTSUP;
+    return -1;
+  }
+  //! \brief Consume bytes given by the last call to peek()
+  /*!
+   * \param size        number of bytes to consume, at most that given by peek()
+   * \return            negative number on failure, bytes consumed on success
+  */
+  virtual ssize_t advance(size_t size) {
+    (void) size;
+    errno = ENOTSUP;
+    return -1;
+  }
+  //! \brief Borrow a region of the stream to write into
+  /*!
+   * The data written there is only part of the stream after commit().  The
+   * region remains valid until then.
+   * \param buffer      where to store the address of the region
+   * \param size        number of bytes wanted
+   * \return            negative number on failure, size of the region on
+   *                    success, which may be less than asked
+  */
+  virtual ssize_t reserve(void** buffer, size_t size) {
+    (void) buffer;
+    (void) size;
+    errno = ENOTSUP;
+    return -1;
+  }
+  //! \brief Write the first bytes of the region given by reserve()
+  /*!
+   * \param size        number of bytes to write, at most that given by
+   *                    reserve()
+   * \return            negative number on failure, bytes written on success
+  */
+  virtual ssize_t commit(size_t size) {
+    (void) size;
+    errno = ENOTSUP;
+    return -1;
+  }
 };
 
 };
@@ -46,6 +46,9 @@ public:
   ssize_t put(const void* buffer, size_t size);
   int64_t offset() const { return _offset; }
   int64_t childOffset() const;
+  //! \brief Lend the buffered data, filling the buffer first if empty
+  ssize_t peek(const void** buffer, size_t size);
+  ssize_t advance(size_t size);
   //! \brief Read complete line from stream
   /*!
    * getLine() reads an entire line from the underlying stream, storing the
@@ -53,6 +53,13 @@ public:
   //! \brief Always fails to get, as this is a writer
   ssize_t get(void* buffer, size_t size);
   ssize_t put(const void* buffer, size_t size);
+  //! \brief Borrow from the first stream, the others get a copy at commit()
+  /*!
+   * The region is re-used by the first stream, so the others must not keep
+   * it after put() has returned, as an AsyncWriter in borrow mode would.
+   */
+  ssize_t reserve(void** buffer, size_t size);
+  ssize_t commit(size_t size);
   //! \brief Returns the path of the last error if any, or an empty string
   const char* path() const;
   //! \brief Returns the first valid offset found, if any
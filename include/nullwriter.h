@@ -17,6 +17,8 @@
 #ifndef _NULLWRITER_H
 #define _NULLWRITER_H
 
+#include <stdlib.h>
+
 #include <ireaderwriter.h>
 
 namespace htoolbox {
@@ -29,9 +31,16 @@ namespace htoolbox {
  */
 class NullWriter : public IReaderWriter {
   int64_t _offset;
+  // Region lent by reserve()
+  void*   _buffer;
+  size_t  _capacity;
+  NullWriter(const NullWriter&);
+  const NullWriter& operator=(const NullWriter&);
 public:
-  NullWriter() {}
-  ~NullWriter() {}
+  NullWriter() : _buffer(NULL), _capacity(0) {}
+  ~NullWriter() {
+    free(_buffer);
+  }
   int open() {
     _offset = 0;
     return 0;
@@ -58,6 +67,21 @@ public:
   int64_t offset() const {
     return _offset;
   };
+  ssize_t reserve(void** buffer, size_t size) {
+    if (size > _capacity) {
+      void* new_buffer = realloc(_buffer, size);
+      if (new_buffer == NULL) {
+        return -1;
+      }
+      _buffer = new_buffer;
+      _capacity = size;
+    }
+    *buffer = _buffer;
+    return size;
+  }
+  ssize_t commit(size_t size) {
+    return put(_buffer, size);
+  }
 };
 
 };
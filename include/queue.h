@@ -17,6 +17,8 @@
 #ifndef _QUEUE_H
 #define _QUEUE_H
 
+#include <stdint.h>
+
 namespace htoolbox {
 
 class Queue {
@@ -31,8 +33,41 @@ public:
   bool empty() const;
   size_t size() const;
   int push(void* data);
-  int pop(void** data);
+  //! \brief Pop one item, waiting for it
+  /*!
+   * \param data        where to store the item
+   * \param push_time   if not NULL, where to store the time the item was pushed
+   * \return            0 on data, 1 if signalled, -1 if the queue was closed
+  */
+  int pop(void** data, uint64_t* push_time = NULL);
+  //! \brief Push several items, locking the queue as few times as possible
+  /*!
+   * If the queue gets closed on the way, the items not pushed are still the
+   * caller's.
+   * \param items       items to push, in order
+   * \param n           number of items
+   * \return            number of items pushed, less than n if the queue was
+   *                    closed
+  */
+  size_t pushBatch(void** items, size_t n);
+  //! \brief Pop as many items as available, waiting for at least one
+  /*!
+   * \param out         array to store the items into, in order
+   * \param max         maximum number of items to pop
+   * \param got         number of items actually popped
+   * \param push_times  if not NULL, array to store the items' push times into
+   * \return            0 on data, 1 if signalled, -1 if the queue was closed
+  */
+  int popBatch(void** out, size_t max, size_t* got,
+    uint64_t* push_times = NULL);
   void signal();
+  //! \brief Record the time at which items are pushed
+  /*!
+   * Times are in microseconds since the Epoch, and are 0 when not recorded.
+   *
+   * \param enable      whether to record push times
+  */
+  void setTimestamps(bool enable);
 };
 
 };
@@ -47,6 +47,9 @@ public:
   ssize_t read(void* buffer, size_t max_size);
   ssize_t get(void* buffer, size_t size);
   ssize_t put(const void* buffer, size_t size);
+  // several buffers at once, with as few system calls as possible
+  ssize_t getv(const struct iovec* iov, int count);
+  ssize_t putv(const struct iovec* iov, int count);
   const char* path() const;
   static int getAddress(const char* hostname, uint32_t* address);
 };
@@ -28,6 +28,27 @@ class ThreadsManager {
   ThreadsManager(const htoolbox::ThreadsManager&);
 public:
   typedef void* (*routine_f)(void* data, void* user);
+  //! Runtime statistics
+  /*!
+   * Job counters and times are accumulated since start(), times are in
+   * microseconds.  Histogram bucket i counts the jobs that took between 2^i
+   * and 2^(i+1) microseconds (bucket 0 also counts those under 1).
+  */
+  struct Stats {
+    enum { HISTOGRAM_SIZE = 32 };
+    size_t    queue_depth;          //!< jobs waiting in the input queue
+    size_t    busy_threads;         //!< threads currently running a job
+    size_t    idle_threads;         //!< threads currently waiting for a job
+    uint64_t  threads_created;      //!< threads created
+    uint64_t  threads_reaped;       //!< idle threads stopped on time out
+    uint64_t  jobs_completed;       //!< jobs run to completion
+    uint64_t  jobs_stolen;          //!< jobs taken from another thread
+    uint64_t  wait_us;              //!< total time jobs spent queued
+    uint64_t  run_us;               //!< total time spent running jobs
+    uint64_t  push_out_us;          //!< total time spent pushing to q_out
+    uint64_t  wait_histogram[HISTOGRAM_SIZE];
+    uint64_t  run_histogram[HISTOGRAM_SIZE];
+  };
   ThreadsManager(
     const char* name,
     routine_f   routine,
@@ -50,9 +71,47 @@ public:
    * \param base        second delimiter to use
   */
   void setThreadIdBase(int base);
+  //! Use a fixed pool of threads that steal jobs from each other
+  /*!
+   * Instead of a monitor thread handing each job to a worker thread, each
+   * worker thread fetches jobs from the input queue in batches, keeps them in
+   * a local queue, and steals from other threads' local queues when idle.
+   * The number of threads is max_threads, or the number of CPUs if 0, and they
+   * are only stopped by stop(). Must be called before start().
+   *
+   * \param work_stealing whether to use work-stealing mode
+  */
+  void setWorkStealing(bool work_stealing);
+  //! Bind each worker thread to one CPU
+  /*!
+   * Threads are spread in turn over the CPUs the process is allowed to run
+   * on. Must be called before start().
+   *
+   * \param cpu_affinity whether to bind threads to CPUs
+  */
+  void setCpuAffinity(bool cpu_affinity);
+  //! Start processing jobs
+  /*!
+   * In default mode, threads are created as jobs come in, up to max_threads
+   * (0 for no limit), and the ones that have been idle for time_out seconds
+   * are stopped.  The first min_threads threads are created before this
+   * returns, and are kept until stop() is called.
+   *
+   * \param max_threads maximum number of worker threads, 0 for no limit
+   * \param min_threads number of worker threads to keep ready
+   * \param time_out    time after which to stop idle threads
+  */
   int start(size_t max_threads = 0, size_t min_threads = 0, time_t time_out = 600);
   int stop(bool urgent = false);
   size_t threads() const;
+  //! Get runtime statistics
+  /*!
+   * Counters are kept per thread and only added up here, so this can be
+   * called at any time without slowing the workers down.
+   *
+   * \param stats       where to store the statistics
+  */
+  void getStats(Stats* stats) const;
 };
 
 }
@@ -0,0 +1,75 @@
+/*
+    Copyright (C) 2011  Hervé Fache
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 3.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _URINGREADERWRITER_H
+#define _URINGREADERWRITER_H
+
+#include <ireaderwriter.h>
+
+namespace htoolbox {
+
+//! \brief Asynchronous file reader/writer, using io_uring
+/*!
+ * Like FileReaderWriter, but the file is read or written through a ring of
+ * buffers which the kernel fills or empties in the background, so disk I/O
+ * overlaps with what the caller does with the data, without a thread:
+ * - reading: as many reads as there are buffers are kept in flight ahead of
+ *   the caller, who gets the data from the oldest buffer;
+ * - writing: the data is copied into the current buffer, which is queued for
+ *   writing when full, so the caller only waits when all buffers are queued.
+ *
+ * peek()/advance() and reserve()/commit() lend the buffers of the ring.
+ *
+ * If io_uring is not available (old kernel, forbidden by seccomp, or depth
+ * set to 0), open() falls back to a FileReaderWriter, so the stream is used
+ * the same way whatever the system.
+ */
+class UringReaderWriter : public IReaderWriter {
+  struct         Private;
+  Private* const _d;
+  UringReaderWriter(const UringReaderWriter&);
+  const UringReaderWriter& operator=(const UringReaderWriter&);
+public:
+  //! \brief Constructor
+  /*!
+   * \param path        path to the file to open a stream from
+   * \param writer      whether write to or read from stream
+   * \param depth       number of buffers in the ring, 0 for synchronous I/O
+   * \param buffer_size size of each buffer
+  */
+  UringReaderWriter(const char* path, bool writer, size_t depth = 4,
+    size_t buffer_size = 131072);
+  ~UringReaderWriter();
+  int open();
+  int close();
+  ssize_t read(void* buffer, size_t size);
+  ssize_t get(void* buffer, size_t size);
+  ssize_t put(const void* buffer, size_t size);
+  const char* path() const;
+  int64_t offset() const;
+  //! \brief Lend data from the oldest buffer of the ring
+  ssize_t peek(const void** buffer, size_t size);
+  ssize_t advance(size_t size);
+  //! \brief Lend the free part of the current buffer of the ring
+  ssize_t reserve(void** buffer, size_t size);
+  ssize_t commit(size_t size);
+  //! \brief Whether io_uring is in use, or the synchronous fallback (once open)
+  bool isAsync() const;
+};
+
+};
+
+#endif // _URINGREADERWRITER_H
@@ -25,6 +25,11 @@ namespace htoolbox {
 /*!
  * Reading from/writing to this stream will automatically (un)zip the data
  * before reading from/writing to the underlying stream.
+ *
+ * When writing compressed data, the work can be shared between several
+ * threads: the data is then cut into blocks which are compressed concurrently,
+ * each using the end of the previous block as dictionary, and written in order
+ * as a single gzip member.
  */
 class Zipper : public IReaderWriter {
   struct         Private;
@@ -35,8 +40,10 @@ public:
    * \param child             underlying stream
    * \param delete_child      whether to also delete child at destruction
    * \param compression_level the compression level to apply, -1 to uncompress
+   * \param threads           number of threads to compress with when writing
   */
-  Zipper(IReaderWriter* child, bool delete_child, int compression_level = -1);
+  Zipper(IReaderWriter* child, bool delete_child, int compression_level = -1,
+    size_t threads = 1);
   ~Zipper();
   int open();
   int close();
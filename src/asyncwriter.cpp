@@ -14,8 +14,10 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <sys/time.h>
 #include <pthread.h>
 
 #include <report.h>
@@ -24,19 +26,78 @@
 using namespace htoolbox;
 
 struct AsyncWriter::Private {
+  struct Slot {
+    const void*   buffer;
+    size_t        size;
+    void*         owned;        // Slot buffer in copy mode
+    size_t        capacity;     // Size of the above
+    Slot() : owned(NULL), capacity(0) {}
+  };
   IReaderWriter*  child;
+  const Mode      mode;
   pthread_t       tid;
-  const void*     buffer;
-  size_t          size;
+  const size_t    max_slots;
+  Slot*           slots;
+  size_t          writer;       // Next slot to fill in
+  size_t          reader;       // Next slot to write out
+  size_t          used;
   bool            failed;
   bool            closing;
-  pthread_mutex_t buffer_lock;
-  pthread_mutex_t thread_lock;
-  Private(IReaderWriter* c) : child(c) {}
+  Stats           stats;
+  pthread_mutex_t lock;
+  pthread_cond_t  slot_freed;
+  pthread_cond_t  slot_filled;
+  Private(IReaderWriter* c, size_t n, Mode m) :
+      child(c), mode(m), max_slots(n > 0 ? n : 1) {
+    slots = new Slot[max_slots];
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&slot_freed, NULL);
+    pthread_cond_init(&slot_filled, NULL);
+  }
+  ~Private() {
+    pthread_cond_destroy(&slot_filled);
+    pthread_cond_destroy(&slot_freed);
+    pthread_mutex_destroy(&lock);
+    for (size_t i = 0; i < max_slots; ++i) {
+      free(slots[i].owned);
+    }
+    delete[] slots;
+  }
+  static uint64_t now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return static_cast<uint64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+  }
+  // Must be called with lock held
+  void wait(pthread_cond_t* cond, uint64_t* waits, uint64_t* wait_us) {
+    uint64_t start = now();
+    pthread_cond_wait(cond, &lock);
+    ++*waits;
+    *wait_us += now() - start;
+  }
+  // Slot is not in use, no need for lock
+  int fill(Slot& slot, const void* buffer, size_t size) {
+    if (mode == copy) {
+      if (slot.capacity < size) {
+        void* owned = realloc(slot.owned, size);
+        if (owned == NULL) {
+          return -1;
+        }
+        slot.owned = owned;
+        slot.capacity = size;
+      }
+      memcpy(slot.owned, buffer, size);
+      buffer = slot.owned;
+    }
+    slot.buffer = buffer;
+    slot.size = size;
+    return 0;
+  }
 };
 
-AsyncWriter::AsyncWriter(IReaderWriter* child, bool delete_child) :
-  IReaderWriter(child, delete_child), _d(new Private(child)) {}
+AsyncWriter::AsyncWriter(IReaderWriter* child, bool delete_child, size_t slots,
+    Mode mode) :
+  IReaderWriter(child, delete_child), _d(new Private(child, slots, mode)) {}
 
 AsyncWriter::~AsyncWriter() {
   delete _d;
@@ -44,18 +105,40 @@ AsyncWriter::~AsyncWriter() {
 
 void* AsyncWriter::_write_thread(void* data) {
   AsyncWriter::Private* d = static_cast<AsyncWriter::Private*>(data);
+  pthread_mutex_lock(&d->lock);
   do {
     /* Wait for data */
-    pthread_mutex_lock(&d->thread_lock);
-    if (! d->closing) {
-      if (d->child->put(d->buffer, d->size) < 0) {
-        /* Can't do more than report failures */
-        d->failed = true;
-      }
+    while ((d->used == 0) && ! d->closing) {
+      d->wait(&d->slot_filled, &d->stats.consumer_waits,
+        &d->stats.consumer_wait_us);
+    }
+    /* Closing and all data written */
+    if (d->used == 0) {
+      break;
+    }
+    /* The slot remains in use until written */
+    Private::Slot& slot = d->slots[d->reader];
+    bool failed = d->failed;
+    pthread_mutex_unlock(&d->lock);
+    if (! failed && (d->child->put(slot.buffer, slot.size) < 0)) {
+      /* Can't do more than report failures */
+      failed = true;
+    }
+    if (d->mode == donate) {
+      free(const_cast<void*>(slot.buffer));
     }
     /* Allow write or close to proceed */
-    pthread_mutex_unlock(&d->buffer_lock);
-  } while (! d->closing);
+    pthread_mutex_lock(&d->lock);
+    if (failed) {
+      d->failed = true;
+    }
+    if (++d->reader == d->max_slots) {
+      d->reader = 0;
+    }
+    --d->used;
+    pthread_cond_signal(&d->slot_freed);
+  } while (true);
+  pthread_mutex_unlock(&d->lock);
   return NULL;
 }
 
@@ -63,44 +146,32 @@ int AsyncWriter::open() {
   if (_d->child->open() < 0) {
     return -1;
   }
+  _d->writer = 0;
+  _d->reader = 0;
+  _d->used = 0;
   _d->failed = false;
   _d->closing = false;
-  errno = pthread_mutex_init(&_d->buffer_lock, NULL);
-  if (errno != 0) {
-    hlog_alert("%s initialising buffer mutex", strerror(errno));
-    goto failed;
-  }
-  errno = pthread_mutex_init(&_d->thread_lock, NULL);
-  if (errno != 0) {
-    hlog_alert("%s initialising thread mutex", strerror(errno));
-    goto failed;
-  }
-  /* The thread must wait for data */
-  pthread_mutex_lock(&_d->thread_lock);
+  memset(&_d->stats, 0, sizeof(_d->stats));
+  _d->stats.slots = _d->max_slots;
   errno = pthread_create(&_d->tid, NULL, _write_thread, _d);
   if (errno != 0) {
     hlog_alert("%s creating thread", strerror(errno));
-    goto failed;
+    _d->child->close();
+    return -1;
   }
   return 0;
-failed:
-  _d->child->close();
-  return -1;
 }
 
 int AsyncWriter::close() {
-  /* Wait for all data transfers to complete */
-  pthread_mutex_lock(&_d->buffer_lock);
-  /* Make sure everybody stops */
+  /* Make sure everybody stops once all data transfers have completed */
+  pthread_mutex_lock(&_d->lock);
   _d->closing = true;
   /* Let thread see we are closing */
-  pthread_mutex_unlock(&_d->thread_lock);
+  pthread_cond_signal(&_d->slot_filled);
+  pthread_mutex_unlock(&_d->lock);
   /* Wait for thread to exit */
-//   pthread_mutex_lock(&_d->buffer_lock);
   pthread_join(_d->tid, NULL);
   /* All done */
-  pthread_mutex_destroy(&_d->buffer_lock);
-  pthread_mutex_destroy(&_d->thread_lock);
   if (_d->child->close() < 0) {
     return -1;
   }
@@ -116,19 +187,50 @@ ssize_t AsyncWriter::get(void*, size_t) {
 }
 
 ssize_t AsyncWriter::put(const void* buffer, size_t size) {
-  /* Wait for thread to finish */
-  pthread_mutex_lock(&_d->buffer_lock);
-  if (_d->failed) {
-    return -1;
+  pthread_mutex_lock(&_d->lock);
+  /* Wait for a free slot */
+  while ((_d->used == _d->max_slots) && ! _d->failed) {
+    _d->wait(&_d->slot_freed, &_d->stats.producer_waits,
+      &_d->stats.producer_wait_us);
   }
+  int rc = 0;
+  if (_d->failed) {
+    rc = -1;
+  } else
   if (_d->closing) {
     hlog_alert("write called while closed");
     errno = EBADF;
+    rc = -1;
+  }
+  pthread_mutex_unlock(&_d->lock);
+  /* Only the thread reads the slots in use, and we are the only writer */
+  if ((rc == 0) && (_d->fill(_d->slots[_d->writer], buffer, size) < 0)) {
+    hlog_alert("%s copying buffer", strerror(errno));
+    rc = -1;
+  }
+  if (rc < 0) {
+    if (_d->mode == donate) {
+      free(const_cast<void*>(buffer));
+    }
     return -1;
   }
-  _d->buffer = buffer;
-  _d->size = size;
+  pthread_mutex_lock(&_d->lock);
+  if (++_d->writer == _d->max_slots) {
+    _d->writer = 0;
+  }
+  if (++_d->used > _d->stats.max_used) {
+    _d->stats.max_used = _d->used;
+  }
+  ++_d->stats.puts;
   /* Unleash thread */
-  pthread_mutex_unlock(&_d->thread_lock);
+  pthread_cond_signal(&_d->slot_filled);
+  pthread_mutex_unlock(&_d->lock);
   return size;
 }
+
+void AsyncWriter::getStats(Stats* stats) const {
+  pthread_mutex_lock(&_d->lock);
+  *stats = _d->stats;
+  stats->used = _d->used;
+  pthread_mutex_unlock(&_d->lock);
+}
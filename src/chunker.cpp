@@ -0,0 +1,257 @@
+/*
+    Copyright (C) 2011  Hervé Fache
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 3.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+
+#include <report.h>
+#include "nullwriter.h"
+#include "chunker.h"
+
+using namespace htoolbox;
+
+// Gear table: one random value per byte, from a fixed seed (splitmix64)
+struct GearTable {
+  uint64_t values[256];
+  GearTable() {
+    uint64_t seed = 0x6765617274616231ULL;
+    for (int i = 0; i < 256; ++i) {
+      uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+      values[i] = z ^ (z >> 31);
+    }
+  }
+};
+
+static const GearTable gear;
+
+// The hash only depends on the last 64 bytes, as each byte is shifted out
+static const size_t WINDOW = 64;
+
+struct Chunker::Private {
+  chunk_cb_f  callback;
+  void*       user;
+  size_t      min_size;
+  size_t      avg_size;
+  size_t      max_size;
+  // Harder to match before average size, easier after (normalised chunking)
+  uint64_t    mask_s;
+  uint64_t    mask_l;
+  // Current chunk
+  NullWriter  null;
+  char        hash[129];
+  Hasher      hasher;
+  bool        hashing;
+  int64_t     offset;
+  size_t      size;
+  uint64_t    fp;
+  Private(Hasher::Digest digest, chunk_cb_f cb, void* u, size_t min,
+      size_t avg, size_t max) :
+      callback(cb), user(u), hasher(&null, false, digest, hash),
+      hashing(false) {
+    int bits = 0;
+    while ((static_cast<size_t>(2) << bits) <= avg) {
+      ++bits;
+    }
+    // Use the top bits, which depend on the whole window
+    mask_s = ~static_cast<uint64_t>(0) << (64 - bits - 1);
+    mask_l = ~static_cast<uint64_t>(0) << (64 - bits + 1);
+    avg_size = static_cast<size_t>(1) << bits;
+    min_size = min < WINDOW ? WINDOW : min;
+    if (min_size > avg_size) {
+      min_size = avg_size;
+    }
+    max_size = max < avg_size ? avg_size : max;
+  }
+  int cut();
+  int feed(const void* buffer, size_t length);
+};
+
+int Chunker::Private::cut() {
+  hashing = false;
+  if (hasher.close() < 0) {
+    return -1;
+  }
+  if (callback(offset, size, hash, user) < 0) {
+    return -1;
+  }
+  offset += size;
+  size = 0;
+  fp = 0;
+  if (hasher.open() < 0) {
+    return -1;
+  }
+  hashing = true;
+  return 0;
+}
+
+int Chunker::Private::feed(const void* buffer, size_t length) {
+  const unsigned char* start = static_cast<const unsigned char*>(buffer);
+  const unsigned char* end = start + length;
+  if (! hashing && (length > 0)) {
+    // A previous chunk failed
+    errno = EIO;
+    return -1;
+  }
+  while (start < end) {
+    const unsigned char* p = start;
+    size_t left = end - p;
+    bool found = false;
+    // Skip what cannot be a cut point nor affect one
+    if (size + WINDOW < min_size) {
+      size_t skip = min_size - WINDOW - size;
+      if (skip > left) {
+        skip = left;
+      }
+      p += skip;
+      size += skip;
+      left -= skip;
+    }
+    uint64_t h = fp;
+    // Roll up to minimum size
+    if ((left > 0) && (size < min_size)) {
+      size_t n = min_size - size;
+      if (n > left) {
+        n = left;
+      }
+      for (const unsigned char* q = p + n; p < q; ++p) {
+        h = (h << 1) + gear.values[*p];
+      }
+      size += n;
+      left -= n;
+    }
+    // Look for a cut point, harder before the average size
+    if ((left > 0) && (size < avg_size)) {
+      size_t n = avg_size - size;
+      if (n > left) {
+        n = left;
+      }
+      const unsigned char* q = p + n;
+      while (p < q) {
+        h = (h << 1) + gear.values[*p++];
+        if ((h & mask_s) == 0) {
+          found = true;
+          break;
+        }
+      }
+      size_t done = n - (q - p);
+      size += done;
+      left -= done;
+    }
+    if (! found && (left > 0) && (size < max_size)) {
+      size_t n = max_size - size;
+      if (n > left) {
+        n = left;
+      }
+      const unsigned char* q = p + n;
+      while (p < q) {
+        h = (h << 1) + gear.values[*p++];
+        if ((h & mask_l) == 0) {
+          found = true;
+          break;
+        }
+      }
+      size_t done = n - (q - p);
+      size += done;
+      left -= done;
+    }
+    fp = h;
+    if (hasher.put(start, p - start) < 0) {
+      return -1;
+    }
+    start = p;
+    if ((found || (size >= max_size)) && (cut() < 0)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+Chunker::Chunker(IReaderWriter* c, bool d, Hasher::Digest m, chunk_cb_f cb,
+  void* u, size_t min, size_t avg, size_t max) :
+  IReaderWriter(c, d), _d(new Private(m, cb, u, min, avg, max)) {}
+
+Chunker::~Chunker() {
+  delete _d;
+}
+
+int Chunker::open() {
+  if (_child->open() < 0) {
+    return -1;
+  }
+  _d->offset = 0;
+  _d->size = 0;
+  _d->fp = 0;
+  if (_d->hasher.open() < 0) {
+    _child->close();
+    return -1;
+  }
+  _d->hashing = true;
+  return 0;
+}
+
+int Chunker::close() {
+  int rc = 0;
+  if (! _d->hashing) {
+    rc = -1;
+  } else
+  if ((_d->size > 0) && (_d->cut() < 0)) {
+    rc = -1;
+  }
+  if (_d->hashing) {
+    _d->hashing = false;
+    if (_d->hasher.close() < 0) {
+      rc = -1;
+    }
+  }
+  if (_child->close() < 0) {
+    rc = -1;
+  }
+  return rc;
+}
+
+ssize_t Chunker::read(void* buffer, size_t size) {
+  ssize_t rc = _child->read(buffer, size);
+  if (rc < 0) {
+    return -1;
+  }
+  if (_d->feed(buffer, rc) < 0) {
+    return -1;
+  }
+  return rc;
+}
+
+ssize_t Chunker::get(void* buffer, size_t size) {
+  ssize_t rc = _child->get(buffer, size);
+  if (rc < 0) {
+    return -1;
+  }
+  if (_d->feed(buffer, rc) < 0) {
+    return -1;
+  }
+  return rc;
+}
+
+ssize_t Chunker::put(const void* buffer, size_t size) {
+  ssize_t rc = _child->put(buffer, size);
+  if (rc < 0) {
+    return -1;
+  }
+  if (_d->feed(buffer, rc) < 0) {
+    return -1;
+  }
+  return rc;
+}
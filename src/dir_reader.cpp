@@ -0,0 +1,192 @@
+/*
+    Copyright (C) 2011  Hervé Fache
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 3.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+
+#include "dir_reader.h"
+
+using namespace htoolbox;
+
+// Layout of the entries returned by getdents64
+struct linux_dirent64 {
+  uint64_t        d_ino;
+  int64_t         d_off;
+  unsigned short  d_reclen;
+  unsigned char   d_type;
+  char            d_name[];
+};
+
+struct DirReader::Private {
+  enum {
+    BUFFER_SIZE = 32768
+  };
+  struct Entry {
+    const char*   name;
+    size_t        offset;
+    unsigned char type;
+  };
+  int       fd;
+  // Kernel buffer
+  char*     buffer;
+  // Names, one after the other
+  char*     names;
+  size_t    names_size;
+  size_t    names_capacity;
+  // Entries, sorted once all read
+  Entry*    entries;
+  size_t    entries_size;
+  size_t    entries_capacity;
+  Private() : fd(-1), names(NULL), names_size(0), names_capacity(0),
+      entries(NULL), entries_size(0), entries_capacity(0) {
+    buffer = static_cast<char*>(malloc(BUFFER_SIZE));
+  }
+  ~Private() {
+    free(entries);
+    free(names);
+    free(buffer);
+  }
+  int add(const char* name, unsigned char type) {
+    size_t len = strlen(name) + 1;
+    if (names_size + len > names_capacity) {
+      size_t capacity = names_capacity > 0 ? names_capacity : 4096;
+      while (names_size + len > capacity) {
+        capacity *= 2;
+      }
+      char* new_names = static_cast<char*>(realloc(names, capacity));
+      if (new_names == NULL) {
+        return -1;
+      }
+      names = new_names;
+      names_capacity = capacity;
+    }
+    if (entries_size == entries_capacity) {
+      size_t capacity = entries_capacity > 0 ? 2 * entries_capacity : 256;
+      Entry* new_entries = static_cast<Entry*>(
+        realloc(entries, capacity * sizeof(Entry)));
+      if (new_entries == NULL) {
+        return -1;
+      }
+      entries = new_entries;
+      entries_capacity = capacity;
+    }
+    memcpy(&names[names_size], name, len);
+    // Names may move until all is read, so store the offset for now
+    entries[entries_size].offset = names_size;
+    entries[entries_size].type = type;
+    ++entries_size;
+    names_size += len;
+    return 0;
+  }
+  static int compare(const void* a, const void* b) {
+    return strcmp(static_cast<const Entry*>(a)->name,
+      static_cast<const Entry*>(b)->name);
+  }
+};
+
+DirReader::DirReader() : _d(new Private) {}
+
+DirReader::~DirReader() {
+  close();
+  delete _d;
+}
+
+int DirReader::open(const char* path) {
+  if (_d->fd >= 0) {
+    errno = EBUSY;
+    return -1;
+  }
+  _d->names_size = 0;
+  _d->entries_size = 0;
+  if (_d->buffer == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  _d->fd = ::open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (_d->fd < 0) {
+    return -1;
+  }
+  while (true) {
+    long size = syscall(SYS_getdents64, _d->fd, _d->buffer,
+      static_cast<unsigned int>(Private::BUFFER_SIZE));
+    if (size < 0) {
+      int errno_keep = errno;
+      close();
+      errno = errno_keep;
+      return -1;
+    }
+    if (size == 0) {
+      break;
+    }
+    for (long offset = 0; offset < size;) {
+      const linux_dirent64* d =
+        reinterpret_cast<const linux_dirent64*>(&_d->buffer[offset]);
+      offset += d->d_reclen;
+      // Skip '.' and '..'
+      if ((d->d_name[0] == '.') && ((d->d_name[1] == '\0') ||
+          ((d->d_name[1] == '.') && (d->d_name[2] == '\0')))) {
+        continue;
+      }
+      if (_d->add(d->d_name, d->d_type) < 0) {
+        errno = ENOMEM;
+        close();
+        return -1;
+      }
+    }
+  }
+  for (size_t i = 0; i < _d->entries_size; ++i) {
+    _d->entries[i].name = &_d->names[_d->entries[i].offset];
+  }
+  qsort(_d->entries, _d->entries_size, sizeof(Private::Entry),
+    Private::compare);
+  return static_cast<int>(_d->entries_size);
+}
+
+int DirReader::close() {
+  if (_d->fd < 0) {
+    return 0;
+  }
+  int rc = ::close(_d->fd);
+  _d->fd = -1;
+  return rc;
+}
+
+size_t DirReader::size() const {
+  return _d->entries_size;
+}
+
+const char* DirReader::name(size_t index) const {
+  return _d->entries[index].name;
+}
+
+unsigned char DirReader::type(size_t index) const {
+  return _d->entries[index].type;
+}
+
+int DirReader::stat(size_t index, struct stat64* metadata) const {
+  return fstatat64(_d->fd, _d->entries[index].name, metadata,
+    AT_SYMLINK_NOFOLLOW);
+}
+
+ssize_t DirReader::readlink(size_t index, char* buffer, size_t size) const {
+  return readlinkat(_d->fd, _d->entries[index].name, buffer, size);
+}
@@ -14,9 +14,12 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <stdlib.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <string.h>
@@ -26,13 +29,145 @@
 
 using namespace htoolbox;
 
+// Alignment of buffers and offsets for O_DIRECT
+static const size_t direct_align = 4096;
+
 struct FileReaderWriter::Private {
   char      path[PATH_MAX];
   bool      writer;
   int       fd;
-  Private(const char* p, bool w) : writer(w), fd(-1) {
+  int64_t   start;
+  // Buffer lent by peek() or reserve(): data peeked from begin to end, or
+  // region reserved up to end
+  char*     buffer;
+  size_t    capacity;
+  size_t    begin;
+  size_t    end;
+  // Memory-mapped reading: part of the file mapped from map_offset, when
+  // the file can be mapped
+  size_t    window;
+  bool      mapping;
+  int64_t   file_size;
+  char*     map;
+  int64_t   map_offset;
+  size_t    map_size;
+  // Direct writing: data staged in an aligned buffer, written when full
+  size_t    direct_size;
+  bool      direct;
+  bool      staging;
+  char*     staging_buffer;
+  size_t    staged;
+  Private(const char* p, bool w) : writer(w), fd(-1), start(0), buffer(NULL),
+      capacity(0), begin(0), end(0), window(0), mapping(false),
+      file_size(0), map(NULL),
+      map_offset(0), map_size(0), direct_size(0), direct(false),
+      staging(false), staging_buffer(NULL), staged(0) {
     strcpy(path, p);
   }
+  ~Private() {
+    unmap();
+    free(staging_buffer);
+    free(buffer);
+  }
+  int allocStaging() {
+    if (staging_buffer == NULL) {
+      void* b;
+      if (::posix_memalign(&b, direct_align, direct_size) != 0) {
+        return -1;
+      }
+      staging_buffer = static_cast<char*>(b);
+    }
+    return 0;
+  }
+  int dropDirect() {
+    int flags = ::fcntl(fd, F_GETFL);
+    if ((flags < 0) || (::fcntl(fd, F_SETFL, flags & ~O_DIRECT) < 0)) {
+      return -1;
+    }
+    direct = false;
+    return 0;
+  }
+  // Write staged data, without O_DIRECT if not whole blocks (tail)
+  int writeStaged() {
+    if (direct && ((staged % direct_align) != 0) && (dropDirect() < 0)) {
+      return -1;
+    }
+    size_t done = 0;
+    while (done < staged) {
+      ssize_t rc = ::write(fd, &staging_buffer[done], staged - done);
+      if (rc < 0) {
+        // Some filesystems accept O_DIRECT at open but not when writing
+        if ((errno == EINVAL) && direct) {
+          if (dropDirect() < 0) {
+            return -1;
+          }
+          continue;
+        }
+        return -1;
+      }
+      done += rc;
+    }
+    staged = 0;
+    return 0;
+  }
+  void unmap() {
+    if (map != NULL) {
+      ::munmap(map, map_size);
+      map = NULL;
+    }
+  }
+  int remap(int64_t offset) {
+    unmap();
+    map_offset = offset - offset % ::sysconf(_SC_PAGESIZE);
+    map_size = window;
+    if (file_size - map_offset < static_cast<int64_t>(map_size)) {
+      map_size = static_cast<size_t>(file_size - map_offset);
+    }
+    void* m = ::mmap64(NULL, map_size, PROT_READ, MAP_SHARED, fd, map_offset);
+    if (m == MAP_FAILED) {
+      return -1;
+    }
+    map = static_cast<char*>(m);
+    // Read ahead, and let the kernel know the access is sequential
+    ::madvise(map, map_size, MADV_SEQUENTIAL);
+    ::madvise(map, map_size, MADV_WILLNEED);
+    return 0;
+  }
+  // Get mapped data from offset, 0 at end of file
+  ssize_t mapped(int64_t offset, const char** data) {
+    if ((map == NULL) || (offset < map_offset) ||
+        (offset >= map_offset + static_cast<int64_t>(map_size))) {
+      if (offset >= file_size) {
+        return 0;
+      }
+      if (remap(offset) < 0) {
+        return -1;
+      }
+    }
+    *data = &map[offset - map_offset];
+    return static_cast<ssize_t>(map_offset + map_size - offset);
+  }
+  int grow(size_t size) {
+    if (size > capacity) {
+      char* new_buffer = static_cast<char*>(realloc(buffer, size));
+      if (new_buffer == NULL) {
+        return -1;
+      }
+      buffer = new_buffer;
+      capacity = size;
+    }
+    return 0;
+  }
+  // Give back data peeked but not consumed
+  size_t drain(void* out, size_t size) {
+    size_t length = end - begin;
+    if (length > size) {
+      length = size;
+    }
+    memcpy(out, &buffer[begin], length);
+    begin += length;
+    return length;
+  }
 };
 
 FileReaderWriter::FileReaderWriter(const char* path, bool writer) :
@@ -48,8 +183,43 @@ FileReaderWriter::~FileReaderWriter() {
 
 int FileReaderWriter::open() {
   _offset = 0;
+  _d->begin = _d->end = 0;
+  int64_t start = _d->start;
+  _d->start = 0;
   if (_d->writer) {
-    _d->fd = ::open64(_d->path, O_WRONLY|O_CREAT|O_LARGEFILE|O_TRUNC, 0666);
+    // When resuming, the file must be there already
+    int flags = O_WRONLY|O_LARGEFILE|(start > 0 ? 0 : O_CREAT|O_TRUNC);
+    _d->direct = false;
+    _d->staging = false;
+    _d->staged = 0;
+    // O_DIRECT needs aligned offsets, and not all filesystems support it
+    if ((_d->direct_size > 0) && ((start % direct_align) == 0) &&
+        (_d->allocStaging() == 0)) {
+      _d->fd = ::open64(_d->path, flags|O_DIRECT, 0666);
+      _d->direct = _d->staging = _d->fd >= 0;
+    }
+    if (_d->fd < 0) {
+      _d->fd = ::open64(_d->path, flags, 0666);
+    }
+    // Drop what was written after the given offset, but do not pad a file
+    // that lost data (e.g. in a crash after the state was saved) with zeroes
+    if ((_d->fd >= 0) && (start > 0)) {
+      struct stat64 metadata;
+      int rc = ::fstat64(_d->fd, &metadata);
+      if ((rc == 0) && (metadata.st_size < start)) {
+        errno = EINVAL;
+        rc = -1;
+      } else
+      if ((rc == 0) && (metadata.st_size > start)) {
+        rc = ::ftruncate64(_d->fd, start);
+      }
+      if (rc < 0) {
+        int errno_keep = errno;
+        ::close(_d->fd);
+        _d->fd = -1;
+        errno = errno_keep;
+      }
+    }
   } else {
     _d->fd = ::open64(_d->path, O_RDONLY|O_NOATIME|O_LARGEFILE);
     // Try without O_NOATIME
@@ -57,16 +227,78 @@ int FileReaderWriter::open() {
       _d->fd = ::open64(_d->path, O_RDONLY|O_LARGEFILE);
     }
   }
-  return _d->fd < 0 ? -1 : 0;
+  if (_d->fd < 0) {
+    return -1;
+  }
+  _d->mapping = false;
+  if (! _d->writer && (_d->window > 0)) {
+    struct stat64 metadata;
+    if (::fstat64(_d->fd, &metadata) < 0) {
+      int errno_keep = errno;
+      ::close(_d->fd);
+      _d->fd = -1;
+      errno = errno_keep;
+      return -1;
+    }
+    _d->file_size = metadata.st_size;
+    // Pipes, devices and files of unknown size (e.g. in /proc) are read
+    _d->mapping = S_ISREG(metadata.st_mode) && (metadata.st_size > 0);
+    // So are files on filesystems that cannot map them
+    if (_d->mapping &&
+        (_d->remap(start < _d->file_size ? start : 0) < 0)) {
+      if ((errno != ENODEV) && (errno != EACCES)) {
+        int errno_keep = errno;
+        ::close(_d->fd);
+        _d->fd = -1;
+        errno = errno_keep;
+        return -1;
+      }
+      _d->mapping = false;
+    }
+  }
+  if ((start > 0) && (seek(start) < 0)) {
+    int errno_keep = errno;
+    ::close(_d->fd);
+    _d->fd = -1;
+    errno = errno_keep;
+    return -1;
+  }
+  return 0;
 }
 
 int FileReaderWriter::close() {
-  int rc = ::close(_d->fd);
+  int rc = 0;
+  if (_d->staging && (_d->writeStaged() < 0)) {
+    rc = -1;
+  }
+  _d->staging = false;
+  _d->unmap();
+  if (::close(_d->fd) < 0) {
+    rc = -1;
+  }
   _d->fd = -1;
   return rc;
 }
 
 ssize_t FileReaderWriter::read(void* buffer, size_t size) {
+  if (_d->mapping) {
+    const char* data;
+    ssize_t length = _d->mapped(_offset, &data);
+    if (length <= 0) {
+      return length;
+    }
+    if (static_cast<size_t>(length) > size) {
+      length = size;
+    }
+    memcpy(buffer, data, length);
+    _offset += length;
+    return length;
+  }
+  if (_d->begin < _d->end) {
+    ssize_t length = _d->drain(buffer, size);
+    _offset += length;
+    return length;
+  }
   ssize_t rc = ::read(_d->fd, buffer, size);
   if (rc > 0) {
     _offset += rc;
@@ -78,6 +310,25 @@ ssize_t FileReaderWriter::get(void* buffer, size_t size) {
   char* cbuffer = static_cast<char*>(buffer);
   ssize_t ssize = size;
   ssize_t count = 0;
+  if (_d->mapping) {
+    while (count < ssize) {
+      ssize_t rc = read(&cbuffer[count], size - count);
+      if (rc < 0) {
+        return rc;
+      }
+      if (rc == 0) {
+        /* count < size => end of file */
+        break;
+      }
+      count += rc;
+    }
+    return count;
+  }
+  if (_d->begin < _d->end) {
+    count = _d->drain(buffer, size);
+    cbuffer += count;
+    _offset += count;
+  }
   while (count < ssize) {
     ssize_t rc = ::read(_d->fd, cbuffer, size - count);
     if (rc < 0) {
@@ -98,6 +349,22 @@ ssize_t FileReaderWriter::put(const void* buffer, size_t size) {
   const char* cbuffer = static_cast<const char*>(buffer);
   ssize_t ssize = size;
   ssize_t count = 0;
+  if (_d->staging) {
+    while (count < ssize) {
+      size_t length = _d->direct_size - _d->staged;
+      if (length > size - count) {
+        length = size - count;
+      }
+      memcpy(&_d->staging_buffer[_d->staged], &cbuffer[count], length);
+      _d->staged += length;
+      count += length;
+      _offset += length;
+      if ((_d->staged == _d->direct_size) && (_d->writeStaged() < 0)) {
+        return -1;
+      }
+    }
+    return count;
+  }
   while (count < ssize) {
     ssize_t rc = ::write(_d->fd, cbuffer, size - count);
     if (rc < 0) {
@@ -114,6 +381,233 @@ ssize_t FileReaderWriter::put(const void* buffer, size_t size) {
   return count;
 }
 
+ssize_t FileReaderWriter::getv(const struct iovec* iov, int count) {
+  // Data peeked but not consumed comes first, mapped data is just copied
+  if ((_d->begin < _d->end) || _d->mapping) {
+    return IReaderWriter::getv(iov, count);
+  }
+  ssize_t total = 0;
+  int i = 0;
+  while (i < count) {
+    int n = count - i;
+    if (n > IOV_MAX) {
+      n = IOV_MAX;
+    }
+    ssize_t rc = ::readv(_d->fd, &iov[i], n);
+    if (rc < 0) {
+      return -1;
+    }
+    if (rc == 0) {
+      /* end of file */
+      break;
+    }
+    total += rc;
+    _offset += rc;
+    // Skip full buffers
+    size_t done = rc;
+    while ((i < count) && (done >= iov[i].iov_len)) {
+      done -= iov[i].iov_len;
+      ++i;
+    }
+    // Fill up the one partly read
+    if (done > 0) {
+      size_t left = iov[i].iov_len - done;
+      rc = get(static_cast<char*>(iov[i].iov_base) + done, left);
+      if (rc < 0) {
+        return -1;
+      }
+      total += rc;
+      if (static_cast<size_t>(rc) < left) {
+        /* end of file */
+        break;
+      }
+      ++i;
+    }
+  }
+  return total;
+}
+
+ssize_t FileReaderWriter::putv(const struct iovec* iov, int count) {
+  if (_d->staging) {
+    return IReaderWriter::putv(iov, count);
+  }
+  ssize_t total = 0;
+  int i = 0;
+  while (i < count) {
+    int n = count - i;
+    if (n > IOV_MAX) {
+      n = IOV_MAX;
+    }
+    ssize_t rc = ::writev(_d->fd, &iov[i], n);
+    if (rc < 0) {
+      return -1;
+    }
+    total += rc;
+    _offset += rc;
+    // Skip buffers fully written
+    size_t done = rc;
+    while ((i < count) && (done >= iov[i].iov_len)) {
+      done -= iov[i].iov_len;
+      ++i;
+    }
+    if (rc == 0) {
+      break;
+    }
+    // Finish the one partly written
+    if (done > 0) {
+      size_t left = iov[i].iov_len - done;
+      rc = put(static_cast<const char*>(iov[i].iov_base) + done, left);
+      if (rc < 0) {
+        return -1;
+      }
+      total += rc;
+      if (static_cast<size_t>(rc) < left) {
+        break;
+      }
+      ++i;
+    }
+  }
+  return total;
+}
+
+int FileReaderWriter::seek(int64_t offset) {
+  if (offset < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (_d->fd < 0) {
+    _d->start = offset;
+    return 0;
+  }
+  // Write what is staged, then carry on without O_DIRECT
+  if (_d->staging) {
+    if ((_d->writeStaged() < 0) || (_d->direct && (_d->dropDirect() < 0))) {
+      return -1;
+    }
+    _d->staging = false;
+  }
+  if (::lseek64(_d->fd, offset, SEEK_SET) < 0) {
+    return -1;
+  }
+  _d->begin = _d->end = 0;
+  _offset = offset;
+  return 0;
+}
+
+ssize_t FileReaderWriter::peek(const void** buffer, size_t size) {
+  if (_d->writer) {
+    errno = EBADF;
+    return -1;
+  }
+  if (_d->mapping) {
+    const char* data;
+    ssize_t length = _d->mapped(_offset, &data);
+    if (length <= 0) {
+      return length;
+    }
+    if (static_cast<size_t>(length) > size) {
+      length = size;
+    }
+    *buffer = data;
+    return length;
+  }
+  if (_d->begin == _d->end) {
+    if (_d->grow(size) < 0) {
+      return -1;
+    }
+    ssize_t rc = ::read(_d->fd, _d->buffer, size);
+    if (rc < 0) {
+      return -1;
+    }
+    _d->begin = 0;
+    _d->end = rc;
+  }
+  size_t length = _d->end - _d->begin;
+  if (length > size) {
+    length = size;
+  }
+  *buffer = &_d->buffer[_d->begin];
+  return length;
+}
+
+ssize_t FileReaderWriter::advance(size_t size) {
+  if (_d->mapping) {
+    if (static_cast<int64_t>(size) > _d->file_size - _offset) {
+      errno = EINVAL;
+      return -1;
+    }
+    _offset += size;
+    return size;
+  }
+  if (_d->writer || (size > _d->end - _d->begin)) {
+    errno = EINVAL;
+    return -1;
+  }
+  _d->begin += size;
+  _offset += size;
+  return size;
+}
+
+ssize_t FileReaderWriter::reserve(void** buffer, size_t size) {
+  if (! _d->writer) {
+    errno = EBADF;
+    return -1;
+  }
+  // Lend the free part of the staging buffer
+  if (_d->staging) {
+    size_t length = _d->direct_size - _d->staged;
+    if (length > size) {
+      length = size;
+    }
+    _d->end = length;
+    *buffer = &_d->staging_buffer[_d->staged];
+    return length;
+  }
+  if (_d->grow(size) < 0) {
+    return -1;
+  }
+  _d->end = size;
+  *buffer = _d->buffer;
+  return size;
+}
+
+ssize_t FileReaderWriter::commit(size_t size) {
+  if (! _d->writer || (size > _d->end)) {
+    errno = EINVAL;
+    return -1;
+  }
+  _d->end = 0;
+  if (_d->staging) {
+    _d->staged += size;
+    _offset += size;
+    if ((_d->staged == _d->direct_size) && (_d->writeStaged() < 0)) {
+      return -1;
+    }
+    return size;
+  }
+  return put(_d->buffer, size);
+}
+
+void FileReaderWriter::setMapped(size_t window_size) {
+  if (_d->writer) {
+    return;
+  }
+  // Whole pages
+  size_t page = ::sysconf(_SC_PAGESIZE);
+  _d->window = (window_size + page - 1) / page * page;
+}
+
+void FileReaderWriter::setDirect(size_t buffer_size) {
+  if (! _d->writer) {
+    return;
+  }
+  free(_d->staging_buffer);
+  _d->staging_buffer = NULL;
+  // Whole blocks
+  _d->direct_size = (buffer_size + direct_align - 1) / direct_align *
+    direct_align;
+}
+
 const char* FileReaderWriter::path() const {
   return _d->path;
 }
@@ -29,6 +29,7 @@
 using namespace std;
 
 #include "report.h"
+#include "dir_reader.h"
 #include "files.h"
 
 using namespace htoolbox;
@@ -186,6 +187,17 @@ int Path::pathcmp(const char* ss1, const char* ss2, ssize_t length) {
   }
 }
 
+static char typeFromMode(mode_t mode) {
+  if (S_ISREG(mode))       return 'f';
+  else if (S_ISDIR(mode))  return 'd';
+  else if (S_ISCHR(mode))  return 'c';
+  else if (S_ISBLK(mode))  return 'b';
+  else if (S_ISFIFO(mode)) return 'p';
+  else if (S_ISLNK(mode))  return 'l';
+  else if (S_ISSOCK(mode)) return 's';
+  else                     return '?';
+}
+
 int Node::stat() {
   struct stat64 metadata;
   int rc = lstat64(_path, &metadata);
@@ -193,14 +205,7 @@ int Node::stat() {
     // errno set by lstat
     _type = '?';
   } else {
-    if (S_ISREG(metadata.st_mode))       _type = 'f';
-    else if (S_ISDIR(metadata.st_mode))  _type = 'd';
-    else if (S_ISCHR(metadata.st_mode))  _type = 'c';
-    else if (S_ISBLK(metadata.st_mode))  _type = 'b';
-    else if (S_ISFIFO(metadata.st_mode)) _type = 'p';
-    else if (S_ISLNK(metadata.st_mode))  _type = 'l';
-    else if (S_ISSOCK(metadata.st_mode)) _type = 's';
-    else                                 _type = '?';
+    _type = typeFromMode(metadata.st_mode);
     // Fill in file information
     _size   = metadata.st_size;
     _mtime  = metadata.st_mtime;
@@ -233,50 +238,29 @@ int Node::touch(
   return -1;
 }
 
-static int direntFilter(const struct dirent* a) {
-  if (a->d_name[0] != '.') return 1;
-  if (a->d_name[1] == '\0') return 0;
-  if (a->d_name[1] != '.') return 1;
-  if (a->d_name[2] == '\0') return 0;
-  return 1;
-}
-
-static int direntCompare(const dirent** a, const dirent** b) {
-  return strcmp((*a)->d_name, (*b)->d_name);
-}
-
 int Node::createList() {
   if (_nodes != NULL) {
     errno = EBUSY;
     return -1;
   }
   // Create list
-  struct dirent** direntList;
-  int size = scandir(_path, &direntList, direntFilter, direntCompare);
+  DirReader reader;
+  int size = reader.open(_path);
   if (size < 0) {
     return -1;
   }
-  // Cleanup list
-  int size2 = size;
-  while (size2--) {
-    free(direntList[size2]);
-  }
-  free(direntList);
+  reader.close();
   // Bug in CIFS client, usually gets detected by two subsequent dir reads
-  size2 = scandir(_path, &direntList, direntFilter, direntCompare);
+  int size2 = reader.open(_path);
+  if (size2 < 0) {
+    return -1;
+  }
   if (size != size2) {
+    reader.close();
     errno = EAGAIN;
-    size = size2;
-    size2 = -1;
-  }
-  if (size2 < 0) {
-    while (size--) {
-      free(direntList[size]);
-    }
-    free(direntList);
     return -1;
   }
-  // Ok, let's parse
+  // Ok, let's parse, getting metadata relative to the directory
   _nodes = new list<Node*>;
   bool failed = false;
   char path[PATH_MAX];
@@ -284,15 +268,34 @@ int Node::createList() {
   size_t path_len = strlen(path);
   path[path_len++] = '/';
   while (size--) {
-    strcpy(&path[path_len], direntList[size]->d_name);
-    Node *g = new Node(path);
-    free(direntList[size]);
+    strcpy(&path[path_len], reader.name(size));
+    Node* g;
+    struct stat64 metadata;
+    if (reader.stat(size, &metadata) < 0) {
+      // Let the constructor try again and report
+      g = new Node(path);
+    } else {
+      char type = typeFromMode(metadata.st_mode);
+      char link[PATH_MAX] = "";
+      if (type == 'l') {
+        ssize_t count = reader.readlink(size, link, sizeof(link) - 1);
+        if (count >= 0) {
+          metadata.st_size = count;
+        } else {
+          metadata.st_size = 0;
+        }
+        link[metadata.st_size] = '\0';
+      }
+      g = new Node(path, type, metadata.st_mtime, metadata.st_size,
+        metadata.st_uid, metadata.st_gid, metadata.st_mode & ~S_IFMT,
+        metadata.st_dev, link);
+    }
     if (g->type() == '?') {
       failed = true;
     }
     _nodes->push_front(g);
   }
-  free(direntList);
+  reader.close();
   return failed ? -1 : 0;
 }
 
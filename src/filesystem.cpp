@@ -17,63 +17,219 @@
 */
 
 #include <stdio.h>
+#include <unistd.h>
 #include <errno.h>
 #include <limits.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <pthread.h>
+
+#include <new>
+#include <list>
 
 #include "report.h"
 #include "shared_path.h"
 #include "files.h"
+#include "dir_reader.h"
 #include "filesystem.h"
 
 using namespace htoolbox;
 
-FsNode::FsNode(const char* n, mode_t m):
-  name(strdup(n)), mode(m), uid(0), gid(0), sibling(NULL) {}
+struct FsArena::Private {
+  enum {
+    CHUNK_SIZE = 65536,
+    // Enough for any node
+    ALIGNMENT = 16
+  };
+  struct Chunk {
+    Chunk*  next;
+    size_t  size;
+    size_t  used;
+    size_t  padding;  // keep data aligned
+    char*   data() { return reinterpret_cast<char*>(this + 1); }
+  };
+  // Chunk being filled by one thread, so it allocates without locking
+  struct Local {
+    pthread_t thread;
+    Chunk*    chunk;
+    Local(pthread_t t) : thread(t), chunk(NULL) {}
+  };
+  // Each thread remembers its Local for the last arena it allocated from
+  struct Cache {
+    unsigned long id;
+    Local*        local;
+  };
+  static __thread Cache cache;
+  static unsigned long  last_id;
+  Chunk*            head;
+  size_t            size;
+  std::list<Local>  locals;
+  // Changes on release(), so threads' caches get invalidated
+  unsigned long     id;
+  pthread_mutex_t   mutex;
+  Private() : head(NULL), size(0), id(__sync_add_and_fetch(&last_id, 1)) {
+    pthread_mutex_init(&mutex, NULL);
+  }
+  ~Private() {
+    release();
+    pthread_mutex_destroy(&mutex);
+  }
+  Local* local() {
+    if (cache.id == id) {
+      return cache.local;
+    }
+    pthread_t self = pthread_self();
+    pthread_mutex_lock(&mutex);
+    std::list<Local>::iterator it = locals.begin();
+    while ((it != locals.end()) && ! pthread_equal(it->thread, self)) {
+      ++it;
+    }
+    if (it == locals.end()) {
+      it = locals.insert(locals.end(), Local(self));
+    }
+    pthread_mutex_unlock(&mutex);
+    cache.id = id;
+    cache.local = &*it;
+    return cache.local;
+  }
+  Chunk* newChunk(size_t chunk_size) {
+    Chunk* chunk = static_cast<Chunk*>(malloc(sizeof(Chunk) + chunk_size));
+    if (chunk == NULL) {
+      throw std::bad_alloc();
+    }
+    chunk->size = chunk_size;
+    chunk->used = 0;
+    pthread_mutex_lock(&mutex);
+    chunk->next = head;
+    head = chunk;
+    size += sizeof(Chunk) + chunk_size;
+    pthread_mutex_unlock(&mutex);
+    return chunk;
+  }
+  void release() {
+    while (head != NULL) {
+      Chunk* next = head->next;
+      free(head);
+      head = next;
+    }
+    size = 0;
+    locals.clear();
+    id = __sync_add_and_fetch(&last_id, 1);
+  }
+};
+
+__thread FsArena::Private::Cache FsArena::Private::cache;
+unsigned long FsArena::Private::last_id = 0;
+
+FsArena::FsArena() : _d(new Private) {}
+
+FsArena::~FsArena() {
+  delete _d;
+}
+
+void* FsArena::alloc(size_t size) {
+  size = (size + Private::ALIGNMENT - 1) & ~(Private::ALIGNMENT - 1);
+  // Big allocations get their own chunk
+  if (size > Private::CHUNK_SIZE / 4) {
+    return _d->newChunk(size)->data();
+  }
+  Private::Local* local = _d->local();
+  Private::Chunk* chunk = local->chunk;
+  if ((chunk == NULL) || (chunk->used + size > chunk->size)) {
+    // Wasting what's left in this one
+    chunk = local->chunk = _d->newChunk(Private::CHUNK_SIZE);
+  }
+  void* p = &chunk->data()[chunk->used];
+  chunk->used += size;
+  return p;
+}
+
+char* FsArena::strdup(const char* string) {
+  size_t size = strlen(string) + 1;
+  char* copy = static_cast<char*>(alloc(size));
+  memcpy(copy, string, size);
+  return copy;
+}
+
+void FsArena::release() {
+  pthread_mutex_lock(&_d->mutex);
+  _d->release();
+  pthread_mutex_unlock(&_d->mutex);
+}
+
+size_t FsArena::size() const {
+  return _d->size;
+}
+
+FsNode::FsNode(const char* n, mode_t m, FsArena* arena):
+  name(arena == NULL ? strdup(n) : arena->strdup(n)),
+  mode(arena == NULL ? m : m | arena_bit), uid(0), gid(0), sibling(NULL) {}
 
 FsNode::~FsNode() {
-  free(name);
   if (S_ISDIR(mode)) {
     FsNodeDir* t = static_cast<FsNodeDir*>(this);
     t->clear();
-  } else
+    // The root owns the arena
+    if ((t->arena != NULL) && ((mode & arena_bit) == 0)) {
+      delete t->arena;
+    }
+  }
+  if ((mode & arena_bit) != 0) {
+    // Strings are in the arena
+    return;
+  }
+  free(name);
   if (S_ISLNK(mode)) {
     FsNodeLink* t = static_cast<FsNodeLink*>(this);
     free(t->string);
   }
 }
 
-FsNodeDir* FsNode::createRoot(const char* path) {
+FsNodeDir* FsNode::createRoot(const char* path, bool use_arena) {
   FsNodeDir* node = new FsNodeDir(path == NULL ? "" : path);
   node->mode = S_IFDIR;
+  if (use_arena) {
+    node->arena = new FsArena;
+  }
   return node;
 }
 
-FsNode* FsNode::createNode(const char* path, dev_t dev) {
-  struct stat64 metadata;
-  // Any error is fatal here
-  if (lstat64(path, &metadata) < 0) {
-    return NULL;
+template <class T>
+static T* allocNode(const char* name, FsArena* arena) {
+  if (arena == NULL) {
+    return new T(name);
+  }
+  return new (arena->alloc(sizeof(T))) T(name, arena);
+}
+
+template <>
+FsNodeNotDir* allocNode<FsNodeNotDir>(const char* name, FsArena* arena) {
+  if (arena == NULL) {
+    return new FsNodeNotDir(name);
   }
-  // Create node
+  return new (arena->alloc(sizeof(FsNodeNotDir))) FsNodeNotDir(name, 0, arena);
+}
+
+// Create node from metadata, leaving the link string to be read
+static FsNode* newNode(const char* name, struct stat64& metadata, dev_t dev,
+    FsArena* arena) {
   FsNode* node;
   if (S_ISDIR(metadata.st_mode)) {
-    node = new FsNodeDir(Path::basename(path));
+    node = allocNode<FsNodeDir>(name, arena);
   } else
   if (S_ISREG(metadata.st_mode)) {
-    node = new FsNodeFile(Path::basename(path));
+    node = allocNode<FsNodeFile>(name, arena);
   } else
   if (S_ISLNK(metadata.st_mode)) {
-    node = new FsNodeLink(Path::basename(path));
+    node = allocNode<FsNodeLink>(name, arena);
   } else
   {
-    node = new FsNodeNotDir(Path::basename(path));
+    node = allocNode<FsNodeNotDir>(name, arena);
   }
   // Populate
-  node->mode = metadata.st_mode & 0177777;
+  node->mode = (metadata.st_mode & 0177777) | (node->mode & FsNode::arena_bit);
   if ((dev != 0) && (dev != metadata.st_dev)) {
-    node->mode |= dev_changed_bit;
+    node->mode |= FsNode::dev_changed_bit;
   }
   node->uid = metadata.st_uid;
   node->gid = metadata.st_gid;
@@ -83,26 +239,139 @@ FsNode* FsNode::createNode(const char* path, dev_t dev) {
     not_dir->mtime = metadata.st_mtime;
     if (S_ISLNK(node->mode)) {
       FsNodeLink* link = static_cast<FsNodeLink*>(node);
+      size_t size = static_cast<int>(metadata.st_size) + 1;
       link->string = static_cast<char*>(
-        malloc(static_cast<int>(metadata.st_size) + 1));
-      ssize_t count = readlink(path, link->string,
-        static_cast<int>(metadata.st_size));
-      if (count >= 0) {
-        metadata.st_size = count;
-      } else {
-        metadata.st_size = 0;
-      }
-      link->string[metadata.st_size] = '\0';
+        arena == NULL ? malloc(size) : arena->alloc(size));
     }
   }
   return node;
 }
 
+// Terminate the link string, given the result of readlink
+static void setLinkSize(FsNode* node, ssize_t count) {
+  FsNodeLink* link = static_cast<FsNodeLink*>(node);
+  link->string[count >= 0 ? count : 0] = '\0';
+}
+
+FsNode* FsNode::createNode(const char* path, dev_t dev, FsArena* arena) {
+  struct stat64 metadata;
+  // Any error is fatal here
+  if (lstat64(path, &metadata) < 0) {
+    return NULL;
+  }
+  FsNode* node = newNode(Path::basename(path), metadata, dev, arena);
+  if (S_ISLNK(node->mode)) {
+    setLinkSize(node, readlink(path, static_cast<FsNodeLink*>(node)->string,
+      static_cast<int>(metadata.st_size)));
+  }
+  return node;
+}
+
+// Open addressing hash table of a directory's children, by name
+struct htoolbox::FsNodeIndex {
+  size_t    capacity;   // power of two
+  size_t    size;
+  FsNode**  slots;
+  static size_t hash(const char* name, size_t len) {
+    // FNV-1a
+    size_t h = 2166136261U;
+    for (size_t i = 0; i < len; ++i) {
+      h = (h ^ static_cast<unsigned char>(name[i])) * 16777619U;
+    }
+    return h;
+  }
+  static FsNodeIndex* create(size_t capacity, FsArena* arena) {
+    size_t size = sizeof(FsNodeIndex) + capacity * sizeof(FsNode*);
+    void* p = arena == NULL ? malloc(size) : arena->alloc(size);
+    if (p == NULL) {
+      throw std::bad_alloc();
+    }
+    FsNodeIndex* index = static_cast<FsNodeIndex*>(p);
+    index->capacity = capacity;
+    index->size = 0;
+    index->slots = reinterpret_cast<FsNode**>(index + 1);
+    memset(index->slots, 0, capacity * sizeof(FsNode*));
+    return index;
+  }
+  // Arena memory is only freed with the arena
+  static void destroy(FsNodeIndex* index, FsArena* arena) {
+    if (arena == NULL) {
+      free(index);
+    }
+  }
+  // Probing stops after going round, in case the table is full
+  FsNode* find(const char* name, size_t len) const {
+    size_t mask = capacity - 1;
+    size_t i = hash(name, len) & mask;
+    for (size_t n = 0; (n < capacity) && (slots[i] != NULL); ++n) {
+      if ((strncmp(name, slots[i]->name, len) == 0) &&
+          (slots[i]->name[len] == '\0')) {
+        return slots[i];
+      }
+      i = (i + 1) & mask;
+    }
+    return NULL;
+  }
+  // Latest added node wins, as for the list
+  int insert(FsNode* node, bool replace) {
+    size_t len = strlen(node->name);
+    size_t mask = capacity - 1;
+    size_t i = hash(node->name, len) & mask;
+    for (size_t n = 0; n < capacity; ++n) {
+      if (slots[i] == NULL) {
+        slots[i] = node;
+        ++size;
+        return 0;
+      }
+      if (strcmp(node->name, slots[i]->name) == 0) {
+        if (replace) {
+          slots[i] = node;
+        }
+        return 0;
+      }
+      i = (i + 1) & mask;
+    }
+    return -1;
+  }
+  // Keep load under one half
+  bool full() const {
+    return 2 * (size + 1) > capacity;
+  }
+};
+
+size_t FsNodeDir::index_threshold = 32;
+
+// Build index for all children, newest first, with load under one quarter
+static FsNodeIndex* buildIndex(FsNodeDir* dir) {
+  size_t capacity = 16;
+  while (capacity < 4 * dir->children) {
+    capacity <<= 1;
+  }
+  FsNodeIndex* index = FsNodeIndex::create(capacity, dir->arena);
+  for (FsNode* child = dir->children_head; child != NULL;
+      child = child->sibling) {
+    index->insert(child, false);
+  }
+  return index;
+}
+
 FsNode* FsNode::addChild(FsNode* node) {
   if (S_ISDIR(mode)) {
     FsNodeDir* t = static_cast<FsNodeDir*>(this);
     node->sibling = t->children_head;
     t->children_head = node;
+    ++t->children;
+    // Index as children get added, so look-ups do not modify the tree
+    if (t->index != NULL) {
+      if (t->index->full() || (t->index->insert(node, true) < 0)) {
+        FsNodeIndex::destroy(t->index, t->arena);
+        t->index = buildIndex(t);
+      }
+    } else
+    if ((FsNodeDir::index_threshold != 0) &&
+        (t->children >= FsNodeDir::index_threshold)) {
+      t->index = buildIndex(t);
+    }
     return node;
   } else {
     return NULL;
@@ -111,19 +380,20 @@ FsNode* FsNode::addChild(FsNode* node) {
 
 FsNode* FsNode::createChild(const char* name, char type) {
   if (S_ISDIR(mode)) {
+    FsArena* arena = static_cast<FsNodeDir*>(this)->arena;
     FsNode* f;
     switch (type) {
       case 'd':
-        f = new FsNodeDir(name);
+        f = allocNode<FsNodeDir>(name, arena);
         break;
       case 'f':
-        f = new FsNodeFile(name);
+        f = allocNode<FsNodeFile>(name, arena);
         break;
       case 'l':
-        f = new FsNodeLink(name);
+        f = allocNode<FsNodeLink>(name, arena);
         break;
       default:
-        f = new FsNodeNotDir(name);
+        f = allocNode<FsNodeNotDir>(name, arena);
     }
     return addChild(f);
   } else {
@@ -149,19 +419,24 @@ FsNode* FsNode::getNode(
   }
   if (S_ISDIR(mode)) {
     FsNodeDir* t = static_cast<FsNodeDir*>(this);
-    FsNode* child = t->children_head;
-    while (child != NULL) {
+    FsNode* child;
+    if (t->index != NULL) {
+      child = t->index->find(path, len);
+    } else {
+      child = t->children_head;
       // We use len because path is not 0-terminated, so check child name's length
-      if ((strncmp(path, child->name, len) == 0) &&
-          (child->name[len] == '\0')) {
-        if (end == NULL) {
-          // End of path
-          return child;
-        } else {
-          return child->getNode(++end);
-        }
+      while ((child != NULL) && ((strncmp(path, child->name, len) != 0) ||
+          (child->name[len] != '\0'))) {
+        child = child->sibling;
+      }
+    }
+    if (child != NULL) {
+      if (end == NULL) {
+        // End of path
+        return child;
+      } else {
+        return child->getNode(++end, create_missing);
       }
-      child = child->sibling;
     }
     // The path may not start from /, so add the missing links if needed
     if (create_missing) {
@@ -183,10 +458,12 @@ FsNode* FsNode::getNode(
 void FsNode::show(int level) const {
   char format[64];
   sprintf(format, "%%-%ds %%7o %%8jd %%s", 30 - level);
+  // Where the node was allocated is of no interest
+  mode_t shown_mode = mode & ~arena_bit;
   if (S_ISDIR(mode)) {
     const FsNodeDir* t = static_cast<const FsNodeDir*>(this);
     off_t zero = 0;
-    hlog_verbose_arrow(level, format, name, mode, zero, "");
+    hlog_verbose_arrow(level, format, name, shown_mode, zero, "");
     const FsNode* child = t->children_head;
     while (child != NULL) {
       child->show(level + 1);
@@ -195,63 +472,182 @@ void FsNode::show(int level) const {
   } else
   if (S_ISREG(mode)) {
     const FsNodeFile* t = static_cast<const FsNodeFile*>(this);
-    hlog_verbose_arrow(level, format, name, mode, t->size, t->hash);
+    hlog_verbose_arrow(level, format, name, shown_mode, t->size, t->hash);
   } else
   if (S_ISLNK(mode)) {
     const FsNodeLink* t = static_cast<const FsNodeLink*>(this);
-    hlog_verbose_arrow(level, format, name, mode, t->size, t->string);
+    hlog_verbose_arrow(level, format, name, shown_mode, t->size, t->string);
   } else
   {
     const FsNodeNotDir* t = static_cast<const FsNodeNotDir*>(this);
-    hlog_verbose_arrow(level, format, name, mode, t->size, "");
+    hlog_verbose_arrow(level, format, name, shown_mode, t->size, "");
   }
 }
 
-static int direntFilter(const struct dirent* a) {
-  if (a->d_name[0] != '.') return 1;
-  if (a->d_name[1] == '\0') return 0;
-  if (a->d_name[1] != '.') return 1;
-  if (a->d_name[2] == '\0') return 0;
-  return 1;
-}
-
-static int direntCompare(const dirent** a, const dirent** b) {
-  return strcmp((*a)->d_name, (*b)->d_name);
+int FsNodeDir::read(const char* path, dev_t dev) {
+  DirReader reader;
+  return read(reader, path, dev);
 }
 
-int FsNodeDir::read(const char* path, dev_t dev) {
-  char full_path[PATH_MAX];
-  strcpy(full_path, path);
-  size_t full_path_len = strlen(full_path);
+int FsNodeDir::read(DirReader& reader, const char* path, dev_t dev) {
   // Get entries
-  struct dirent** direntList;
-  int size = scandir(full_path, &direntList, direntFilter, direntCompare);
+  int size = reader.open(path);
   if (size < 0) {
     return -1;
   }
   bool failed = false;
+  // Sorted, and we add at the head
   while (size--) {
-    if (! failed) {
-      // Stat
-      const char* basename = direntList[size]->d_name;
-      SharedPath shared(full_path, full_path_len, basename);
-      FsNode* node = createNode(full_path, dev);
-      if (node == NULL) {
-        failed = true;
-      } else {
-        addChild(node);
-      }
+    // Stat, relative to the directory
+    struct stat64 metadata;
+    if (reader.stat(size, &metadata) < 0) {
+      failed = true;
+      break;
     }
-    free(direntList[size]);
+    FsNode* node = newNode(reader.name(size), metadata, dev, arena);
+    if (S_ISLNK(node->mode)) {
+      setLinkSize(node, reader.readlink(size,
+        static_cast<FsNodeLink*>(node)->string,
+        static_cast<int>(metadata.st_size)));
+    }
+    addChild(node);
   }
-  free(direntList);
+  reader.close();
   return failed ? -1 : 0;
 }
 
 void FsNodeDir::clear() {
+  if (index != NULL) {
+    FsNodeIndex::destroy(index, arena);
+    index = NULL;
+  }
+  children = 0;
+  if (arena != NULL) {
+    // Children are in the arena, freed all at once by its owner
+    children_head = NULL;
+    if ((mode & arena_bit) == 0) {
+      arena->release();
+    }
+    return;
+  }
   FsNode* child;
   while ((child = children_head) != NULL) {
     children_head = child->sibling;
     delete child;
   }
 }
+
+// Shared state for readTree(): directories left to read, and their count
+struct TreeScan {
+  struct Job {
+    FsNodeDir*  dir;
+    char*       path;
+    Job(FsNodeDir* d, char* p) : dir(d), path(p) {}
+  };
+  dev_t             dev;
+  std::list<Job>    jobs;
+  // Jobs queued or being processed
+  size_t            pending;
+  int               error;
+  pthread_mutex_t   mutex;
+  pthread_cond_t    cond;
+  TreeScan(dev_t d) : dev(d), pending(0), error(0) {
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&cond, NULL);
+  }
+  ~TreeScan() {
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&mutex);
+  }
+  // Called with mutex locked
+  void add(FsNodeDir* dir, const char* path) {
+    // Depth first, to keep the number of queued paths low
+    jobs.push_front(Job(dir, strdup(path)));
+    ++pending;
+    pthread_cond_signal(&cond);
+  }
+  void process(DirReader& reader, const Job& job) {
+    int rc = job.dir->read(reader, job.path, dev);
+    if (rc < 0) {
+      int read_errno = errno;
+      hlog_error("%m reading dir '%s'", job.path);
+      job.dir->mode |= FsNode::read_issue_bit;
+      pthread_mutex_lock(&mutex);
+      if (error == 0) {
+        error = read_errno;
+      }
+      pthread_mutex_unlock(&mutex);
+    }
+    // Partially read directories are still descended into
+    char full_path[PATH_MAX];
+    strcpy(full_path, job.path);
+    size_t full_path_len = strlen(full_path);
+    pthread_mutex_lock(&mutex);
+    for (FsNode* child = job.dir->children_head; child != NULL;
+        child = child->sibling) {
+      if (S_ISDIR(child->mode) && ! child->deviceChanged()) {
+        SharedPath shared(full_path, full_path_len, child->name);
+        add(static_cast<FsNodeDir*>(child), full_path);
+      }
+    }
+    if (--pending == 0) {
+      // All done: wake up everybody
+      pthread_cond_broadcast(&cond);
+    }
+    pthread_mutex_unlock(&mutex);
+  }
+  void run() {
+    // One per thread, so its buffers get re-used
+    DirReader reader;
+    pthread_mutex_lock(&mutex);
+    while (true) {
+      while (jobs.empty() && (pending > 0)) {
+        pthread_cond_wait(&cond, &mutex);
+      }
+      if (pending == 0) {
+        break;
+      }
+      Job job = jobs.front();
+      jobs.pop_front();
+      pthread_mutex_unlock(&mutex);
+      process(reader, job);
+      free(job.path);
+      pthread_mutex_lock(&mutex);
+    }
+    pthread_mutex_unlock(&mutex);
+  }
+  static void* thread(void* data) {
+    static_cast<TreeScan*>(data)->run();
+    return NULL;
+  }
+};
+
+int FsNodeDir::readTree(const char* path, dev_t dev, size_t threads) {
+  if (threads == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 0 ? static_cast<size_t>(cpus) : 1;
+  }
+  TreeScan scan(dev);
+  scan.add(this, path);
+  // This thread is one of the workers
+  pthread_t* tids = new pthread_t[threads - 1];
+  size_t started = 0;
+  while (started < threads - 1) {
+    int rc = pthread_create(&tids[started], NULL, TreeScan::thread, &scan);
+    if (rc != 0) {
+      hlog_warning("%s creating thread, using %zu", strerror(rc), started + 1);
+      break;
+    }
+    ++started;
+  }
+  scan.run();
+  for (size_t i = 0; i < started; ++i) {
+    pthread_join(tids[i], NULL);
+  }
+  delete[] tids;
+  if (scan.error != 0) {
+    errno = scan.error;
+    return -1;
+  }
+  return 0;
+}
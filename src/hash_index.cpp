@@ -0,0 +1,578 @@
+/*
+     Copyright (C) 2011  Hervé Fache
+
+     This program is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License version 2 as
+     published by the Free Software Foundation.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program; if not, write to the Free Software
+     Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <string>
+
+#include <report.h>
+#include "hash_index.h"
+
+using namespace htoolbox;
+
+// File layout: the header, then records and nodes in the order they were
+// written, all aligned to 8 bytes.  Offsets are from the start of the file, 0
+// meaning none.
+static const char magic[8] = { 'H', 'T', 'I', 'D', 'X', '1', '\n', '\0' };
+
+struct Header {
+  char      magic[8];
+  uint64_t  size;       // Size of the committed data
+  uint64_t  root;       // Offset of root node
+  uint64_t  count;      // Number of hashes
+  uint64_t  hash_size;  // Length of all hashes
+};
+
+struct Node {
+  uint16_t  mask;       // Which of the 16 children exist
+  uint16_t  leaves;     // Which of the children are records
+  uint32_t  reserved;
+  uint64_t  children[]; // Offsets, only for existing children
+  int count() const { return __builtin_popcount(mask); }
+  bool has(int i) const { return (mask & (1 << i)) != 0; }
+  bool isLeaf(int i) const { return (leaves & (1 << i)) != 0; }
+  uint64_t get(int i) const {
+    return children[__builtin_popcount(mask & ((1 << i) - 1))];
+  }
+};
+
+static int getIndex(char c) {
+  return (c >= 'a' ? c - 'a' + 10: c >= 'A' ? c - 'A' + 10 : c >= '0' ?
+    c - '0' : 0) & 0xf;
+}
+
+static size_t align(size_t size) {
+  return (size + 7) & ~static_cast<size_t>(7);
+}
+
+struct HashIndex::Private {
+  const char*   base;
+  size_t        length;
+  // Copied, as the writer changes it in the file
+  Header        header;
+  Private() : base(NULL), length(0) {
+    header.size = 0;
+    header.root = 0;
+    header.count = 0;
+    header.hash_size = 0;
+  }
+  // Offsets come from the file, so are checked before use
+  const Node* node(uint64_t offset) const {
+    if ((offset < sizeof(Header)) || ((offset & 7) != 0) ||
+        (offset + sizeof(Node) > header.size)) {
+      return NULL;
+    }
+    const Node* n = reinterpret_cast<const Node*>(&base[offset]);
+    if (offset + sizeof(Node) + n->count() * sizeof(uint64_t) >
+        header.size) {
+      return NULL;
+    }
+    return n;
+  }
+  const Record* record(uint64_t offset) const {
+    if ((offset < sizeof(Header)) || ((offset & 7) != 0) ||
+        (offset + sizeof(Record) > header.size)) {
+      return NULL;
+    }
+    const Record* r = reinterpret_cast<const Record*>(&base[offset]);
+    if ((offset + sizeof(Record) + r->hash_size + r->data_size + 2 >
+          header.size) ||
+        (r->strings[r->hash_size] != '\0') ||
+        (r->data()[r->data_size] != '\0')) {
+      return NULL;
+    }
+    return r;
+  }
+  const Record* first(const Node* n) const;
+  const Record* after(const Node* n, const char* hash, int level) const;
+  void show(const Node* n, int level) const;
+};
+
+const HashIndex::Record* HashIndex::Private::first(const Node* n) const {
+  while (n != NULL) {
+    if (n->mask == 0) {
+      return NULL;
+    }
+    int i = __builtin_ctz(n->mask);
+    if (n->isLeaf(i)) {
+      return record(n->get(i));
+    }
+    n = node(n->get(i));
+  }
+  return NULL;
+}
+
+const HashIndex::Record* HashIndex::Private::after(const Node* n,
+    const char* hash, int level) const {
+  int i = getIndex(hash[level]);
+  if (n->has(i)) {
+    if (n->isLeaf(i)) {
+      const Record* r = record(n->get(i));
+      if ((r != NULL) && (strcasecmp(r->hash(), hash) > 0)) {
+        return r;
+      }
+    } else
+    if (hash[level] != '\0') {
+      const Node* child = node(n->get(i));
+      if (child != NULL) {
+        const Record* found = after(child, hash, level + 1);
+        if (found != NULL) {
+          return found;
+        }
+      }
+    }
+  }
+  // First child after i
+  uint16_t later = static_cast<uint16_t>(n->mask & ~((2 << i) - 1));
+  if (later == 0) {
+    return NULL;
+  }
+  int j = __builtin_ctz(later);
+  if (n->isLeaf(j)) {
+    return record(n->get(j));
+  }
+  return first(node(n->get(j)));
+}
+
+void HashIndex::Private::show(const Node* n, int level) const {
+  ++level;
+  for (int i = 0; i < 16; ++i) {
+    if (n->has(i)) {
+      if (n->isLeaf(i)) {
+        const Record* r = record(n->get(i));
+        hlog_verbose_arrow(level, "[%x] %s", i, r != NULL ? r->hash() :
+          "(corrupted)");
+      } else {
+        hlog_verbose_arrow(level, "[%x] (node)", i);
+        const Node* child = node(n->get(i));
+        if (child != NULL) {
+          show(child, level);
+        } else {
+          hlog_verbose_arrow(level + 1, "(corrupted)");
+        }
+      }
+    }
+  }
+}
+
+HashIndex::HashIndex() : _d(new Private) {}
+
+HashIndex::~HashIndex() {
+  if (_d->base != NULL) {
+    close();
+  }
+  delete _d;
+}
+
+int HashIndex::open(const char* path) {
+  int fd = ::open64(path, O_RDONLY|O_LARGEFILE);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat64 metadata;
+  if (fstat64(fd, &metadata) < 0) {
+    ::close(fd);
+    return -1;
+  }
+  if (static_cast<size_t>(metadata.st_size) < sizeof(Header)) {
+    ::close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+  void* base = mmap(NULL, metadata.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  // The mapping remains valid after closing
+  ::close(fd);
+  if (base == MAP_FAILED) {
+    return -1;
+  }
+  const Header* header = static_cast<const Header*>(base);
+  if ((memcmp(header->magic, magic, sizeof(magic)) != 0) ||
+      (header->size > static_cast<uint64_t>(metadata.st_size))) {
+    munmap(base, metadata.st_size);
+    errno = EINVAL;
+    return -1;
+  }
+  _d->base = static_cast<const char*>(base);
+  _d->length = metadata.st_size;
+  _d->header = *header;
+  return 0;
+}
+
+int HashIndex::close() {
+  int rc = munmap(const_cast<char*>(_d->base), _d->length);
+  _d->base = NULL;
+  _d->length = 0;
+  _d->header.root = 0;
+  _d->header.count = 0;
+  return rc;
+}
+
+size_t HashIndex::size() const {
+  return _d->base != NULL ? _d->header.count : 0;
+}
+
+const HashIndex::Record* HashIndex::find(const char* hash) const {
+  if ((_d->base == NULL) || (_d->header.root == 0) ||
+      (strlen(hash) != _d->header.hash_size)) {
+    return NULL;
+  }
+  const Node* n = _d->node(_d->header.root);
+  for (int level = 0; n != NULL; ++level) {
+    int i = getIndex(hash[level]);
+    if (! n->has(i)) {
+      return NULL;
+    }
+    if (n->isLeaf(i)) {
+      const Record* r = _d->record(n->get(i));
+      if ((r == NULL) || (strcasecmp(r->hash(), hash) != 0)) {
+        return NULL;
+      }
+      return r;
+    }
+    n = _d->node(n->get(i));
+  }
+  return NULL;
+}
+
+const HashIndex::Record* HashIndex::next(const char* hash) const {
+  if ((_d->base == NULL) || (_d->header.root == 0)) {
+    return NULL;
+  }
+  const Node* root = _d->node(_d->header.root);
+  if (root == NULL) {
+    return NULL;
+  }
+  if (hash == NULL) {
+    return _d->first(root);
+  }
+  return _d->after(root, hash, 0);
+}
+
+void HashIndex::show() const {
+  if ((_d->base == NULL) || (_d->header.root == 0)) {
+    return;
+  }
+  const Node* root = _d->node(_d->header.root);
+  if (root != NULL) {
+    _d->show(root, 0);
+  }
+}
+
+struct HashIndexWriter::Private {
+  enum {
+    BUFFER_SIZE = 1 << 20
+  };
+  // Node being modified, with all 16 children expanded
+  struct WNode {
+    uint16_t  mask;
+    uint16_t  leaves;
+    uint64_t  children[16];
+    WNode*    modified[16];
+    WNode() : mask(0), leaves(0) {
+      for (int i = 0; i < 16; ++i) {
+        modified[i] = NULL;
+      }
+    }
+    ~WNode() {
+      for (int i = 0; i < 16; ++i) {
+        delete modified[i];
+      }
+    }
+  };
+  int           fd;
+  Header        header;
+  WNode*        root;
+  bool          changed;
+  // Data not yet written, to be put at offset 'flushed'
+  std::string   pending;
+  uint64_t      flushed;
+  Private() : fd(-1), root(NULL), changed(false), flushed(0) {}
+  uint64_t end() const {
+    return flushed + pending.size();
+  }
+  int flush() {
+    size_t done = 0;
+    while (done < pending.size()) {
+      ssize_t rc = pwrite64(fd, &pending[done], pending.size() - done,
+        flushed + done);
+      if (rc < 0) {
+        return -1;
+      }
+      done += rc;
+    }
+    flushed += pending.size();
+    pending.clear();
+    return 0;
+  }
+  int readAt(uint64_t offset, void* buffer, size_t size) {
+    if (offset >= flushed) {
+      memcpy(buffer, &pending[offset - flushed], size);
+      return 0;
+    }
+    ssize_t rc = pread64(fd, buffer, size, offset);
+    if (rc < 0) {
+      return -1;
+    }
+    if (static_cast<size_t>(rc) < size) {
+      errno = EINVAL;
+      return -1;
+    }
+    return 0;
+  }
+  uint64_t append(const void* data, size_t size) {
+    uint64_t offset = end();
+    pending.append(static_cast<const char*>(data), size);
+    pending.append(align(size) - size, '\0');
+    if ((pending.size() >= BUFFER_SIZE) && (flush() < 0)) {
+      return 0;
+    }
+    return offset;
+  }
+  WNode* load(uint64_t offset) {
+    WNode* n = new WNode;
+    if (offset == 0) {
+      return n;
+    }
+    Node node;
+    uint64_t children[16];
+    if ((readAt(offset, &node, sizeof(Node)) < 0) ||
+        (readAt(offset + sizeof(Node), children,
+          node.count() * sizeof(uint64_t)) < 0)) {
+      delete n;
+      return NULL;
+    }
+    n->mask = node.mask;
+    n->leaves = node.leaves;
+    for (int i = 0, pos = 0; i < 16; ++i) {
+      if (node.has(i)) {
+        n->children[i] = children[pos++];
+      }
+    }
+    return n;
+  }
+  uint64_t write(WNode* n) {
+    char buffer[sizeof(Node) + 16 * sizeof(uint64_t)];
+    Node* node = reinterpret_cast<Node*>(buffer);
+    node->mask = n->mask;
+    node->leaves = n->leaves;
+    node->reserved = 0;
+    for (int i = 0, pos = 0; i < 16; ++i) {
+      if (n->modified[i] != NULL) {
+        n->children[i] = write(n->modified[i]);
+        if (n->children[i] == 0) {
+          return 0;
+        }
+      }
+      if (node->has(i)) {
+        node->children[pos++] = n->children[i];
+      }
+    }
+    return append(buffer, sizeof(Node) + node->count() * sizeof(uint64_t));
+  }
+};
+
+HashIndexWriter::HashIndexWriter() : _d(new Private) {}
+
+HashIndexWriter::~HashIndexWriter() {
+  if (_d->fd >= 0) {
+    close();
+  }
+  delete _d;
+}
+
+int HashIndexWriter::open(const char* path) {
+  _d->fd = ::open64(path, O_RDWR|O_CREAT|O_LARGEFILE, 0666);
+  if (_d->fd < 0) {
+    return -1;
+  }
+  ssize_t rc = pread64(_d->fd, &_d->header, sizeof(Header), 0);
+  if (rc == 0) {
+    memcpy(_d->header.magic, magic, sizeof(magic));
+    _d->header.size = sizeof(Header);
+    _d->header.root = 0;
+    _d->header.count = 0;
+    _d->header.hash_size = 0;
+    if (pwrite64(_d->fd, &_d->header, sizeof(Header), 0) !=
+        static_cast<ssize_t>(sizeof(Header))) {
+      rc = -1;
+    }
+  } else
+  if ((rc == static_cast<ssize_t>(sizeof(Header))) &&
+      (memcmp(_d->header.magic, magic, sizeof(magic)) == 0)) {
+    // Drop whatever was written after the last commit
+    if (ftruncate64(_d->fd, _d->header.size) < 0) {
+      rc = -1;
+    }
+  } else
+  if (rc >= 0) {
+    errno = EINVAL;
+    rc = -1;
+  }
+  if (rc < 0) {
+    int errno_keep = errno;
+    ::close(_d->fd);
+    _d->fd = -1;
+    errno = errno_keep;
+    return -1;
+  }
+  _d->flushed = _d->header.size;
+  return 0;
+}
+
+int HashIndexWriter::close() {
+  int rc = commit();
+  if (::close(_d->fd) < 0) {
+    rc = -1;
+  }
+  _d->fd = -1;
+  return rc;
+}
+
+int HashIndexWriter::add(const char* hash, const char* data) {
+  size_t hash_size = strlen(hash);
+  if (_d->header.hash_size == 0) {
+    if (hash_size == 0) {
+      errno = EINVAL;
+      return -1;
+    }
+    _d->header.hash_size = hash_size;
+  } else
+  if (hash_size != _d->header.hash_size) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (_d->root == NULL) {
+    _d->root = _d->load(_d->header.root);
+    if (_d->root == NULL) {
+      return -1;
+    }
+  }
+  Private::WNode* n = _d->root;
+  for (size_t level = 0; level < hash_size; ++level) {
+    int i = getIndex(hash[level]);
+    if (n->modified[i] != NULL) {
+      n = n->modified[i];
+    } else
+    if (! (n->mask & (1 << i))) {
+      // Free slot: add record
+      size_t data_size = strlen(data);
+      size_t size = sizeof(HashIndex::Record) + hash_size + data_size + 2;
+      HashIndex::Record* record = static_cast<HashIndex::Record*>(malloc(size));
+      record->hash_size = static_cast<uint32_t>(hash_size);
+      record->data_size = static_cast<uint32_t>(data_size);
+      memcpy(record->strings, hash, hash_size + 1);
+      memcpy(&record->strings[hash_size + 1], data, data_size + 1);
+      uint64_t offset = _d->append(record, size);
+      free(record);
+      if (offset == 0) {
+        return -1;
+      }
+      n->children[i] = offset;
+      n->mask = static_cast<uint16_t>(n->mask | (1 << i));
+      n->leaves = static_cast<uint16_t>(n->leaves | (1 << i));
+      ++_d->header.count;
+      _d->changed = true;
+      return 0;
+    } else
+    if (n->leaves & (1 << i)) {
+      // HashIndex::Record there: compare, then push it down a level
+      std::string existing(hash_size + 1, '\0');
+      if (_d->readAt(n->children[i] + sizeof(HashIndex::Record), &existing[0],
+          hash_size + 1) < 0) {
+        return -1;
+      }
+      if (strcasecmp(existing.c_str(), hash) == 0) {
+        return 1;
+      }
+      Private::WNode* child = new Private::WNode;
+      int j = getIndex(existing[level + 1]);
+      child->mask = static_cast<uint16_t>(1 << j);
+      child->leaves = static_cast<uint16_t>(1 << j);
+      child->children[j] = n->children[i];
+      n->leaves = static_cast<uint16_t>(n->leaves & ~(1 << i));
+      n->modified[i] = child;
+      n = child;
+    } else
+    {
+      // Node there: load it to modify it
+      Private::WNode* child = _d->load(n->children[i]);
+      if (child == NULL) {
+        return -1;
+      }
+      n->modified[i] = child;
+      n = child;
+    }
+  }
+  // Cannot happen with hashes of the same length
+  errno = EINVAL;
+  return -1;
+}
+
+int HashIndexWriter::commit() {
+  if (! _d->changed) {
+    delete _d->root;
+    _d->root = NULL;
+    return 0;
+  }
+  uint64_t root = _d->write(_d->root);
+  delete _d->root;
+  _d->root = NULL;
+  _d->changed = false;
+  int rc = 0;
+  if ((root == 0) || (_d->flush() < 0) || (fdatasync(_d->fd) < 0)) {
+    rc = -1;
+  } else {
+    // Only now that the data is on disk, make it reachable
+    Header header = _d->header;
+    header.root = root;
+    header.size = _d->flushed;
+    if ((pwrite64(_d->fd, &header, sizeof(Header), 0) !=
+          static_cast<ssize_t>(sizeof(Header))) ||
+        (fdatasync(_d->fd) < 0)) {
+      rc = -1;
+    }
+  }
+  // Whatever happens, go back to what the file says
+  int errno_keep = errno;
+  if (pread64(_d->fd, &_d->header, sizeof(Header), 0) !=
+      static_cast<ssize_t>(sizeof(Header))) {
+    rc = -1;
+  } else {
+    errno = errno_keep;
+  }
+  _d->pending.clear();
+  _d->flushed = _d->header.size;
+  if (rc < 0) {
+    return -1;
+  }
+  hlog_regression("committed %zu hashes, size %zu",
+    static_cast<size_t>(_d->header.count),
+    static_cast<size_t>(_d->header.size));
+  return 0;
+}
+
+size_t HashIndexWriter::size() const {
+  return _d->header.count;
+}
@@ -14,35 +14,66 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <pthread.h>
 #include <openssl/evp.h>
+#include <openssl/md4.h>
+#include <openssl/md5.h>
+#include <openssl/sha.h>
+#include <openssl/ripemd.h>
+
+#include <list>
+#include <vector>
 
 #include <report.h>
 #include "hasher.h"
 
 using namespace htoolbox;
 
-struct Hasher::Private {
-  Digest         digest;
-  char*          hash;
-  EVP_MD_CTX ctx;
-  Private(Digest m, char *h) : digest(m), hash(h) {}
-  void binToHex(char* out, const unsigned char* in, int bytes) {
-    const char* hex = "0123456789abcdef";
+static const EVP_MD* getDigest(Hasher::Digest digest) {
+  switch (digest) {
+    case Hasher::md_null:
+      return EVP_md_null();
+    case Hasher::md4:
+      return EVP_md4();
+    case Hasher::md5:
+      return EVP_md5();
+    case Hasher::sha:
+      return EVP_sha();
+    case Hasher::sha1:
+      return EVP_sha1();
+    case Hasher::dss:
+      return EVP_dss();
+    case Hasher::sha224:
+      return EVP_sha224();
+    case Hasher::sha256:
+      return EVP_sha256();
+    case Hasher::sha384:
+      return EVP_sha384();
+    case Hasher::sha512:
+      return EVP_sha512();
+    case Hasher::dss1:
+      return EVP_dss1();
+    case Hasher::ripemd160:
+      return EVP_ripemd160();
+  }
+  return NULL;
+}
 
-    while (bytes-- != 0) {
-      *out++ = hex[*in >> 4];
-      *out++ = hex[*in & 0xf];
-      in++;
-    }
-    *out = '\0';
+static void binToHex(char* out, const unsigned char* in, int bytes) {
+  const char* hex = "0123456789abcdef";
+
+  while (bytes-- != 0) {
+    *out++ = hex[*in >> 4];
+    *out++ = hex[*in & 0xf];
+    in++;
   }
-  int update(const void* buffer, size_t size);
-};
+  *out = '\0';
+}
 
-int Hasher::Private::update(
-    const void*     buffer,
-    size_t          size) {
+static int digestUpdate(EVP_MD_CTX* ctx, const void* buffer, size_t size) {
   size_t      max = 409600; // That's as much as openssl/md5 accepts
   const char* cbuffer = static_cast<const char*>(buffer);
   while (size > 0) {
@@ -52,7 +83,7 @@ int Hasher::Private::update(
     } else {
       length = size;
     }
-    if (EVP_DigestUpdate(&ctx, cbuffer, length) != 1) {
+    if (EVP_DigestUpdate(ctx, cbuffer, length) != 1) {
       hlog_alert("failed to update hasher");
       errno = EUNATCH;
       return -1;
@@ -63,63 +94,400 @@ int Hasher::Private::update(
   return 0;
 }
 
+// Low-level digest functions, which state is a plain structure
+struct LowLevel {
+  int    (*init)(void* state);
+  int    (*update)(void* state, const void* buffer, size_t size);
+  int    (*finish)(unsigned char* md, void* state);
+  size_t state_size;
+};
+
+template<typename C, int (*I)(C*), int (*U)(C*, const void*, size_t),
+    int (*F)(unsigned char*, C*)>
+struct LowLevelDigest {
+  static int init(void* state) {
+    return I(static_cast<C*>(state));
+  }
+  static int update(void* state, const void* buffer, size_t size) {
+    return U(static_cast<C*>(state), buffer, size);
+  }
+  static int finish(unsigned char* md, void* state) {
+    return F(md, static_cast<C*>(state));
+  }
+  static const LowLevel* get() {
+    static const LowLevel low_level = { init, update, finish, sizeof(C) };
+    return &low_level;
+  }
+};
+
+static const LowLevel* getLowLevel(Hasher::Digest digest) {
+  switch (digest) {
+    case Hasher::md4:
+      return LowLevelDigest<MD4_CTX, MD4_Init, MD4_Update, MD4_Final>::get();
+    case Hasher::md5:
+      return LowLevelDigest<MD5_CTX, MD5_Init, MD5_Update, MD5_Final>::get();
+    case Hasher::sha1:
+    case Hasher::dss:
+    case Hasher::dss1:
+      return LowLevelDigest<SHA_CTX, SHA1_Init, SHA1_Update, SHA1_Final>::get();
+    case Hasher::sha224:
+      return LowLevelDigest<SHA256_CTX, SHA224_Init, SHA224_Update,
+        SHA224_Final>::get();
+    case Hasher::sha256:
+      return LowLevelDigest<SHA256_CTX, SHA256_Init, SHA256_Update,
+        SHA256_Final>::get();
+    case Hasher::sha384:
+      return LowLevelDigest<SHA512_CTX, SHA384_Init, SHA384_Update,
+        SHA384_Final>::get();
+    case Hasher::sha512:
+      return LowLevelDigest<SHA512_CTX, SHA512_Init, SHA512_Update,
+        SHA512_Final>::get();
+    case Hasher::ripemd160:
+      return LowLevelDigest<RIPEMD160_CTX, RIPEMD160_Init, RIPEMD160_Update,
+        RIPEMD160_Final>::get();
+    default:
+      return NULL;
+  }
+}
+
+// Saved state: header, then for each digest its header and state
+struct StateHeader {
+  char     magic[8];
+  int64_t  hashed;
+  uint32_t count;
+  uint32_t reserved;
+};
+
+struct StateDigest {
+  int32_t  digest;
+  uint32_t size;
+};
+
+static const char state_magic[8] = "HTHASH1";
+
+struct Hasher::Private {
+  struct Context {
+    Digest         digest;
+    char*          hash;
+    // Low-level functions if resumable, EVP otherwise
+    const LowLevel* low_level;
+    union {
+      MD4_CTX      md4;
+      MD5_CTX      md5;
+      SHA_CTX      sha1;
+      SHA256_CTX   sha256;
+      SHA512_CTX   sha512;
+      RIPEMD160_CTX ripemd160;
+    }              state;
+    EVP_MD_CTX ctx;
+    // For threaded update
+    Private*       parent;
+    pthread_t      tid;
+    unsigned long  generation;
+    const void*    buffer;
+    size_t         size;
+    int            rc;
+    int update();
+  };
+  Context*       contexts;
+  size_t         count;
+  size_t         threaded_min_size;
+  int64_t        hashed;
+  bool           resumed;
+  // Data lent by the child
+  const void*    lent;
+  size_t         lent_size;
+  // Digest threads, started by open() and stopped by close()
+  size_t         threads;
+  unsigned long  generation;
+  size_t         pending;
+  bool           stopping;
+  pthread_mutex_t lock;
+  pthread_cond_t todo_cond;
+  pthread_cond_t done_cond;
+  Private(const Digest* m, char* const* h, size_t c) :
+      count(c), threaded_min_size(0), hashed(0), resumed(false), lent(NULL),
+      lent_size(0), threads(0), generation(0), pending(0), stopping(false) {
+    contexts = new Context[count];
+    for (size_t i = 0; i < count; ++i) {
+      contexts[i].digest = m[i];
+      contexts[i].hash = h[i];
+      contexts[i].low_level = NULL;
+      contexts[i].parent = this;
+      contexts[i].generation = 0;
+    }
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&todo_cond, NULL);
+    pthread_cond_init(&done_cond, NULL);
+  }
+  ~Private() {
+    stop();
+    pthread_cond_destroy(&done_cond);
+    pthread_cond_destroy(&todo_cond);
+    pthread_mutex_destroy(&lock);
+    delete[] contexts;
+  }
+  static void* updateThread(void* data);
+  void start();
+  void stop();
+  int update(const void* buffer, size_t size);
+  // Hash the first size bytes of the buffers
+  int updatev(const struct iovec* iov, size_t size) {
+    for (; size > 0; ++iov) {
+      size_t length = iov->iov_len < size ? iov->iov_len : size;
+      if (update(iov->iov_base, length) < 0) {
+        return -1;
+      }
+      size -= length;
+    }
+    return 0;
+  }
+};
+
+int Hasher::Private::Context::update() {
+  if (low_level == NULL) {
+    return digestUpdate(&ctx, buffer, size);
+  }
+  size_t      max = 409600;
+  const char* cbuffer = static_cast<const char*>(buffer);
+  size_t      left = size;
+  while (left > 0) {
+    size_t length = left >= max ? max : left;
+    if (low_level->update(&state, cbuffer, length) != 1) {
+      hlog_alert("failed to update hasher");
+      errno = EUNATCH;
+      return -1;
+    }
+    cbuffer += length;
+    left    -= length;
+  }
+  return 0;
+}
+
+void* Hasher::Private::updateThread(void* data) {
+  Context* context = static_cast<Context*>(data);
+  Private* d = context->parent;
+  pthread_mutex_lock(&d->lock);
+  while (true) {
+    while ((context->generation == d->generation) && ! d->stopping) {
+      pthread_cond_wait(&d->todo_cond, &d->lock);
+    }
+    if (d->stopping) {
+      break;
+    }
+    context->generation = d->generation;
+    pthread_mutex_unlock(&d->lock);
+    context->rc = context->update();
+    pthread_mutex_lock(&d->lock);
+    if (--d->pending == 0) {
+      pthread_cond_signal(&d->done_cond);
+    }
+  }
+  pthread_mutex_unlock(&d->lock);
+  return NULL;
+}
+
+void Hasher::Private::start() {
+  if ((count <= 1) || (threaded_min_size == 0) || (threads > 0)) {
+    return;
+  }
+  stopping = false;
+  // Each digest but the first in its own thread, the first in the caller's
+  for (size_t i = 1; i < count; ++i) {
+    contexts[i].generation = generation;
+    if (pthread_create(&contexts[i].tid, NULL, updateThread,
+        &contexts[i]) != 0) {
+      // Digests without a thread are computed by the caller
+      break;
+    }
+    ++threads;
+  }
+}
+
+void Hasher::Private::stop() {
+  if (threads == 0) {
+    return;
+  }
+  pthread_mutex_lock(&lock);
+  stopping = true;
+  pthread_cond_broadcast(&todo_cond);
+  pthread_mutex_unlock(&lock);
+  for (size_t i = 1; i <= threads; ++i) {
+    pthread_join(contexts[i].tid, NULL);
+  }
+  threads = 0;
+}
+
+int Hasher::Private::update(
+    const void*     buffer,
+    size_t          size) {
+  for (size_t i = 0; i < count; ++i) {
+    contexts[i].buffer = buffer;
+    contexts[i].size = size;
+    contexts[i].rc = 0;
+  }
+  // Hand the buffer over to the digest threads, if large enough
+  bool threaded = (threads > 0) && (size >= threaded_min_size);
+  if (threaded) {
+    pthread_mutex_lock(&lock);
+    ++generation;
+    pending = threads;
+    pthread_cond_broadcast(&todo_cond);
+    pthread_mutex_unlock(&lock);
+  }
+  int rc = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (! threaded || (i == 0) || (i > threads)) {
+      if (contexts[i].update() < 0) {
+        rc = -1;
+      }
+    }
+  }
+  if (threaded) {
+    pthread_mutex_lock(&lock);
+    while (pending > 0) {
+      pthread_cond_wait(&done_cond, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+    for (size_t i = 1; i <= threads; ++i) {
+      if (contexts[i].rc < 0) {
+        errno = EUNATCH;
+        rc = -1;
+      }
+    }
+  }
+  if (rc == 0) {
+    hashed += size;
+  }
+  return rc;
+}
+
 Hasher::Hasher(IReaderWriter* c, bool d, Digest m, char* h) :
-  IReaderWriter(c, d), _d(new Private(m, h)) {}
+  IReaderWriter(c, d), _d(new Private(&m, &h, 1)) {}
+
+Hasher::Hasher(IReaderWriter* c, bool d, const Digest* m, char* const* h,
+    size_t n) : IReaderWriter(c, d), _d(new Private(m, h, n)) {}
 
 Hasher::~Hasher() {
   delete _d;
 }
 
+void Hasher::setThreaded(size_t min_size) {
+  _d->threaded_min_size = min_size;
+}
+
+void Hasher::setResumable() {
+  for (size_t i = 0; i < _d->count; ++i) {
+    _d->contexts[i].low_level = getLowLevel(_d->contexts[i].digest);
+  }
+}
+
+size_t Hasher::stateSize() const {
+  size_t size = sizeof(StateHeader);
+  for (size_t i = 0; i < _d->count; ++i) {
+    if (_d->contexts[i].low_level == NULL) {
+      return 0;
+    }
+    size += sizeof(StateDigest) + _d->contexts[i].low_level->state_size;
+  }
+  return size;
+}
+
+ssize_t Hasher::saveState(void* state) const {
+  if (stateSize() == 0) {
+    errno = ENOTSUP;
+    return -1;
+  }
+  char* cstate = static_cast<char*>(state);
+  StateHeader header;
+  memcpy(header.magic, state_magic, sizeof(header.magic));
+  header.hashed = _d->hashed;
+  header.count = static_cast<uint32_t>(_d->count);
+  header.reserved = 0;
+  memcpy(cstate, &header, sizeof(header));
+  cstate += sizeof(header);
+  for (size_t i = 0; i < _d->count; ++i) {
+    const Private::Context& context = _d->contexts[i];
+    StateDigest digest;
+    digest.digest = context.digest;
+    digest.size = static_cast<uint32_t>(context.low_level->state_size);
+    memcpy(cstate, &digest, sizeof(digest));
+    cstate += sizeof(digest);
+    memcpy(cstate, &context.state, digest.size);
+    cstate += digest.size;
+  }
+  return cstate - static_cast<char*>(state);
+}
+
+int64_t Hasher::resume(const void* state, size_t size) {
+  const char* cstate = static_cast<const char*>(state);
+  StateHeader header;
+  if ((stateSize() == 0) || (size != stateSize())) {
+    errno = EINVAL;
+    return -1;
+  }
+  memcpy(&header, cstate, sizeof(header));
+  cstate += sizeof(header);
+  if ((memcmp(header.magic, state_magic, sizeof(header.magic)) != 0) ||
+      (header.count != _d->count) || (header.hashed < 0)) {
+    errno = EINVAL;
+    return -1;
+  }
+  // Check all before changing anything
+  const char* check = cstate;
+  for (size_t i = 0; i < _d->count; ++i) {
+    StateDigest digest;
+    memcpy(&digest, check, sizeof(digest));
+    if ((digest.digest != _d->contexts[i].digest) ||
+        (digest.size != _d->contexts[i].low_level->state_size)) {
+      errno = EINVAL;
+      return -1;
+    }
+    check += sizeof(digest) + digest.size;
+  }
+  for (size_t i = 0; i < _d->count; ++i) {
+    StateDigest digest;
+    memcpy(&digest, cstate, sizeof(digest));
+    cstate += sizeof(digest);
+    memcpy(&_d->contexts[i].state, cstate, digest.size);
+    cstate += digest.size;
+  }
+  _d->hashed = header.hashed;
+  _d->resumed = true;
+  return _d->hashed;
+}
+
 int Hasher::open() {
   if (_child->open() < 0) {
     return -1;
   }
-  const EVP_MD* digest;
-  switch (_d->digest) {
-    case md_null:
-      digest = EVP_md_null();
-      break;
-    case md4:
-      digest = EVP_md4();
-      break;
-    case md5:
-      digest = EVP_md5();
-      break;
-    case sha:
-      digest = EVP_sha();
-      break;
-    case sha1:
-      digest = EVP_sha1();
-      break;
-    case dss:
-      digest = EVP_dss();
-      break;
-    case sha224:
-      digest = EVP_sha224();
-      break;
-    case sha256:
-      digest = EVP_sha256();
-      break;
-    case sha384:
-      digest = EVP_sha384();
-      break;
-    case sha512:
-      digest = EVP_sha512();
-      break;
-    case dss1:
-      digest = EVP_dss1();
-      break;
-    case ripemd160:
-      digest = EVP_ripemd160();
-      break;
-    default:
-      goto err;
+  if (_d->resumed) {
+    // States already restored
+    _d->resumed = false;
+    _d->start();
+    return 0;
   }
-  if (EVP_DigestInit(&_d->ctx, digest) != 1) {
-    hlog_alert("failed to intialise hasher");
-    errno = EUNATCH;
-    goto err;
+  _d->hashed = 0;
+  for (size_t i = 0; i < _d->count; ++i) {
+    if (_d->contexts[i].low_level != NULL) {
+      if (_d->contexts[i].low_level->init(&_d->contexts[i].state) != 1) {
+        hlog_alert("failed to intialise hasher");
+        errno = EUNATCH;
+        goto err;
+      }
+      continue;
+    }
+    const EVP_MD* digest = getDigest(_d->contexts[i].digest);
+    if (digest == NULL) {
+      goto err;
+    }
+    if (EVP_DigestInit(&_d->contexts[i].ctx, digest) != 1) {
+      hlog_alert("failed to intialise hasher");
+      errno = EUNATCH;
+      goto err;
+    }
   }
+  _d->start();
   return 0;
 err:
   _child->close();
@@ -130,13 +498,27 @@ int Hasher::close() {
   unsigned char hash[64];
   unsigned int  length;
 
+  _d->stop();
   int rc = 0;
-  if (EVP_DigestFinal(&_d->ctx, hash, &length) != 1) {
-    hlog_alert("failed to finalise hasher");
-    errno = EUNATCH;
-    rc = -1;
-  } else {
-    _d->binToHex(_d->hash, hash, length);
+  for (size_t i = 0; i < _d->count; ++i) {
+    const LowLevel* low_level = _d->contexts[i].low_level;
+    if (low_level != NULL) {
+      if (low_level->finish(hash, &_d->contexts[i].state) != 1) {
+        hlog_alert("failed to finalise hasher");
+        errno = EUNATCH;
+        rc = -1;
+      } else {
+        binToHex(_d->contexts[i].hash, hash,
+          EVP_MD_size(getDigest(_d->contexts[i].digest)));
+      }
+    } else
+    if (EVP_DigestFinal(&_d->contexts[i].ctx, hash, &length) != 1) {
+      hlog_alert("failed to finalise hasher");
+      errno = EUNATCH;
+      rc = -1;
+    } else {
+      binToHex(_d->contexts[i].hash, hash, length);
+    }
   }
   if (_child->close() < 0) {
     rc = -1;
@@ -176,3 +558,443 @@ ssize_t Hasher::put(const void* buffer, size_t size) {
   }
   return rc;
 }
+
+ssize_t Hasher::getv(const struct iovec* iov, int count) {
+  ssize_t rc = _child->getv(iov, count);
+  if (rc < 0) {
+    return -1;
+  }
+  if (_d->updatev(iov, rc) < 0) {
+    return -1;
+  }
+  return rc;
+}
+
+ssize_t Hasher::putv(const struct iovec* iov, int count) {
+  ssize_t rc = _child->putv(iov, count);
+  if (rc < 0) {
+    return -1;
+  }
+  if (_d->updatev(iov, rc) < 0) {
+    return -1;
+  }
+  return rc;
+}
+
+ssize_t Hasher::peek(const void** buffer, size_t size) {
+  ssize_t rc = _child->peek(buffer, size);
+  if (rc >= 0) {
+    _d->lent = *buffer;
+    _d->lent_size = rc;
+  }
+  return rc;
+}
+
+ssize_t Hasher::advance(size_t size) {
+  if (size > _d->lent_size) {
+    errno = EINVAL;
+    return -1;
+  }
+  // Hash first, so nothing is consumed on failure
+  if ((size > 0) && (_d->update(_d->lent, size) < 0)) {
+    return -1;
+  }
+  _d->lent_size = 0;
+  return _child->advance(size);
+}
+
+ssize_t Hasher::reserve(void** buffer, size_t size) {
+  ssize_t rc = _child->reserve(buffer, size);
+  if (rc >= 0) {
+    _d->lent = *buffer;
+    _d->lent_size = rc;
+  }
+  return rc;
+}
+
+ssize_t Hasher::commit(size_t size) {
+  if (size > _d->lent_size) {
+    errno = EINVAL;
+    return -1;
+  }
+  if ((size > 0) && (_d->update(_d->lent, size) < 0)) {
+    return -1;
+  }
+  _d->lent_size = 0;
+  return _child->commit(size);
+}
+
+// Hash prefix byte followed by up to two buffers into out
+static int treeDigest(const EVP_MD* md, unsigned char prefix,
+    const void* buffer1, size_t size1, const void* buffer2, size_t size2,
+    unsigned char* out) {
+  EVP_MD_CTX ctx;
+  unsigned int length;
+  if (EVP_DigestInit(&ctx, md) != 1) {
+    hlog_alert("failed to intialise hasher");
+    errno = EUNATCH;
+    return -1;
+  }
+  if ((digestUpdate(&ctx, &prefix, 1) < 0) ||
+      (digestUpdate(&ctx, buffer1, size1) < 0) ||
+      (digestUpdate(&ctx, buffer2, size2) < 0)) {
+    EVP_DigestFinal(&ctx, out, &length);
+    return -1;
+  }
+  if (EVP_DigestFinal(&ctx, out, &length) != 1) {
+    hlog_alert("failed to finalise hasher");
+    errno = EUNATCH;
+    return -1;
+  }
+  return 0;
+}
+
+struct TreeHasher::Private {
+  struct Job {
+    size_t        index;
+    char*         buffer;
+    size_t        size;
+    int           rc;
+    unsigned char digest[EVP_MAX_MD_SIZE];
+  };
+  Hasher::Digest  digest;
+  const EVP_MD*   md;
+  size_t          md_size;
+  size_t          chunk_size;
+  char*           hash;
+  size_t          threads;
+  // Chunk being filled
+  Job*            job;
+  size_t          next_index;
+  // Chunks' hashes, one after the other
+  std::vector<unsigned char> leaves;
+  bool            failed;
+  // Thread pool, not used with one thread
+  pthread_t*      tids;
+  pthread_mutex_t lock;
+  pthread_cond_t  todo_cond;
+  pthread_cond_t  done_cond;
+  std::list<Job*> todo;
+  std::list<Job*> done;
+  std::list<Job*> spare;
+  size_t          outstanding;
+  bool            stopping;
+  Private(Hasher::Digest d, size_t c, char* h, size_t t) :
+      digest(d), md(NULL), md_size(0), chunk_size(c), hash(h), threads(t),
+      job(NULL), next_index(0), failed(false), tids(NULL), outstanding(0),
+      stopping(false) {
+    if (threads == 0) {
+      long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      threads = cpus > 0 ? cpus : 1;
+    }
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&todo_cond, NULL);
+    pthread_cond_init(&done_cond, NULL);
+  }
+  ~Private() {
+    stop();
+    if (job != NULL) {
+      spare.push_back(job);
+    }
+    while (! spare.empty()) {
+      free(spare.front()->buffer);
+      delete spare.front();
+      spare.pop_front();
+    }
+    pthread_cond_destroy(&done_cond);
+    pthread_cond_destroy(&todo_cond);
+    pthread_mutex_destroy(&lock);
+  }
+  int hashJob(Job* j) {
+    j->rc = treeDigest(md, 0, j->buffer, j->size, NULL, 0, j->digest);
+    return j->rc;
+  }
+  static void* worker(void* data);
+  int start();
+  void stop();
+  Job* newJob();
+  void collect(Job* j);
+  int submit();
+  int feed(const void* buffer, size_t size);
+  int finish();
+};
+
+void* TreeHasher::Private::worker(void* data) {
+  Private* d = static_cast<Private*>(data);
+  pthread_mutex_lock(&d->lock);
+  while (true) {
+    while (d->todo.empty() && ! d->stopping) {
+      pthread_cond_wait(&d->todo_cond, &d->lock);
+    }
+    if (d->todo.empty()) {
+      break;
+    }
+    Job* j = d->todo.front();
+    d->todo.pop_front();
+    pthread_mutex_unlock(&d->lock);
+    d->hashJob(j);
+    pthread_mutex_lock(&d->lock);
+    d->done.push_back(j);
+    pthread_cond_signal(&d->done_cond);
+  }
+  pthread_mutex_unlock(&d->lock);
+  return NULL;
+}
+
+int TreeHasher::Private::start() {
+  if (threads <= 1) {
+    return 0;
+  }
+  stopping = false;
+  tids = new pthread_t[threads];
+  for (size_t i = 0; i < threads; ++i) {
+    if (pthread_create(&tids[i], NULL, worker, this) != 0) {
+      threads = i;
+      stop();
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void TreeHasher::Private::stop() {
+  if (tids == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&lock);
+  stopping = true;
+  pthread_cond_broadcast(&todo_cond);
+  pthread_mutex_unlock(&lock);
+  for (size_t i = 0; i < threads; ++i) {
+    pthread_join(tids[i], NULL);
+  }
+  delete[] tids;
+  tids = NULL;
+  // Jobs left over after a failure
+  while (! todo.empty()) {
+    spare.push_back(todo.front());
+    todo.pop_front();
+  }
+  while (! done.empty()) {
+    spare.push_back(done.front());
+    done.pop_front();
+  }
+  outstanding = 0;
+}
+
+TreeHasher::Private::Job* TreeHasher::Private::newJob() {
+  Job* j;
+  if (! spare.empty()) {
+    j = spare.front();
+    spare.pop_front();
+  } else {
+    j = new Job;
+    j->buffer = static_cast<char*>(malloc(chunk_size));
+    if (j->buffer == NULL) {
+      delete j;
+      return NULL;
+    }
+  }
+  j->index = next_index++;
+  j->size = 0;
+  return j;
+}
+
+void TreeHasher::Private::collect(Job* j) {
+  if (j->rc < 0) {
+    failed = true;
+  } else {
+    if (leaves.size() < (j->index + 1) * md_size) {
+      leaves.resize((j->index + 1) * md_size);
+    }
+    memcpy(&leaves[j->index * md_size], j->digest, md_size);
+  }
+  spare.push_back(j);
+}
+
+int TreeHasher::Private::submit() {
+  Job* j = job;
+  job = NULL;
+  if (tids == NULL) {
+    hashJob(j);
+    collect(j);
+    return failed ? -1 : 0;
+  }
+  pthread_mutex_lock(&lock);
+  todo.push_back(j);
+  ++outstanding;
+  pthread_cond_signal(&todo_cond);
+  // Keep two chunks per thread in flight at most
+  while (! done.empty() || (outstanding >= 2 * threads)) {
+    while (done.empty()) {
+      pthread_cond_wait(&done_cond, &lock);
+    }
+    collect(done.front());
+    done.pop_front();
+    --outstanding;
+  }
+  pthread_mutex_unlock(&lock);
+  return failed ? -1 : 0;
+}
+
+int TreeHasher::Private::feed(const void* buffer, size_t size) {
+  const char* cbuffer = static_cast<const char*>(buffer);
+  while (size > 0) {
+    if (job == NULL) {
+      job = newJob();
+      if (job == NULL) {
+        return -1;
+      }
+    }
+    size_t length = chunk_size - job->size;
+    if (length > size) {
+      length = size;
+    }
+    memcpy(&job->buffer[job->size], cbuffer, length);
+    job->size += length;
+    cbuffer += length;
+    size -= length;
+    if ((job->size == chunk_size) && (submit() < 0)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int TreeHasher::Private::finish() {
+  // Last chunk, or only and empty one
+  if ((job != NULL) || (next_index == 0)) {
+    if (job == NULL) {
+      job = newJob();
+      if (job == NULL) {
+        return -1;
+      }
+    }
+    if (submit() < 0) {
+      return -1;
+    }
+  }
+  if (tids != NULL) {
+    pthread_mutex_lock(&lock);
+    while (outstanding > 0) {
+      while (done.empty()) {
+        pthread_cond_wait(&done_cond, &lock);
+      }
+      collect(done.front());
+      done.pop_front();
+      --outstanding;
+    }
+    pthread_mutex_unlock(&lock);
+    stop();
+  }
+  if (failed) {
+    errno = EUNATCH;
+    return -1;
+  }
+  // Combine level by level, in place in a copy
+  std::vector<unsigned char> level(leaves);
+  size_t count = next_index;
+  while (count > 1) {
+    size_t pairs = count / 2;
+    for (size_t i = 0; i < pairs; ++i) {
+      unsigned char digest[EVP_MAX_MD_SIZE];
+      if (treeDigest(md, 1, &level[2 * i * md_size], md_size,
+          &level[(2 * i + 1) * md_size], md_size, digest) < 0) {
+        return -1;
+      }
+      memcpy(&level[i * md_size], digest, md_size);
+    }
+    if ((count & 1) != 0) {
+      memmove(&level[pairs * md_size], &level[(count - 1) * md_size],
+        md_size);
+    }
+    count = pairs + (count & 1);
+  }
+  binToHex(hash, &level[0], static_cast<int>(md_size));
+  return 0;
+}
+
+TreeHasher::TreeHasher(IReaderWriter* c, bool d, Hasher::Digest m, size_t s,
+    char* h, size_t t) : IReaderWriter(c, d), _d(new Private(m, s, h, t)) {}
+
+TreeHasher::~TreeHasher() {
+  delete _d;
+}
+
+int TreeHasher::open() {
+  _d->md = getDigest(_d->digest);
+  if ((_d->md == NULL) || (_d->chunk_size == 0)) {
+    errno = EINVAL;
+    return -1;
+  }
+  _d->md_size = EVP_MD_size(_d->md);
+  if (_child->open() < 0) {
+    return -1;
+  }
+  if (_d->job != NULL) {
+    _d->spare.push_back(_d->job);
+    _d->job = NULL;
+  }
+  _d->next_index = 0;
+  _d->leaves.clear();
+  _d->failed = false;
+  if (_d->start() < 0) {
+    _child->close();
+    return -1;
+  }
+  return 0;
+}
+
+int TreeHasher::close() {
+  int rc = _d->finish();
+  if (_child->close() < 0) {
+    rc = -1;
+  }
+  return rc;
+}
+
+ssize_t TreeHasher::read(void* buffer, size_t size) {
+  ssize_t rc = _child->read(buffer, size);
+  if (rc < 0) {
+    return -1;
+  }
+  if (_d->feed(buffer, rc) < 0) {
+    return -1;
+  }
+  return rc;
+}
+
+ssize_t TreeHasher::get(void* buffer, size_t size) {
+  ssize_t rc = _child->get(buffer, size);
+  if (rc < 0) {
+    return -1;
+  }
+  if (_d->feed(buffer, rc) < 0) {
+    return -1;
+  }
+  return rc;
+}
+
+ssize_t TreeHasher::put(const void* buffer, size_t size) {
+  ssize_t rc = _child->put(buffer, size);
+  if (rc < 0) {
+    return -1;
+  }
+  if (_d->feed(buffer, rc) < 0) {
+    return -1;
+  }
+  return rc;
+}
+
+size_t TreeHasher::chunks() const {
+  return _d->md_size > 0 ? _d->leaves.size() / _d->md_size : 0;
+}
+
+int TreeHasher::chunkHash(size_t index, char* hash) const {
+  if (index >= chunks()) {
+    return -1;
+  }
+  binToHex(hash, &_d->leaves[index * _d->md_size],
+    static_cast<int>(_d->md_size));
+  return 0;
+}
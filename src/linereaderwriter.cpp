@@ -103,6 +103,33 @@ ssize_t LineReaderWriter::put(const void* buffer, size_t size) {
   return rc;
 }
 
+ssize_t LineReaderWriter::peek(const void** buffer, size_t size) {
+  if (_d->reader == _d->buffer_end) {
+    ssize_t rc = _d->child->read(_d->buffer, sizeof(_d->buffer));
+    if (rc < 0) {
+      return rc;
+    }
+    _d->reader = _d->buffer;
+    _d->buffer_end = _d->buffer + rc;
+  }
+  size_t length = _d->buffer_end - _d->reader;
+  if (size < length) {
+    length = size;
+  }
+  *buffer = _d->reader;
+  return length;
+}
+
+ssize_t LineReaderWriter::advance(size_t size) {
+  if (size > static_cast<size_t>(_d->buffer_end - _d->reader)) {
+    errno = EINVAL;
+    return -1;
+  }
+  _d->reader += size;
+  _offset += size;
+  return size;
+}
+
 int64_t LineReaderWriter::childOffset() const {
   return _child->offset();
 }
@@ -187,16 +214,20 @@ ssize_t LineReaderWriter::putLine(
     size_t          size,
     int             delim,
     int             delim2) {
-  ssize_t rc = _d->child->put(buffer, size);
-  if ((rc < 0) || (_d->child->put(&delim, 1) < 0)) {
+  // Line and delimiter(s) in one go
+  char delims[2] = { static_cast<char>(delim), static_cast<char>(delim2) };
+  struct iovec iov[2];
+  iov[0].iov_base = const_cast<void*>(buffer);
+  iov[0].iov_len  = size;
+  iov[1].iov_base = delims;
+  iov[1].iov_len  = delim2 >= 0 ? 2 : 1;
+  ssize_t rc = _d->child->putv(iov, 2);
+  if (rc < 0) {
     return -1;
   }
-  _offset += rc + 1;
-  if (delim2 >= 0) {
-    if (_d->child->put(&delim2, 1) < 0) {
-      return -1;
-    }
-    ++_offset;
+  _offset += rc;
+  if (rc < static_cast<ssize_t>(size + iov[1].iov_len)) {
+    return -1;
   }
-  return rc;
+  return size;
 }
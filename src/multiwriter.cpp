@@ -31,7 +31,10 @@ struct MultiWriter::Private {
   };
   list<Child> children;
   const char* path;
-  Private() : path("") {}
+  // Region lent by the first child
+  const void* lent;
+  size_t      lent_size;
+  Private() : path(""), lent(NULL), lent_size(0) {}
 };
 
 MultiWriter::MultiWriter(IReaderWriter* child, bool delete_child) :
@@ -112,6 +115,40 @@ ssize_t MultiWriter::put(const void* buffer, size_t size) {
   return size;
 }
 
+ssize_t MultiWriter::reserve(void** buffer, size_t size) {
+  IReaderWriter* first = _d->children.front().child;
+  ssize_t rc = first->reserve(buffer, size);
+  if (rc < 0) {
+    _d->path = first->path();
+    return -1;
+  }
+  _d->lent = *buffer;
+  _d->lent_size = rc;
+  return rc;
+}
+
+ssize_t MultiWriter::commit(size_t size) {
+  if (size > _d->lent_size) {
+    errno = EINVAL;
+    return -1;
+  }
+  _d->lent_size = 0;
+  // The region is only valid until the first child commits it
+  list<Private::Child>::iterator it = _d->children.begin();
+  for (++it; it != _d->children.end(); ++it) {
+    if (it->child->put(_d->lent, size) < static_cast<ssize_t>(size)) {
+      _d->path = it->child->path();
+      return -1;
+    }
+  }
+  IReaderWriter* first = _d->children.front().child;
+  if (first->commit(size) < static_cast<ssize_t>(size)) {
+    _d->path = first->path();
+    return -1;
+  }
+  return size;
+}
+
 const char* MultiWriter::path() const {
   return _d->path;
 }
@@ -16,6 +16,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
 #include <pthread.h>
 
 #include <report.h>
@@ -23,58 +24,230 @@
 
 using namespace htoolbox;
 
+/*
+ * The queue itself is a lock-free bounded ring: each slot has a turn number,
+ * which is even when the slot is free for the writer of that turn and odd when
+ * it holds data for the reader of that turn.  Pushers and poppers claim slots
+ * by incrementing the head and tail positions respectively.
+ *
+ * The mutex and conditions are only used to sleep when the queue is full or
+ * empty, and to change the state of the queue.  Both sides register as waiters
+ * before checking the queue again, so that the other side knows it needs to
+ * take the lock to wake them up.
+ */
+
+enum {
+  CACHE_LINE = 64
+};
+
 struct Queue::Private {
+  struct Slot {
+    unsigned long turn;
+    void*         data;
+    uint64_t      time;
+  };
   char            name[64];
   bool            is_open;
   bool            signal;
   bool            urgent_close;
+  bool            timestamps;
   const size_t    max_size;
-  size_t          size;
-  void**          objects;
-  void**          reader;
-  void**          writer;
-  void**          end;
+  Slot*           slots;
+  // Keep positions in their own cache lines
+  char            pad1[CACHE_LINE];
+  unsigned long   head;
+  char            pad2[CACHE_LINE];
+  unsigned long   tail;
+  char            pad3[CACHE_LINE];
+  // Number of sleepers
+  unsigned long   push_waiters;
+  unsigned long   pop_waiters;
   // Lock
   pthread_mutex_t queue_lock;
   // Conditions
   pthread_cond_t  pop_cond;
   pthread_cond_t  push_cond;
-  Private(size_t n) : is_open(false), max_size(n), size(0) {
-    objects = static_cast<void**>(malloc(n * sizeof(void*)));
-    end = &objects[max_size];
+  Private(size_t n) : is_open(false), signal(false), urgent_close(false),
+      timestamps(false), max_size(n > 0 ? n : 1), head(0), tail(0),
+      push_waiters(0), pop_waiters(0) {
+    slots = static_cast<Slot*>(malloc(max_size * sizeof(Slot)));
   }
   ~Private() {
-    free(objects);
+    free(slots);
+  }
+  template<typename T>
+  static T load(const T* p) {
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+  }
+  template<typename T>
+  static void store(T* p, T v) {
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
   }
   void open() {
-    reader = &objects[0];
-    writer = &objects[0];
-    is_open = true;
-    signal = false;
+    for (size_t i = 0; i < max_size; ++i) {
+      slots[i].turn = 0;
+    }
+    store(&head, 0UL);
+    store(&tail, 0UL);
+    store(&signal, false);
+    store(&urgent_close, false);
+    store(&is_open, true);
   }
   void close(bool urgent) {
-    is_open = false;
-    urgent_close = urgent;
-  }
-  // Must not be full!
-  void push(void* d) {
-    *reader++ = d;
-    ++size;
-    if (reader == end) {
-      reader = &objects[0];
+    store(&urgent_close, urgent);
+    store(&is_open, false);
+  }
+  size_t size() const {
+    // Read tail first so we never see it ahead of head
+    unsigned long t = load(&tail);
+    unsigned long h = load(&head);
+    return h > t ? h - t : 0;
+  }
+  // Claim as many consecutive slots of the given turn parity as possible
+  size_t claim(unsigned long* position, unsigned long parity, size_t n,
+      unsigned long* start) {
+    unsigned long pos = load(position);
+    do {
+      size_t count = 0;
+      while ((count < n) && (count < max_size)) {
+        unsigned long p = pos + count;
+        if (load(&slots[p % max_size].turn) != 2 * (p / max_size) + parity) {
+          break;
+        }
+        ++count;
+      }
+      if (count > 0) {
+        if (__atomic_compare_exchange_n(position, &pos, pos + count, false,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+          *start = pos;
+          return count;
+        }
+        // pos was updated by the failed exchange
+      } else {
+        unsigned long previous = pos;
+        pos = load(position);
+        if (pos == previous) {
+          // Full or empty
+          return 0;
+        }
+      }
+    } while (true);
+  }
+  static uint64_t now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return static_cast<uint64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+  }
+  size_t tryPush(void* const* d, size_t n) {
+    unsigned long pos;
+    size_t count = claim(&head, 0, n, &pos);
+    uint64_t time = (count > 0) && timestamps ? now() : 0;
+    for (size_t i = 0; i < count; ++i, ++pos) {
+      Slot& slot = slots[pos % max_size];
+      slot.data = d[i];
+      slot.time = time;
+      store(&slot.turn, 2 * (pos / max_size) + 1);
+    }
+    return count;
+  }
+  size_t tryPop(void** d, size_t n, uint64_t* times) {
+    unsigned long pos;
+    size_t count = claim(&tail, 1, n, &pos);
+    for (size_t i = 0; i < count; ++i, ++pos) {
+      Slot& slot = slots[pos % max_size];
+      d[i] = slot.data;
+      if (times != NULL) {
+        times[i] = slot.time;
+      }
+      store(&slot.turn, 2 * (pos / max_size) + 2);
     }
+    return count;
   }
-  // Must not be empty!
-  void* pop() {
-    void* rc = *writer++;
-    --size;
-    if (writer == end) {
-      writer = &objects[0];
+  // Wake sleepers up, if any
+  void wake(unsigned long* waiters, pthread_cond_t* cond) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (load(waiters) != 0) {
+      pthread_mutex_lock(&queue_lock);
+      pthread_cond_broadcast(cond);
+      pthread_mutex_unlock(&queue_lock);
     }
-    return rc;
   }
+  // Must be called with lock held, register before checking the condition
+  void registerWaiter(unsigned long* waiters) {
+    __atomic_fetch_add(waiters, 1, __ATOMIC_SEQ_CST);
+  }
+  void unregisterWaiter(unsigned long* waiters) {
+    __atomic_fetch_sub(waiters, 1, __ATOMIC_SEQ_CST);
+  }
+  int push(void* const* d, size_t n, size_t* pushed);
+  int pop(void** d, size_t n, size_t* got, uint64_t* times);
 };
 
+int Queue::Private::push(void* const* d, size_t n, size_t* pushed) {
+  size_t& count = *pushed;
+  count = 0;
+  if (n == 0) {
+    return load(&is_open) ? 0 : 1;
+  }
+  while (load(&is_open)) {
+    count += tryPush(&d[count], n - count);
+    if (count > 0) {
+      // Signal not empty
+      wake(&pop_waiters, &pop_cond);
+      if (count == n) {
+        return 0;
+      }
+    }
+    // Wait for some space
+    pthread_mutex_lock(&queue_lock);
+    registerWaiter(&push_waiters);
+    if ((size() >= max_size) && load(&is_open)) {
+      hlog_regression("%s.%s wait for queue to empty some", name, "push");
+      pthread_cond_wait(&push_cond, &queue_lock);
+    }
+    unregisterWaiter(&push_waiters);
+    pthread_mutex_unlock(&queue_lock);
+  }
+  return 1;
+}
+
+int Queue::Private::pop(void** d, size_t n, size_t* got, uint64_t* times) {
+  *got = 0;
+  do {
+    // Check status
+    if (__atomic_exchange_n(&signal, false, __ATOMIC_ACQ_REL)) {
+      return 1;
+    }
+    if (load(&urgent_close)) {
+      return -1;
+    }
+    if (n == 0) {
+      return 0;
+    }
+    // Get data
+    *got = tryPop(d, n, times);
+    if (*got > 0) {
+      // Signal not full
+      wake(&push_waiters, &push_cond);
+      return 0;
+    }
+    if (! load(&is_open)) {
+      // Closed and empty
+      wake(&push_waiters, &push_cond);
+      return -1;
+    }
+    // Wait for some data
+    pthread_mutex_lock(&queue_lock);
+    registerWaiter(&pop_waiters);
+    if ((size() == 0) && load(&is_open) && ! load(&signal)) {
+      hlog_regression("%s.%s wait for queue to fill up some", name, "pop");
+      pthread_cond_wait(&pop_cond, &queue_lock);
+    }
+    unregisterWaiter(&pop_waiters);
+    pthread_mutex_unlock(&queue_lock);
+  } while (true);
+}
+
 Queue::Queue(const char* name, size_t max_size) :_d(new Private(max_size)) {
   strncpy(_d->name, name, sizeof(_d->name));
   _d->name[sizeof(_d->name) - 1] = '\0';
@@ -100,84 +273,80 @@ void Queue::open() {
 void Queue::close(bool urgent) {
   hlog_regression("%s.%s enter, urgent = %s", _d->name, __FUNCTION__,
     urgent ? "true" : "false");
+  pthread_mutex_lock(&_d->queue_lock);
   _d->close(urgent);
   pthread_cond_broadcast(&_d->pop_cond);
+  pthread_cond_broadcast(&_d->push_cond);
+  pthread_mutex_unlock(&_d->queue_lock);
   hlog_regression("%s.%s exit", _d->name, __FUNCTION__);
 }
 
 void Queue::wait() {
   hlog_regression("%s.%s enter", _d->name, __FUNCTION__);
   pthread_mutex_lock(&_d->queue_lock);
-  while (_d->size > 0) {
+  _d->registerWaiter(&_d->push_waiters);
+  while (_d->size() > 0) {
     hlog_regression("%s.%s wait for queue to empty", _d->name, __FUNCTION__);
     pthread_cond_wait(&_d->push_cond, &_d->queue_lock);
   }
+  _d->unregisterWaiter(&_d->push_waiters);
   pthread_mutex_unlock(&_d->queue_lock);
   hlog_regression("%s.%s exit", _d->name, __FUNCTION__);
 }
 
 bool Queue::empty() const {
-  return _d->size == 0;
+  return _d->size() == 0;
 }
 
 size_t Queue::size() const {
-  return _d->size;
+  return _d->size();
 }
 
 int Queue::push(void* data) {
   hlog_regression("%s.%s enter", _d->name, __FUNCTION__);
-  pthread_mutex_lock(&_d->queue_lock);
-  // Wait for some space
-  while ((_d->size == _d->max_size) && _d->is_open) {
-    hlog_regression("%s.%s wait for queue to empty some", _d->name, __FUNCTION__);
-    pthread_cond_wait(&_d->push_cond, &_d->queue_lock);
-  }
-  // Check status
-  if (_d->is_open) {
-    // Get data
-    _d->push(data);
-    // Signal not empty
-    pthread_cond_broadcast(&_d->pop_cond);
-  }
-  pthread_mutex_unlock(&_d->queue_lock);
-  int rc = _d->is_open ? 0 : 1;
+  size_t pushed;
+  int rc = _d->push(&data, 1, &pushed);
   hlog_regression("%s.%s exit: rc = %d", _d->name, __FUNCTION__, rc);
   return rc;
 }
 
-int Queue::pop(void** data) {
+int Queue::pop(void** data, uint64_t* push_time) {
   hlog_regression("%s.%s enter", _d->name, __FUNCTION__);
-  pthread_mutex_lock(&_d->queue_lock);
-  // Wait for some data
-  while ((_d->size == 0) && _d->is_open && ! _d->signal) {
-    hlog_regression("%s.%s wait for queue to fill up some", _d->name, __FUNCTION__);
-    pthread_cond_wait(&_d->pop_cond, &_d->queue_lock);
-  }
-  // Check status
-  int rc = -1;
-  if (_d->signal) {
-    _d->signal = false;
-    rc = 1;
-  } else
-  if ((_d->size > 0) && ! _d->urgent_close) {
-    *data = _d->pop();
-    pthread_cond_broadcast(&_d->push_cond);
-    rc = 0;
-  } else
-  if (! _d->is_open) {
-    rc = -1;
-    pthread_cond_broadcast(&_d->push_cond);
-  }
-  pthread_mutex_unlock(&_d->queue_lock);
+  size_t got;
+  int rc = _d->pop(data, 1, &got, push_time);
   hlog_regression("%s.%s exit: rc = %d", _d->name, __FUNCTION__, rc);
   return rc;
 }
 
+size_t Queue::pushBatch(void** items, size_t n) {
+  hlog_regression("%s.%s enter, n = %zu", _d->name, __FUNCTION__, n);
+  size_t pushed;
+  int rc = _d->push(items, n, &pushed);
+  hlog_regression("%s.%s exit: rc = %d, pushed = %zu", _d->name, __FUNCTION__,
+    rc, pushed);
+  return pushed;
+}
+
+int Queue::popBatch(void** out, size_t max, size_t* got,
+    uint64_t* push_times) {
+  hlog_regression("%s.%s enter, max = %zu", _d->name, __FUNCTION__, max);
+  int rc = _d->pop(out, max, got, push_times);
+  hlog_regression("%s.%s exit: rc = %d, got = %zu", _d->name, __FUNCTION__,
+    rc, *got);
+  return rc;
+}
+
 void Queue::signal() {
   hlog_regression("%s.%s enter", _d->name, __FUNCTION__);
-  if (_d->is_open) {
-    _d->signal = true;
+  pthread_mutex_lock(&_d->queue_lock);
+  if (Private::load(&_d->is_open)) {
+    Private::store(&_d->signal, true);
     pthread_cond_broadcast(&_d->pop_cond);
   }
+  pthread_mutex_unlock(&_d->queue_lock);
   hlog_regression("%s.%s exit", _d->name, __FUNCTION__);
 }
+
+void Queue::setTimestamps(bool enable) {
+  _d->timestamps = enable;
+}
@@ -19,9 +19,11 @@
 #include <stdint.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 
 #include "socket.h"
 
@@ -352,6 +354,106 @@ ssize_t Socket::get(
   return count;
 }
 
+ssize_t Socket::putv(
+    const struct iovec* iov,
+    int             count) {
+  ssize_t sent = 0;
+  int i = 0;
+  while (i < count) {
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = const_cast<struct iovec*>(&iov[i]);
+    message.msg_iovlen = count - i > IOV_MAX ? IOV_MAX : count - i;
+    ssize_t size;
+    bool conclusive = false;
+    do {
+      size = ::sendmsg(_d->conn_socket, &message, MSG_NOSIGNAL);
+      if (size < 0) {
+        switch (errno) {
+          case EAGAIN:
+            // Socket full, wait and try again
+            usleep(1000);
+            // DO NOT INSERT A BREAK HERE, YOU NAIVE FOOL!
+          case EINTR:
+            break;
+          default:
+            conclusive = true;
+        }
+      } else {
+        conclusive = true;
+      }
+    } while (! conclusive);
+    if (size < 0) {
+      return -1;
+    }
+    sent += size;
+    // Skip buffers fully sent
+    size_t done = size;
+    while ((i < count) && (done >= iov[i].iov_len)) {
+      done -= iov[i].iov_len;
+      ++i;
+    }
+    if (size == 0) {
+      break;
+    }
+    // Finish the one partly sent
+    if (done > 0) {
+      size_t left = iov[i].iov_len - done;
+      size = put(static_cast<const char*>(iov[i].iov_base) + done, left);
+      if (size < 0) {
+        return -1;
+      }
+      sent += size;
+      if (static_cast<size_t>(size) < left) {
+        break;
+      }
+      ++i;
+    }
+  }
+  return sent;
+}
+
+ssize_t Socket::getv(
+    const struct iovec* iov,
+    int             count) {
+  size_t received = 0;
+  int i = 0;
+  while (i < count) {
+    int n = count - i > IOV_MAX ? IOV_MAX : count - i;
+    ssize_t rc = ::readv(_d->conn_socket, &iov[i], n);
+    if (rc < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (rc == 0) {
+      break;
+    }
+    received += rc;
+    // Skip full buffers
+    size_t done = rc;
+    while ((i < count) && (done >= iov[i].iov_len)) {
+      done -= iov[i].iov_len;
+      ++i;
+    }
+    // Fill up the one partly received
+    if (done > 0) {
+      size_t left = iov[i].iov_len - done;
+      rc = get(static_cast<char*>(iov[i].iov_base) + done, left);
+      if (rc < 0) {
+        return -1;
+      }
+      received += rc;
+      if (static_cast<size_t>(rc) < left) {
+        break;
+      }
+      ++i;
+    }
+  }
+  return received;
+}
+
 const char* Socket::path() const {
   return _d->master_data->hostname;
 }
@@ -18,7 +18,10 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include <time.h>
+#include <sched.h>
+#include <sys/time.h>
 #include <pthread.h>
 
 #include <report.h>
@@ -28,7 +31,9 @@
 using namespace htoolbox;
 
 enum {
-  NAME_SIZE = 1024
+  NAME_SIZE = 1024,
+  // Maximum number of jobs fetched at once in work-stealing mode
+  BATCH_SIZE = 16
 };
 
 template <class T>
@@ -78,10 +83,99 @@ public:
     }
     --_size;
   }
+  T* top() { return _head; }
   T* bottom() { return _tail; }
 };
 
+static uint64_t now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return static_cast<uint64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+// Job statistics, only written by their own thread, read by anyone
+class JobCounters {
+  uint64_t  _jobs;
+  uint64_t  _stolen;
+  uint64_t  _wait_us;
+  uint64_t  _run_us;
+  uint64_t  _push_out_us;
+  uint64_t  _wait_histogram[ThreadsManager::Stats::HISTOGRAM_SIZE];
+  uint64_t  _run_histogram[ThreadsManager::Stats::HISTOGRAM_SIZE];
+  static uint64_t get(const uint64_t* counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+  }
+  // Single writer: no need for a locked add
+  static void add(uint64_t* counter, uint64_t value) {
+    __atomic_store_n(counter, get(counter) + value, __ATOMIC_RELAXED);
+  }
+  static size_t bucket(uint64_t us) {
+    size_t i = 0;
+    while (((us >>= 1) != 0) &&
+        (i < ThreadsManager::Stats::HISTOGRAM_SIZE - 1)) {
+      ++i;
+    }
+    return i;
+  }
+public:
+  JobCounters() { clear(); }
+  void clear() {
+    _jobs = 0;
+    _stolen = 0;
+    _wait_us = 0;
+    _run_us = 0;
+    _push_out_us = 0;
+    memset(_wait_histogram, 0, sizeof(_wait_histogram));
+    memset(_run_histogram, 0, sizeof(_run_histogram));
+  }
+  // Times as given by now(), queued is 0 if unknown
+  void record(uint64_t queued, uint64_t started, uint64_t ran,
+      uint64_t pushed) {
+    if ((queued != 0) && (started > queued)) {
+      add(&_wait_us, started - queued);
+      add(&_wait_histogram[bucket(started - queued)], 1);
+    } else {
+      add(&_wait_histogram[0], 1);
+    }
+    if (ran > started) {
+      add(&_run_us, ran - started);
+    }
+    add(&_run_histogram[bucket(ran > started ? ran - started : 0)], 1);
+    if (pushed > ran) {
+      add(&_push_out_us, pushed - ran);
+    }
+    add(&_jobs, 1);
+  }
+  void stole(size_t jobs) {
+    add(&_stolen, jobs);
+  }
+  void addTo(ThreadsManager::Stats* stats) const {
+    stats->jobs_completed += get(&_jobs);
+    stats->jobs_stolen += get(&_stolen);
+    stats->wait_us += get(&_wait_us);
+    stats->run_us += get(&_run_us);
+    stats->push_out_us += get(&_push_out_us);
+    for (size_t i = 0; i < ThreadsManager::Stats::HISTOGRAM_SIZE; ++i) {
+      stats->wait_histogram[i] += get(&_wait_histogram[i]);
+      stats->run_histogram[i] += get(&_run_histogram[i]);
+    }
+  }
+  // Called with the owner thread stopped
+  void addTo(JobCounters* c) const {
+    c->_jobs += _jobs;
+    c->_stolen += _stolen;
+    c->_wait_us += _wait_us;
+    c->_run_us += _run_us;
+    c->_push_out_us += _push_out_us;
+    for (size_t i = 0; i < ThreadsManager::Stats::HISTOGRAM_SIZE; ++i) {
+      c->_wait_histogram[i] += _wait_histogram[i];
+      c->_run_histogram[i] += _run_histogram[i];
+    }
+  }
+};
+
 struct WorkerThreadData;
+struct StealingWorkerData;
 
 struct ThreadsManagerData {
   // Parameters
@@ -95,6 +189,17 @@ struct ThreadsManagerData {
   size_t                    threads;
   time_t                    time_out;
   bool                      running;
+  bool                      urgent;
+  bool                      cpu_affinity;
+  int                       order;
+  // Work-stealing mode
+  bool                      work_stealing;
+  StealingWorkerData**      workers;
+  size_t                    busy_workers;
+  // Statistics, protected by threads_list_lock
+  uint64_t                  threads_created;
+  uint64_t                  threads_reaped;
+  JobCounters               retired;
   // Callback
   ThreadsManager::callback_f callback;
   void*                     callback_user;
@@ -108,7 +213,9 @@ struct ThreadsManagerData {
   Stack<WorkerThreadData>   busy_threads;
   Stack<WorkerThreadData>   idle_threads;
   ThreadsManagerData(Queue* in, Queue* out)
-  : q_in(in), q_out(out), time_out(600), running(false), callback(NULL) {
+  : q_in(in), q_out(out), time_out(600), running(false), urgent(false),
+    cpu_affinity(false), work_stealing(false), workers(NULL), busy_workers(0),
+    threads_created(0), threads_reaped(0), callback(NULL) {
     pthread_mutex_init(&callback_lock, NULL);
     pthread_mutex_init(&threads_list_lock, NULL);
     pthread_cond_init(&idle_cond, NULL);
@@ -124,8 +231,47 @@ struct ThreadsManagerData {
     callback(idle, callback_user);
     pthread_mutex_unlock(&callback_lock);
   }
+  // Work-stealing mode: activity report on first busy/last idle worker
+  void workerBusy() {
+    pthread_mutex_lock(&threads_list_lock);
+    if ((busy_workers++ == 0) && (callback != NULL)) {
+      activityCallback(false);
+    }
+    pthread_mutex_unlock(&threads_list_lock);
+  }
+  void workerIdle() {
+    pthread_mutex_lock(&threads_list_lock);
+    if ((--busy_workers == 0) && (callback != NULL)) {
+      activityCallback(true);
+    }
+    pthread_mutex_unlock(&threads_list_lock);
+  }
 };
 
+// Bind thread to one of the allowed CPUs, chosen by thread number
+static void set_cpu_affinity(const char* name, pthread_t tid, int number) {
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    hlog_error("%s.%d %s getting CPU affinity", name, number, strerror(errno));
+    return;
+  }
+  int target = (number - 1) % CPU_COUNT(&allowed);
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &allowed) && (target-- == 0)) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+      int rc = pthread_setaffinity_np(tid, sizeof(set), &set);
+      if (rc != 0) {
+        hlog_error("%s.%d %s setting CPU affinity", name, number, strerror(rc));
+      } else {
+        hlog_regression("%s.%d bound to CPU %d", name, number, cpu);
+      }
+      break;
+    }
+  }
+}
+
 static void* worker_thread(void* data);
 
 struct WorkerThreadData {
@@ -137,20 +283,28 @@ struct WorkerThreadData {
   time_t                    last_run;
   pthread_mutex_t           mutex;
   void*                     data;
-  WorkerThreadData(ThreadsManagerData& p, int n): parent(p), number(n) {
+  uint64_t                  queued_at;
+  JobCounters               counters;
+  WorkerThreadData(ThreadsManagerData& p, int n)
+  : parent(p), number(n), data(this), queued_at(0) {
     pthread_mutex_init(&mutex, NULL);
     pthread_mutex_lock(&mutex);
   }
   ~WorkerThreadData() {
     pthread_mutex_destroy(&mutex);
   }
-  void push(void* d) {
+  void push(void* d, uint64_t t) {
     data = d;
+    queued_at = t;
     pthread_mutex_unlock(&mutex);
   }
   int start() {
     hlog_regression("%s.%d starting", parent.name, number);
-    return pthread_create(&tid, NULL, worker_thread, this);
+    int rc = pthread_create(&tid, NULL, worker_thread, this);
+    if ((rc == 0) && parent.cpu_affinity) {
+      set_cpu_affinity(parent.name, tid, number);
+    }
+    return rc;
   }
   void stop() {
     hlog_regression("%s.%d stopping", parent.name, number);
@@ -160,6 +314,97 @@ struct WorkerThreadData {
   }
 };
 
+static void* stealing_worker_thread(void* data);
+
+struct StealingWorkerData {
+  ThreadsManagerData&       parent;
+  pthread_t                 tid;
+  int                       number;
+  // Local deque: the owner takes from the back, thieves from the front
+  pthread_mutex_t           mutex;
+  void*                     jobs[BATCH_SIZE];
+  uint64_t                  times[BATCH_SIZE];
+  size_t                    first;
+  size_t                    count;
+  JobCounters               counters;
+  StealingWorkerData(ThreadsManagerData& p, int n)
+  : parent(p), number(n), first(0), count(0) {
+    pthread_mutex_init(&mutex, NULL);
+  }
+  ~StealingWorkerData() {
+    pthread_mutex_destroy(&mutex);
+  }
+  // Only called by owner, when its deque is empty
+  void fill(void** data, const uint64_t* queued_at, size_t n) {
+    pthread_mutex_lock(&mutex);
+    memcpy(jobs, data, n * sizeof(void*));
+    memcpy(times, queued_at, n * sizeof(uint64_t));
+    first = 0;
+    count = n;
+    pthread_mutex_unlock(&mutex);
+  }
+  bool pop(void** data, uint64_t* queued_at) {
+    bool rc = false;
+    pthread_mutex_lock(&mutex);
+    if (count > 0) {
+      --count;
+      *data = jobs[first + count];
+      *queued_at = times[first + count];
+      rc = true;
+    }
+    pthread_mutex_unlock(&mutex);
+    return rc;
+  }
+  // Take half the jobs (rounded up) from the front
+  size_t stealHalf(void** data, uint64_t* queued_at) {
+    size_t n = 0;
+    if (pthread_mutex_trylock(&mutex) == 0) {
+      n = (count + 1) / 2;
+      memcpy(data, &jobs[first], n * sizeof(void*));
+      memcpy(queued_at, &times[first], n * sizeof(uint64_t));
+      first += n;
+      count -= n;
+      pthread_mutex_unlock(&mutex);
+    }
+    return n;
+  }
+  bool steal(void** data, uint64_t* queued_at) {
+    size_t threads = parent.threads;
+    for (size_t i = 1; i < threads; ++i) {
+      StealingWorkerData* victim = parent.workers[(number - 1 + i) % threads];
+      void*    stolen[BATCH_SIZE];
+      uint64_t stolen_times[BATCH_SIZE];
+      size_t n = victim->stealHalf(stolen, stolen_times);
+      if (n > 0) {
+        hlog_regression("%s.%d stole %zu job(s) from %d", parent.name, number,
+          n, victim->number);
+        counters.stole(n);
+        *data = stolen[0];
+        *queued_at = stolen_times[0];
+        if (n > 1) {
+          fill(&stolen[1], &stolen_times[1], n - 1);
+          // Let some sleeping thread steal from us
+          parent.q_in->signal();
+        }
+        return true;
+      }
+    }
+    return false;
+  }
+  int start() {
+    hlog_regression("%s.%d starting", parent.name, number);
+    int rc = pthread_create(&tid, NULL, stealing_worker_thread, this);
+    if ((rc == 0) && parent.cpu_affinity) {
+      set_cpu_affinity(parent.name, tid, number);
+    }
+    return rc;
+  }
+  void join() {
+    pthread_join(tid, NULL);
+    hlog_regression("%s.%d joined", parent.name, number);
+  }
+};
+
 struct ThreadsManager::Private {
   ThreadsManagerData         data;
   pthread_t                 monitor_tid;
@@ -178,10 +423,13 @@ static void* worker_thread(void* data) {
     if (d->data != d) {
       hlog_regression("%s.%d.loop has data", d->parent.name, d->number);
       // Work
+      uint64_t started = now();
       void* data_out = d->parent.routine(d->data, d->parent.user);
+      uint64_t ran = now();
       if (d->parent.q_out != NULL) {
         d->parent.q_out->push(data_out);
       }
+      d->counters.record(d->queued_at, started, ran, now());
       // Lock before checking that we're still running
       pthread_mutex_lock(&d->parent.threads_list_lock);
       d->parent.busy_threads.remove(d);
@@ -203,19 +451,88 @@ static void* worker_thread(void* data) {
   return NULL;
 }
 
+static void* stealing_worker_thread(void* data) {
+  StealingWorkerData* d = static_cast<StealingWorkerData*>(data);
+  ThreadsManagerData& parent = d->parent;
+  if (parent.thread_id_base >= 0) {
+    htoolbox::tl_thread_id = parent.thread_id_base + d->number;
+  }
+  bool busy = false;
+  // Loop
+  while (true) {
+    void*    data_in;
+    uint64_t queued_at = 0;
+    // Own jobs first, then other threads', then the input queue
+    bool got = d->pop(&data_in, &queued_at) || d->steal(&data_in, &queued_at);
+    if (! got) {
+      if (busy) {
+        busy = false;
+        parent.workerIdle();
+      }
+      void*    jobs[BATCH_SIZE];
+      uint64_t times[BATCH_SIZE];
+      size_t   n;
+      int q_rc = parent.q_in->popBatch(jobs, BATCH_SIZE, &n, times);
+      if (q_rc == 0) {
+        hlog_regression("%s.%d.loop got %zu job(s)", parent.name, d->number, n);
+        data_in = jobs[0];
+        queued_at = times[0];
+        if (n > 1) {
+          d->fill(&jobs[1], &times[1], n - 1);
+          // Let some sleeping thread steal from us
+          parent.q_in->signal();
+        }
+        got = true;
+      } else
+      if (q_rc < 0) {
+        // Closed: help finishing the remaining jobs, unless urgent
+        if (parent.urgent || ! d->steal(&data_in, &queued_at)) {
+          hlog_regression("%s.%d.loop exit", parent.name, d->number);
+          break;
+        }
+        got = true;
+      }
+      // Signalled: try stealing again
+    }
+    if (got) {
+      if (parent.urgent) {
+        hlog_regression("%s.%d.loop exit", parent.name, d->number);
+        break;
+      }
+      if (! busy) {
+        busy = true;
+        parent.workerBusy();
+      }
+      // Work
+      uint64_t started = now();
+      void* data_out = parent.routine(data_in, parent.user);
+      uint64_t ran = now();
+      if (parent.q_out != NULL) {
+        parent.q_out->push(data_out);
+      }
+      d->counters.record(queued_at, started, ran, now());
+    }
+  }
+  if (busy) {
+    parent.workerIdle();
+  }
+  // Exit
+  return NULL;
+}
+
 static void* monitor_thread(void* data) {
   ThreadsManagerData* d = static_cast<ThreadsManagerData*>(data);
   if (d->thread_id_base >= 0) {
     htoolbox::tl_thread_id = d->thread_id_base;
   }
-  int order = 0;
   bool busy = false;
   // Loop
   bool run = true;
   do {
     hlog_regression("%s.loop enter", d->name);
-    void* data_in;
-    int q_rc = d->q_in->pop(&data_in);
+    void*    data_in;
+    uint64_t queued_at;
+    int q_rc = d->q_in->pop(&data_in, &queued_at);
     pthread_mutex_lock(&d->threads_list_lock);
     if (q_rc == 1) {
       // Activity report
@@ -244,27 +561,30 @@ static void* monitor_thread(void* data) {
         wtd = d->idle_threads.pop();
         // Always push to back so longest running threads are at the front
         d->busy_threads.push(wtd);
-        // Get rid of oldest idle thread if too old
+        // Get rid of oldest idle thread if too old, keeping the minimum
         WorkerThreadData* bottom = d->idle_threads.bottom();
-        if (bottom != NULL) {
+        if ((bottom != NULL) && (d->threads > d->min_threads)) {
           hlog_regression("%s.%d age %ld, t-o %ld", d->name, bottom->number,
             time(NULL) - bottom->last_run, d->time_out);
           if ((time(NULL) - bottom->last_run) > d->time_out) {
             d->idle_threads.remove(bottom);
             bottom->stop();
+            bottom->counters.addTo(&d->retired);
             delete bottom;
             --d->threads;
+            ++d->threads_reaped;
           }
         }
       } else
       // Create new thread if possible
       if (((d->max_threads == 0) || (d->threads < d->max_threads))) {
         // Create worker thread
-        wtd = new WorkerThreadData(*d, ++order);
+        wtd = new WorkerThreadData(*d, ++d->order);
         int rc = wtd->start();
         if (rc == 0) {
           d->busy_threads.push(wtd);
           ++d->threads;
+          ++d->threads_created;
           hlog_regression("%s.loop thread %d created", d->name, wtd->number);
         } else {
           hlog_error("%s.loop %s creating thread %d", d->name, strerror(-rc),
@@ -285,7 +605,7 @@ static void* monitor_thread(void* data) {
         }
       }
       // Start worker thread
-      wtd->push(data_in);
+      wtd->push(data_in, queued_at);
       // Activity report
       hlog_regression("%s.loop: %s busy (%zu/%zu)",
         d->name, busy ? "remaining" : "becoming",
@@ -307,6 +627,7 @@ static void* monitor_thread(void* data) {
             d->name, bottom->number, d->busy_threads.size(), d->threads);
           d->idle_threads.remove(bottom);
           bottom->stop();
+          bottom->counters.addTo(&d->retired);
           delete bottom;
           --d->threads;
         } else {
@@ -346,6 +667,8 @@ ThreadsManager::ThreadsManager(
     void*       user,
     size_t      q_in_size,
     Queue*      q_out) : in(name, q_in_size), _d(new Private(&in, q_out)) {
+  // Needed for the queue wait statistics
+  in.setTimestamps(true);
   strncpy(_d->data.name, name, NAME_SIZE);
   _d->data.name[NAME_SIZE - 1] ='\0';
   _d->data.routine = routine;
@@ -368,16 +691,134 @@ void ThreadsManager::setThreadIdBase(int thread_id_base) {
   _d->data.thread_id_base = thread_id_base;
 }
 
+void ThreadsManager::setWorkStealing(bool work_stealing) {
+  _d->data.work_stealing = work_stealing;
+}
+
+void ThreadsManager::setCpuAffinity(bool cpu_affinity) {
+  _d->data.cpu_affinity = cpu_affinity;
+}
+
+static int start_min_threads(ThreadsManagerData& d) {
+  for (size_t i = 0; i < d.min_threads; ++i) {
+    WorkerThreadData* wtd = new WorkerThreadData(d, ++d.order);
+    int rc = wtd->start();
+    if (rc != 0) {
+      hlog_error("%s %s creating thread %d", d.name, strerror(rc),
+        wtd->number);
+      delete wtd;
+      return rc;
+    }
+    wtd->last_run = time(NULL);
+    d.idle_threads.push(wtd);
+    ++d.threads;
+    ++d.threads_created;
+  }
+  return 0;
+}
+
+static void stop_min_threads(ThreadsManagerData& d) {
+  WorkerThreadData* wtd;
+  while ((wtd = d.idle_threads.pop()) != NULL) {
+    wtd->stop();
+    delete wtd;
+  }
+  d.threads = 0;
+}
+
+static int start_stealing_workers(ThreadsManagerData& d) {
+  size_t threads = d.max_threads;
+  if (threads == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 0 ? static_cast<size_t>(cpus) : 1;
+  }
+  d.workers = new StealingWorkerData*[threads];
+  for (size_t i = 0; i < threads; ++i) {
+    d.workers[i] = new StealingWorkerData(d, static_cast<int>(i + 1));
+  }
+  d.threads = threads;
+  d.busy_workers = 0;
+  for (size_t i = 0; i < threads; ++i) {
+    int rc = d.workers[i]->start();
+    if (rc == 0) {
+      ++d.threads_created;
+    }
+    if (rc != 0) {
+      hlog_error("%s %s creating thread %d", d.name, strerror(rc),
+        d.workers[i]->number);
+      // Stop the threads already started
+      d.urgent = true;
+      d.q_in->close(true);
+      while (i-- > 0) {
+        d.workers[i]->join();
+      }
+      for (size_t j = 0; j < threads; ++j) {
+        delete d.workers[j];
+      }
+      delete[] d.workers;
+      d.workers = NULL;
+      d.threads = 0;
+      return rc;
+    }
+  }
+  return 0;
+}
+
+static void stop_stealing_workers(ThreadsManagerData& d) {
+  for (size_t i = 0; i < d.threads; ++i) {
+    d.workers[i]->join();
+  }
+  pthread_mutex_lock(&d.threads_list_lock);
+  for (size_t i = 0; i < d.threads; ++i) {
+    d.workers[i]->counters.addTo(&d.retired);
+    delete d.workers[i];
+  }
+  delete[] d.workers;
+  d.workers = NULL;
+  d.threads = 0;
+  pthread_mutex_unlock(&d.threads_list_lock);
+}
+
 int ThreadsManager::start(size_t max_threads, size_t min_threads, time_t time_out) {
   if (_d->data.running) return -1;
   _d->data.q_in->open();
+  if ((max_threads != 0) && (min_threads > max_threads)) {
+    min_threads = max_threads;
+  }
   _d->data.min_threads = min_threads;
   _d->data.max_threads = max_threads;
   _d->data.time_out = time_out;
-  // Start monitoring thread
-  int rc = pthread_create(&_d->monitor_tid, NULL, monitor_thread, &_d->data);
+  _d->data.urgent = false;
+  pthread_mutex_lock(&_d->data.threads_list_lock);
+  _d->data.threads_created = 0;
+  _d->data.threads_reaped = 0;
+  _d->data.retired.clear();
+  pthread_mutex_unlock(&_d->data.threads_list_lock);
+  int rc;
+  if (_d->data.work_stealing) {
+    // Activity must be reported before any worker is started
+    if (_d->data.callback != NULL) {
+      _d->data.activityCallback(true);
+    }
+    rc = start_stealing_workers(_d->data);
+    if (rc == 0) {
+      _d->data.running = true;
+      hlog_regression("%s.threads created", _d->data.name);
+    }
+    return rc;
+  }
+  // Start minimum number of threads, so they are ready for the first jobs
+  _d->data.threads = 0;
+  _d->data.order = 0;
+  rc = start_min_threads(_d->data);
   if (rc == 0) {
-    _d->data.threads = 0;
+    // Start monitoring thread
+    rc = pthread_create(&_d->monitor_tid, NULL, monitor_thread, &_d->data);
+  }
+  if (rc != 0) {
+    stop_min_threads(_d->data);
+    _d->data.q_in->close();
+  } else {
     if (_d->data.callback != NULL) {
       _d->data.activityCallback(true);
     }
@@ -389,10 +830,16 @@ int ThreadsManager::start(size_t max_threads, size_t min_threads, time_t time_ou
 
 int ThreadsManager::stop(bool urgent) {
   if (! _d->data.running) return -1;
-  // Stop monitoring thread
+  _d->data.urgent = urgent;
   _d->data.q_in->close(urgent);
-  pthread_join(_d->monitor_tid, NULL);
-  hlog_regression("%s.thread joined", _d->data.name);
+  if (_d->data.work_stealing) {
+    stop_stealing_workers(_d->data);
+    hlog_regression("%s.threads joined", _d->data.name);
+  } else {
+    // Stop monitoring thread
+    pthread_join(_d->monitor_tid, NULL);
+    hlog_regression("%s.thread joined", _d->data.name);
+  }
   _d->data.running = false;
 
   return 0;
@@ -401,3 +848,34 @@ int ThreadsManager::stop(bool urgent) {
 size_t ThreadsManager::threads() const {
   return _d->data.threads;
 }
+
+void ThreadsManager::getStats(Stats* stats) const {
+  const ThreadsManagerData& d = _d->data;
+  memset(stats, 0, sizeof(*stats));
+  stats->queue_depth = d.q_in->size();
+  pthread_mutex_lock(&_d->data.threads_list_lock);
+  stats->threads_created = d.threads_created;
+  stats->threads_reaped = d.threads_reaped;
+  d.retired.addTo(stats);
+  if (d.work_stealing) {
+    if (d.workers != NULL) {
+      for (size_t i = 0; i < d.threads; ++i) {
+        d.workers[i]->counters.addTo(stats);
+      }
+      stats->busy_threads = d.busy_workers;
+      stats->idle_threads = d.threads - d.busy_workers;
+    }
+  } else {
+    for (const WorkerThreadData* wtd = _d->data.busy_threads.top();
+        wtd != NULL; wtd = wtd->next) {
+      wtd->counters.addTo(stats);
+    }
+    for (const WorkerThreadData* wtd = _d->data.idle_threads.top();
+        wtd != NULL; wtd = wtd->next) {
+      wtd->counters.addTo(stats);
+    }
+    stats->busy_threads = d.busy_threads.size();
+    stats->idle_threads = d.idle_threads.size();
+  }
+  pthread_mutex_unlock(&_d->data.threads_list_lock);
+}
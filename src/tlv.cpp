@@ -21,6 +21,7 @@
 #include <string.h>
 #include <errno.h>
 #include <pthread.h>
+#include <sys/uio.h>
 
 #include "tlv.h"
 
@@ -77,14 +78,14 @@ int Sender::write(uint16_t tag, const void* buffer, size_t len) {
   tag_len[1] = static_cast<uint8_t>(tag);
   tag_len[2] = static_cast<uint8_t>(len >> 8);
   tag_len[3] = static_cast<uint8_t>(len);
-  rc = _fd.put(tag_len, sizeof(tag_len));
-  if (rc < static_cast<ssize_t>(sizeof(tag_len))) {
-    _failed = true;
-    return -1;
-  }
-  // Value
-  rc = _fd.put(cbuffer, len);
-  if (rc < static_cast<ssize_t>(len)) {
+  // Value, sent together
+  struct iovec iov[2];
+  iov[0].iov_base = tag_len;
+  iov[0].iov_len  = sizeof(tag_len);
+  iov[1].iov_base = const_cast<char*>(cbuffer);
+  iov[1].iov_len  = len;
+  rc = _fd.putv(iov, 2);
+  if (rc < static_cast<ssize_t>(sizeof(tag_len) + len)) {
     _failed = true;
     return -1;
   }
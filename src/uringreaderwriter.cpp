@@ -0,0 +1,643 @@
+/*
+    Copyright (C) 2011  Hervé Fache
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 3.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+
+// No need for liburing: the few system calls used are wrapped below
+#if defined(__NR_io_uring_setup) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#include <report.h>
+#include "filereaderwriter.h"
+#include "uringreaderwriter.h"
+
+using namespace htoolbox;
+
+#ifdef HAVE_IO_URING
+static int uring_setup(unsigned entries, struct io_uring_params* params) {
+  return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags) {
+  return static_cast<int>(syscall(__NR_io_uring_enter, fd, submit, wait,
+    flags, NULL, 0));
+}
+#endif
+
+struct UringReaderWriter::Private {
+  // One buffer of the ring, with the transfer it is used for
+  struct Slot {
+    char*         buffer;
+    int64_t       offset;     // offset in the file
+    size_t        length;     // bytes to transfer
+    size_t        done;       // bytes transferred
+    size_t        used;       // bytes consumed (reader) or given (writer)
+    bool          busy;       // transfer in flight
+    bool          eof;        // reader: end of file reached
+    int           error;      // reader: errno of failed transfer
+    struct iovec  iov;        // must stay valid while in flight
+  };
+  char              path[PATH_MAX];
+  bool              writer;
+  size_t            depth;
+  size_t            size;
+  // Synchronous fallback
+  FileReaderWriter  file;
+  bool              async;
+  // File
+  int               fd;
+  int64_t           offset;       // offset in the stream, as seen by caller
+  int64_t           file_offset;  // offset of the next transfer to queue
+  // Ring of buffers: from head, queued slots are in flight or done
+  char*             buffers;
+  Slot*             slots;
+  size_t            head;
+  size_t            queued;
+  size_t            in_flight;
+  bool              eof;
+  int               error;        // writer: errno of first failed transfer
+#ifdef HAVE_IO_URING
+  // io_uring
+  int               ring_fd;
+  void*             sq_ring;
+  size_t            sq_ring_size;
+  void*             cq_ring;
+  size_t            cq_ring_size;
+  io_uring_sqe*     sqes;
+  size_t            sqes_size;
+  unsigned*         sq_tail;
+  unsigned*         sq_mask;
+  unsigned*         sq_array;
+  unsigned*         cq_head;
+  unsigned*         cq_tail;
+  unsigned*         cq_mask;
+  io_uring_cqe*     cqes;
+  unsigned          to_submit;
+#endif
+  Private(const char* p, bool w, size_t d, size_t s) : writer(w), depth(d),
+      size(s), file(p, w), async(false), fd(-1), buffers(NULL), slots(NULL) {
+#ifdef HAVE_IO_URING
+    ring_fd = -1;
+    sq_ring = cq_ring = MAP_FAILED;
+    sqes = NULL;
+#endif
+    snprintf(path, sizeof(path), "%s", p);
+    if (size == 0) {
+      size = 1;
+    }
+  }
+  int setup();
+  void cleanup();
+  void queue(size_t index);
+  int submit(unsigned wait);
+  void complete(size_t index, int result);
+  void reap();
+  int wait();
+  int fill();
+  ssize_t current(const char** data);
+  void consume(size_t length);
+  ssize_t room(char** data);
+  int flush();
+};
+
+int UringReaderWriter::Private::setup() {
+#ifdef HAVE_IO_URING
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring_fd = uring_setup(static_cast<unsigned>(depth), &params);
+  if (ring_fd < 0) {
+    return -1;
+  }
+  sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size = params.cq_off.cqes +
+    params.cq_entries * sizeof(io_uring_cqe);
+  bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single && (cq_ring_size > sq_ring_size)) {
+    sq_ring_size = cq_ring_size;
+  }
+  sq_ring = cq_ring = MAP_FAILED;
+  sqes = NULL;
+  sq_ring = ::mmap(NULL, sq_ring_size, PROT_READ|PROT_WRITE,
+    MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  if (sq_ring != MAP_FAILED) {
+    cq_ring = single ? sq_ring : ::mmap(NULL, cq_ring_size,
+      PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd,
+      IORING_OFF_CQ_RING);
+  }
+  sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+  void* map = MAP_FAILED;
+  if (cq_ring != MAP_FAILED) {
+    map = ::mmap(NULL, sqes_size, PROT_READ|PROT_WRITE,
+      MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+  }
+  if (map == MAP_FAILED) {
+    int errno_keep = errno;
+    cleanup();
+    errno = errno_keep;
+    return -1;
+  }
+  sqes = static_cast<io_uring_sqe*>(map);
+  char* sq = static_cast<char*>(sq_ring);
+  sq_tail = reinterpret_cast<unsigned*>(&sq[params.sq_off.tail]);
+  sq_mask = reinterpret_cast<unsigned*>(&sq[params.sq_off.ring_mask]);
+  sq_array = reinterpret_cast<unsigned*>(&sq[params.sq_off.array]);
+  char* cq = static_cast<char*>(cq_ring);
+  cq_head = reinterpret_cast<unsigned*>(&cq[params.cq_off.head]);
+  cq_tail = reinterpret_cast<unsigned*>(&cq[params.cq_off.tail]);
+  cq_mask = reinterpret_cast<unsigned*>(&cq[params.cq_off.ring_mask]);
+  cqes = reinterpret_cast<io_uring_cqe*>(&cq[params.cq_off.cqes]);
+  to_submit = 0;
+  return 0;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+void UringReaderWriter::Private::cleanup() {
+#ifdef HAVE_IO_URING
+  if (sqes != NULL) {
+    ::munmap(sqes, sqes_size);
+    sqes = NULL;
+  }
+  if ((cq_ring != MAP_FAILED) && (cq_ring != sq_ring)) {
+    ::munmap(cq_ring, cq_ring_size);
+  }
+  cq_ring = MAP_FAILED;
+  if (sq_ring != MAP_FAILED) {
+    ::munmap(sq_ring, sq_ring_size);
+  }
+  sq_ring = MAP_FAILED;
+  if (ring_fd >= 0) {
+    ::close(ring_fd);
+  }
+  ring_fd = -1;
+#endif
+}
+
+// Queue transfer of what is left to do for given slot
+void UringReaderWriter::Private::queue(size_t index) {
+#ifdef HAVE_IO_URING
+  Slot& slot = slots[index];
+  slot.iov.iov_base = &slot.buffer[slot.done];
+  slot.iov.iov_len = slot.length - slot.done;
+  // Only this thread adds entries
+  unsigned tail = *sq_tail;
+  unsigned entry = tail & *sq_mask;
+  io_uring_sqe* sqe = &sqes[entry];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = writer ? IORING_OP_WRITEV : IORING_OP_READV;
+  sqe->fd = fd;
+  sqe->off = static_cast<uint64_t>(slot.offset) + slot.done;
+  sqe->addr = reinterpret_cast<uintptr_t>(&slot.iov);
+  sqe->len = 1;
+  sqe->user_data = index;
+  sq_array[entry] = entry;
+  __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ++to_submit;
+#else
+  (void) index;
+#endif
+}
+
+// Submit queued transfers, and wait for given number of completions
+int UringReaderWriter::Private::submit(unsigned wait) {
+#ifdef HAVE_IO_URING
+  while ((to_submit > 0) || (wait > 0)) {
+    int rc = uring_enter(ring_fd, to_submit, wait,
+      wait > 0 ? IORING_ENTER_GETEVENTS : 0);
+    if (rc < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    to_submit -= static_cast<unsigned>(rc);
+    wait = 0;
+  }
+  return 0;
+#else
+  (void) wait;
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+void UringReaderWriter::Private::complete(size_t index, int result) {
+  Slot& slot = slots[index];
+  if ((result == -EAGAIN) || (result == -EINTR)) {
+    queue(index);
+    return;
+  }
+  if (result < 0) {
+    if (writer) {
+      if (error == 0) {
+        error = -result;
+      }
+    } else {
+      slot.error = -result;
+    }
+  } else
+  if (result == 0) {
+    if (writer) {
+      if (error == 0) {
+        error = EIO;
+      }
+    } else {
+      slot.eof = true;
+      eof = true;
+    }
+  } else {
+    slot.done += result;
+    // Short transfer: carry on from there
+    if (slot.done < slot.length) {
+      queue(index);
+      return;
+    }
+  }
+  slot.busy = false;
+  --in_flight;
+}
+
+void UringReaderWriter::Private::reap() {
+#ifdef HAVE_IO_URING
+  unsigned head = *cq_head;
+  unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+  while (head != tail) {
+    const io_uring_cqe& cqe = cqes[head & *cq_mask];
+    complete(static_cast<size_t>(cqe.user_data), cqe.res);
+    ++head;
+  }
+  __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+#endif
+}
+
+// Wait for at least one transfer to complete
+int UringReaderWriter::Private::wait() {
+  if (submit(1) < 0) {
+    return -1;
+  }
+  reap();
+  return 0;
+}
+
+// Reader: keep all free slots reading ahead
+int UringReaderWriter::Private::fill() {
+  while (! eof && (queued < depth)) {
+    size_t index = (head + queued) % depth;
+    Slot& slot = slots[index];
+    slot.offset = file_offset;
+    slot.length = size;
+    slot.done = 0;
+    slot.used = 0;
+    slot.busy = true;
+    slot.eof = false;
+    slot.error = 0;
+    queue(index);
+    file_offset += size;
+    ++queued;
+    ++in_flight;
+  }
+  return submit(0);
+}
+
+// Reader: get data from oldest slot, waiting for it as needed
+ssize_t UringReaderWriter::Private::current(const char** data) {
+  if (fill() < 0) {
+    return -1;
+  }
+  if (queued == 0) {
+    return 0;
+  }
+  Slot& slot = slots[head];
+  while (slot.busy) {
+    if (wait() < 0) {
+      return -1;
+    }
+  }
+  if (slot.error != 0) {
+    errno = slot.error;
+    return -1;
+  }
+  *data = &slot.buffer[slot.used];
+  return slot.done - slot.used;
+}
+
+// Reader: consume data from oldest slot, which is read again at next fill()
+void UringReaderWriter::Private::consume(size_t length) {
+  Slot& slot = slots[head];
+  slot.used += length;
+  offset += length;
+  if ((slot.used == slot.done) && (slot.done > 0)) {
+    head = (head + 1) % depth;
+    --queued;
+  }
+}
+
+// Writer: get free part of current slot, waiting for it as needed
+ssize_t UringReaderWriter::Private::room(char** data) {
+  Slot& slot = slots[head];
+  while (slot.busy) {
+    if (wait() < 0) {
+      return -1;
+    }
+  }
+  if (error != 0) {
+    errno = error;
+    return -1;
+  }
+  *data = &slot.buffer[slot.used];
+  return size - slot.used;
+}
+
+// Writer: queue current slot for writing, and move on to the next one
+int UringReaderWriter::Private::flush() {
+  Slot& slot = slots[head];
+  if (slot.used == 0) {
+    return 0;
+  }
+  slot.offset = file_offset;
+  slot.length = slot.used;
+  slot.done = 0;
+  slot.busy = true;
+  queue(head);
+  file_offset += slot.used;
+  slot.used = 0;
+  ++in_flight;
+  head = (head + 1) % depth;
+  return submit(0);
+}
+
+UringReaderWriter::UringReaderWriter(const char* path, bool writer,
+    size_t depth, size_t buffer_size) :
+    _d(new Private(path, writer, depth, buffer_size)) {}
+
+UringReaderWriter::~UringReaderWriter() {
+  if (_d->async) {
+    close();
+  }
+  delete _d;
+}
+
+int UringReaderWriter::open() {
+  _d->async = false;
+  if (_d->depth == 0) {
+    return _d->file.open();
+  }
+  void* buffers;
+  if (::posix_memalign(&buffers, 4096, _d->depth * _d->size) != 0) {
+    return -1;
+  }
+  if (_d->setup() < 0) {
+    hlog_debug("io_uring not available (%s), using synchronous I/O",
+      strerror(errno));
+    ::free(buffers);
+    return _d->file.open();
+  }
+  if (_d->writer) {
+    _d->fd = ::open64(_d->path, O_WRONLY|O_CREAT|O_TRUNC|O_LARGEFILE, 0666);
+  } else {
+    _d->fd = ::open64(_d->path, O_RDONLY|O_NOATIME|O_LARGEFILE);
+    // Try without O_NOATIME
+    if ((_d->fd < 0) && (errno == EPERM)) {
+      _d->fd = ::open64(_d->path, O_RDONLY|O_LARGEFILE);
+    }
+  }
+  if (_d->fd < 0) {
+    int errno_keep = errno;
+    _d->cleanup();
+    ::free(buffers);
+    errno = errno_keep;
+    return -1;
+  }
+  _d->buffers = static_cast<char*>(buffers);
+  _d->slots = new Private::Slot[_d->depth];
+  for (size_t i = 0; i < _d->depth; ++i) {
+    _d->slots[i].buffer = &_d->buffers[i * _d->size];
+    _d->slots[i].used = 0;
+    _d->slots[i].busy = false;
+  }
+  _d->offset = 0;
+  _d->file_offset = 0;
+  _d->head = 0;
+  _d->queued = 0;
+  _d->in_flight = 0;
+  _d->eof = false;
+  _d->error = 0;
+  _d->async = true;
+  return 0;
+}
+
+int UringReaderWriter::close() {
+  if (! _d->async) {
+    return _d->file.close();
+  }
+  int rc = 0;
+  if (_d->writer && (_d->flush() < 0)) {
+    rc = -1;
+  }
+  // The kernel must be done with the buffers before they are freed
+  while (_d->in_flight > 0) {
+    if (_d->wait() < 0) {
+      hlog_error("%s waiting for transfers to complete, '%s'",
+        strerror(errno), _d->path);
+      rc = -1;
+      break;
+    }
+  }
+  if (_d->writer && (_d->error != 0)) {
+    errno = _d->error;
+    rc = -1;
+  }
+  int errno_keep = errno;
+  _d->cleanup();
+  // Buffers still in use by the kernel if the wait failed, leak them
+  if (_d->in_flight == 0) {
+    ::free(_d->buffers);
+    delete[] _d->slots;
+  }
+  _d->buffers = NULL;
+  _d->slots = NULL;
+  if (::close(_d->fd) < 0) {
+    errno_keep = errno;
+    rc = -1;
+  }
+  _d->fd = -1;
+  _d->async = false;
+  errno = errno_keep;
+  return rc;
+}
+
+ssize_t UringReaderWriter::read(void* buffer, size_t size) {
+  if (! _d->async) {
+    return _d->file.read(buffer, size);
+  }
+  const char* data;
+  ssize_t length = _d->current(&data);
+  if (length <= 0) {
+    return length;
+  }
+  if (static_cast<size_t>(length) > size) {
+    length = size;
+  }
+  memcpy(buffer, data, length);
+  _d->consume(length);
+  return length;
+}
+
+ssize_t UringReaderWriter::get(void* buffer, size_t size) {
+  if (! _d->async) {
+    return _d->file.get(buffer, size);
+  }
+  char* cbuffer = static_cast<char*>(buffer);
+  ssize_t ssize = size;
+  ssize_t count = 0;
+  while (count < ssize) {
+    ssize_t rc = read(&cbuffer[count], size - count);
+    if (rc < 0) {
+      return rc;
+    }
+    if (rc == 0) {
+      /* count < size => end of file */
+      break;
+    }
+    count += rc;
+  }
+  return count;
+}
+
+ssize_t UringReaderWriter::put(const void* buffer, size_t size) {
+  if (! _d->async) {
+    return _d->file.put(buffer, size);
+  }
+  const char* cbuffer = static_cast<const char*>(buffer);
+  ssize_t ssize = size;
+  ssize_t count = 0;
+  while (count < ssize) {
+    char* data;
+    ssize_t length = _d->room(&data);
+    if (length < 0) {
+      return -1;
+    }
+    if (static_cast<size_t>(length) > size - count) {
+      length = size - count;
+    }
+    memcpy(data, &cbuffer[count], length);
+    count += length;
+    if (commit(length) < 0) {
+      return -1;
+    }
+  }
+  return count;
+}
+
+const char* UringReaderWriter::path() const {
+  return _d->path;
+}
+
+int64_t UringReaderWriter::offset() const {
+  if (! _d->async) {
+    return _d->file.offset();
+  }
+  return _d->offset;
+}
+
+ssize_t UringReaderWriter::peek(const void** buffer, size_t size) {
+  if (! _d->async) {
+    return _d->file.peek(buffer, size);
+  }
+  const char* data;
+  ssize_t length = _d->current(&data);
+  if (length <= 0) {
+    return length;
+  }
+  if (static_cast<size_t>(length) > size) {
+    length = size;
+  }
+  *buffer = data;
+  return length;
+}
+
+ssize_t UringReaderWriter::advance(size_t size) {
+  if (! _d->async) {
+    return _d->file.advance(size);
+  }
+  if (_d->queued == 0) {
+    if (size == 0) {
+      return 0;
+    }
+    errno = EINVAL;
+    return -1;
+  }
+  const Private::Slot& slot = _d->slots[_d->head];
+  if (slot.busy || (size > slot.done - slot.used)) {
+    errno = EINVAL;
+    return -1;
+  }
+  _d->consume(size);
+  return size;
+}
+
+ssize_t UringReaderWriter::reserve(void** buffer, size_t size) {
+  if (! _d->async) {
+    return _d->file.reserve(buffer, size);
+  }
+  char* data;
+  ssize_t length = _d->room(&data);
+  if (length < 0) {
+    return -1;
+  }
+  if (static_cast<size_t>(length) > size) {
+    length = size;
+  }
+  *buffer = data;
+  return length;
+}
+
+ssize_t UringReaderWriter::commit(size_t size) {
+  if (! _d->async) {
+    return _d->file.commit(size);
+  }
+  Private::Slot& slot = _d->slots[_d->head];
+  if (slot.busy || (size > _d->size - slot.used)) {
+    errno = EINVAL;
+    return -1;
+  }
+  slot.used += size;
+  _d->offset += size;
+  if ((slot.used == _d->size) && (_d->flush() < 0)) {
+    return -1;
+  }
+  return size;
+}
+
+bool UringReaderWriter::isAsync() const {
+  return _d->async;
+}
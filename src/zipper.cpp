@@ -14,7 +14,10 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <pthread.h>
 #include <zlib.h>
 
 #include <report.h>
@@ -23,17 +26,333 @@
 using namespace htoolbox;
 
 enum {
-  BUFFER_SIZE = 102400
+  BUFFER_SIZE = 102400,
+  BLOCK_SIZE  = 131072,
+  DICT_SIZE   = 32768
 };
 
+// Compress blocks in parallel, write them in order as one gzip member
+class ParallelDeflater {
+  enum State {
+    free_block,
+    filling,
+    submitted,
+    compressing,
+    compressed
+  };
+  struct Block {
+    State           state;
+    bool            last;
+    unsigned char   in[BLOCK_SIZE];
+    size_t          in_size;
+    unsigned char   dict[DICT_SIZE];
+    size_t          dict_size;
+    unsigned char*  out;
+    size_t          out_capacity;
+    size_t          out_size;
+    uLong           crc;
+    bool            failed;
+    Block() : out(NULL), out_capacity(0) {}
+    ~Block() { free(out); }
+  };
+  IReaderWriter*    _child;
+  const int         _level;
+  const size_t      _threads;
+  pthread_t*        _tids;
+  const size_t      _max_blocks;
+  Block*            _blocks;
+  size_t            _current;     // Block being filled
+  size_t            _next_job;    // Next block to compress
+  uLong             _crc;
+  uLong             _length;
+  bool              _running;     // Threads started
+  bool              _stopping;
+  pthread_mutex_t   _lock;
+  pthread_cond_t    _submitted_cond;
+  pthread_cond_t    _compressed_cond;
+  static void* _worker_thread(void* data);
+  int compress(z_stream* strm, Block& block);
+  int flush(Block& block);
+  int submit(bool last);
+  void stop();
+public:
+  ParallelDeflater(IReaderWriter* child, int level, size_t threads) :
+      _child(child), _level(level), _threads(threads),
+      _max_blocks(2 * threads), _running(false) {
+    _tids = new pthread_t[_threads];
+    _blocks = new Block[_max_blocks];
+    pthread_mutex_init(&_lock, NULL);
+    pthread_cond_init(&_submitted_cond, NULL);
+    pthread_cond_init(&_compressed_cond, NULL);
+  }
+  ~ParallelDeflater() {
+    // Not closed: the data is lost, but the threads must still be joined
+    stop();
+    pthread_cond_destroy(&_compressed_cond);
+    pthread_cond_destroy(&_submitted_cond);
+    pthread_mutex_destroy(&_lock);
+    delete[] _blocks;
+    delete[] _tids;
+  }
+  int open();
+  int close();
+  ssize_t put(const void* buffer, size_t size);
+};
+
+void* ParallelDeflater::_worker_thread(void* data) {
+  ParallelDeflater* d = static_cast<ParallelDeflater*>(data);
+  z_stream strm;
+  strm.zalloc = Z_NULL;
+  strm.zfree  = Z_NULL;
+  strm.opaque = Z_NULL;
+  // Raw deflate: the header and trailer are written by the deflater itself
+  bool failed = deflateInit2(&strm, d->_level, Z_DEFLATED, -15, 9,
+    Z_DEFAULT_STRATEGY) != Z_OK;
+  if (failed) {
+    hlog_alert("failed to initialise compression (level = %d)", d->_level);
+  }
+  pthread_mutex_lock(&d->_lock);
+  do {
+    Block& block = d->_blocks[d->_next_job];
+    if (block.state != submitted) {
+      if (d->_stopping) {
+        break;
+      }
+      pthread_cond_wait(&d->_submitted_cond, &d->_lock);
+      continue;
+    }
+    block.state = compressing;
+    if (++d->_next_job == d->_max_blocks) {
+      d->_next_job = 0;
+    }
+    pthread_mutex_unlock(&d->_lock);
+    block.failed = failed || (d->compress(&strm, block) < 0);
+    pthread_mutex_lock(&d->_lock);
+    block.state = compressed;
+    pthread_cond_broadcast(&d->_compressed_cond);
+  } while (true);
+  pthread_mutex_unlock(&d->_lock);
+  if (! failed) {
+    deflateEnd(&strm);
+  }
+  return NULL;
+}
+
+int ParallelDeflater::compress(z_stream* strm, Block& block) {
+  block.crc = crc32(crc32(0L, Z_NULL, 0), block.in,
+    static_cast<uInt>(block.in_size));
+  if (deflateReset(strm) != Z_OK) {
+    return -1;
+  }
+  if ((block.dict_size > 0) && (deflateSetDictionary(strm, block.dict,
+      static_cast<uInt>(block.dict_size)) != Z_OK)) {
+    return -1;
+  }
+  size_t bound = deflateBound(strm, static_cast<uLong>(block.in_size)) + 16;
+  if (block.out_capacity < bound) {
+    free(block.out);
+    block.out = static_cast<unsigned char*>(malloc(bound));
+    if (block.out == NULL) {
+      block.out_capacity = 0;
+      return -1;
+    }
+    block.out_capacity = bound;
+  }
+  strm->next_in   = block.in;
+  strm->avail_in  = static_cast<uInt>(block.in_size);
+  strm->next_out  = block.out;
+  strm->avail_out = static_cast<uInt>(block.out_capacity);
+  // Sync flush keeps the blocks byte-aligned, so they can be concatenated
+  int rc = deflate(strm, block.last ? Z_FINISH : Z_SYNC_FLUSH);
+  if ((rc != (block.last ? Z_STREAM_END : Z_OK)) || (strm->avail_in != 0)) {
+    return -1;
+  }
+  block.out_size = block.out_capacity - strm->avail_out;
+  return 0;
+}
+
+int ParallelDeflater::flush(Block& block) {
+  pthread_mutex_lock(&_lock);
+  while (block.state != compressed) {
+    pthread_cond_wait(&_compressed_cond, &_lock);
+  }
+  block.state = free_block;
+  pthread_mutex_unlock(&_lock);
+  if (block.failed) {
+    hlog_alert("failed to compress");
+    errno = EUCLEAN;
+    return -1;
+  }
+  if (_child->put(block.out, block.out_size) < 0) {
+    return -1;
+  }
+  _crc = crc32_combine(_crc, block.crc, static_cast<z_off_t>(block.in_size));
+  _length += static_cast<uLong>(block.in_size);
+  return 0;
+}
+
+int ParallelDeflater::submit(bool last) {
+  Block& block = _blocks[_current];
+  pthread_mutex_lock(&_lock);
+  block.last = last;
+  block.state = submitted;
+  pthread_cond_signal(&_submitted_cond);
+  pthread_mutex_unlock(&_lock);
+  if (last) {
+    return 0;
+  }
+  // Oldest block is next in line: write it out to make room
+  if (++_current == _max_blocks) {
+    _current = 0;
+  }
+  Block& next = _blocks[_current];
+  if ((next.state != free_block) && (flush(next) < 0)) {
+    return -1;
+  }
+  // The end of the data is the dictionary for the next block
+  next.dict_size = DICT_SIZE;
+  if (block.in_size < next.dict_size) {
+    next.dict_size = block.in_size;
+  }
+  memcpy(next.dict, &block.in[block.in_size - next.dict_size], next.dict_size);
+  next.in_size = 0;
+  pthread_mutex_lock(&_lock);
+  next.state = filling;
+  pthread_mutex_unlock(&_lock);
+  return 0;
+}
+
+void ParallelDeflater::stop() {
+  if (! _running) {
+    return;
+  }
+  pthread_mutex_lock(&_lock);
+  _stopping = true;
+  pthread_cond_broadcast(&_submitted_cond);
+  pthread_mutex_unlock(&_lock);
+  for (size_t i = 0; i < _threads; ++i) {
+    pthread_join(_tids[i], NULL);
+  }
+  _running = false;
+}
+
+int ParallelDeflater::open() {
+  // gzip header, as written by zlib: extra flags tell the fastest and the
+  // slowest levels apart, the fastest including no compression at all
+  unsigned char header[10] = { 0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 0, 3 };
+  // Re-opened without being closed
+  stop();
+  if (_level == 9) {
+    header[8] = 2;
+  } else
+  if (_level < 2) {
+    header[8] = 4;
+  }
+  if (_child->put(header, sizeof(header)) < 0) {
+    return -1;
+  }
+  for (size_t i = 0; i < _max_blocks; ++i) {
+    _blocks[i].state = free_block;
+  }
+  _current = 0;
+  _next_job = 0;
+  _blocks[_current].in_size = 0;
+  _blocks[_current].dict_size = 0;
+  _blocks[_current].state = filling;
+  _crc = crc32(0L, Z_NULL, 0);
+  _length = 0;
+  _stopping = false;
+  for (size_t i = 0; i < _threads; ++i) {
+    errno = pthread_create(&_tids[i], NULL, _worker_thread, this);
+    if (errno != 0) {
+      hlog_alert("%s creating thread", strerror(errno));
+      pthread_mutex_lock(&_lock);
+      _stopping = true;
+      pthread_cond_broadcast(&_submitted_cond);
+      pthread_mutex_unlock(&_lock);
+      while (i-- > 0) {
+        pthread_join(_tids[i], NULL);
+      }
+      return -1;
+    }
+  }
+  _running = true;
+  return 0;
+}
+
+int ParallelDeflater::close() {
+  int rc = submit(true);
+  // Write all remaining blocks, oldest first
+  for (size_t i = 1; i <= _max_blocks; ++i) {
+    Block& block = _blocks[(_current + i) % _max_blocks];
+    if ((block.state != free_block) && (flush(block) < 0)) {
+      rc = -1;
+    }
+  }
+  stop();
+  if (rc < 0) {
+    return -1;
+  }
+  // gzip trailer: CRC32 and input size modulo 2^32, little endian
+  unsigned char trailer[8];
+  for (int i = 0; i < 4; ++i) {
+    trailer[i]     = static_cast<unsigned char>(_crc >> (8 * i));
+    trailer[i + 4] = static_cast<unsigned char>(_length >> (8 * i));
+  }
+  return _child->put(trailer, sizeof(trailer)) < 0 ? -1 : 0;
+}
+
+ssize_t ParallelDeflater::put(const void* buffer, size_t size) {
+  const unsigned char* cbuffer = static_cast<const unsigned char*>(buffer);
+  size_t count = 0;
+  while (count < size) {
+    Block& block = _blocks[_current];
+    size_t length = BLOCK_SIZE - block.in_size;
+    if (length > size - count) {
+      length = size - count;
+    }
+    memcpy(&block.in[block.in_size], &cbuffer[count], length);
+    block.in_size += length;
+    count += length;
+    if ((block.in_size == BLOCK_SIZE) && (submit(false) < 0)) {
+      return -1;
+    }
+  }
+  return size;
+}
+
 struct Zipper::Private {
+  IReaderWriter* child;
   bool           zip;
   z_stream       strm;
+  bool           strm_ready;
   unsigned char  buffer[BUFFER_SIZE];
+  // Whether the child lends its buffers
+  bool           lending;
   bool           finished;
   int            level;
-  Private(int l) : zip(l >= 0), level(l) {}
+  ParallelDeflater* parallel;
+  bool           parallel_started;
+  Private(IReaderWriter* c, int l, size_t threads) :
+      child(c), zip(l >= 0), strm_ready(false), level(l), parallel(NULL) {
+    if (zip && (threads > 1)) {
+      parallel = new ParallelDeflater(c, l, threads);
+    }
+  }
+  ~Private() {
+    delete parallel;
+  }
   int open() {
+    lending = true;
+    finished = false;
+    strm_ready = false;
+    // The parallel deflater has its own streams, so only needed when reading
+    if (parallel != NULL) {
+      return 0;
+    }
+    return init();
+  }
+  int init() {
     strm.zalloc   = Z_NULL;
     strm.zfree    = Z_NULL;
     strm.opaque   = Z_NULL;
@@ -50,10 +369,14 @@ struct Zipper::Private {
       errno = EUNATCH;
       return -1;
     }
-    finished = false;
+    strm_ready = true;
     return 0;
   }
   int close() {
+    if (! strm_ready) {
+      return 0;
+    }
+    strm_ready = false;
     int rc;
     if (zip) {
       rc = deflateEnd(&strm);
@@ -83,6 +406,54 @@ struct Zipper::Private {
       finished = true;
     }
   }
+  // Get data to uncompress, from the child's buffer if it lends it
+  int fill(bool whole) {
+    if (lending) {
+      // The data remains valid until the next call to peek()
+      const void* data;
+      ssize_t length = child->peek(&data, sizeof(buffer));
+      if ((length >= 0) && (child->advance(length) >= 0)) {
+        submit(data, length);
+        return 0;
+      }
+      if (errno != ENOTSUP) {
+        return -1;
+      }
+      lending = false;
+    }
+    ssize_t length;
+    if (whole) {
+      length = child->get(buffer, sizeof(buffer));
+    } else {
+      length = child->read(buffer, sizeof(buffer));
+    }
+    if (length < 0) {
+      return -1;
+    }
+    submit(buffer, length);
+    return 0;
+  }
+  // Where to compress to, in the child's buffer if it lends one
+  ssize_t reserve(void** out) {
+    if (lending) {
+      ssize_t rc = child->reserve(out, sizeof(buffer));
+      if (rc >= 0) {
+        return rc;
+      }
+      if (errno != ENOTSUP) {
+        return -1;
+      }
+      lending = false;
+    }
+    *out = buffer;
+    return sizeof(buffer);
+  }
+  ssize_t write(size_t size) {
+    if (lending) {
+      return child->commit(size);
+    }
+    return child->put(buffer, size);
+  }
   bool canUpdate() const {
     return strm.avail_out == 0;
   }
@@ -110,8 +481,9 @@ struct Zipper::Private {
   }
 };
 
-Zipper::Zipper(IReaderWriter* child, bool delete_child, int level) :
-  IReaderWriter(child, delete_child), _d(new Private(level)) {}
+Zipper::Zipper(IReaderWriter* child, bool delete_child, int level,
+    size_t threads) :
+  IReaderWriter(child, delete_child), _d(new Private(child, level, threads)) {}
 
 Zipper::~Zipper() {
   delete _d;
@@ -125,10 +497,20 @@ int Zipper::open() {
     _child->close();
     return -1;
   }
+  _d->parallel_started = false;
   return 0;
 }
 
 int Zipper::close() {
+  if (_d->zip && ! _d->finished && (_d->parallel != NULL)) {
+    _d->finished = true;
+    // Start threads if nothing was written, to get a valid empty stream
+    if ((put(NULL, 0) < 0) || (_d->parallel->close() < 0)) {
+      _d->close();
+      _child->close();
+      return -1;
+    }
+  } else
   if (_d->zip && ! _d->finished) {
     if (put(NULL, 0) < 0) {
       return -1;
@@ -142,26 +524,24 @@ int Zipper::close() {
 }
 
 ssize_t Zipper::read(void* buffer, size_t size) {
-  if (_d->canSubmit()) {
-    ssize_t length = _child->read(_d->buffer, sizeof(_d->buffer));
-    if (length < 0) {
-      return -1;
-    }
-    _d->submit(_d->buffer, length);
+  if (! _d->strm_ready && (_d->init() < 0)) {
+    return -1;
+  }
+  if (_d->canSubmit() && (_d->fill(false) < 0)) {
+    return -1;
   }
   return _d->update(buffer, size);
 }
 
 ssize_t Zipper::get(void* buffer, size_t size) {
+  if (! _d->strm_ready && (_d->init() < 0)) {
+    return -1;
+  }
   char* cbuffer = static_cast<char*>(buffer);
   size_t count = 0;
   while (count < size) {
-    if (_d->canSubmit()) {
-      ssize_t length = _child->get(_d->buffer, sizeof(_d->buffer));
-      if (length < 0) {
-        return -1;
-      }
-      _d->submit(_d->buffer, length);
+    if (_d->canSubmit() && (_d->fill(true) < 0)) {
+      return -1;
     }
     ssize_t length = _d->update(&cbuffer[count], size - count);
     if (length < 0) {
@@ -176,10 +556,25 @@ ssize_t Zipper::get(void* buffer, size_t size) {
 }
 
 ssize_t Zipper::put(const void* buffer, size_t size) {
+  if (_d->parallel != NULL) {
+    // Threads are only needed when writing, so start them on first write
+    if (! _d->parallel_started) {
+      if (_d->parallel->open() < 0) {
+        return -1;
+      }
+      _d->parallel_started = true;
+    }
+    return _d->parallel->put(buffer, size);
+  }
   _d->submit(buffer, size);
   do {
-    ssize_t length = _d->update(_d->buffer, sizeof(_d->buffer));
-    if (_child->put(_d->buffer, length) < 0) {
+    void* out;
+    ssize_t room = _d->reserve(&out);
+    if (room < 0) {
+      return -1;
+    }
+    ssize_t length = _d->update(out, room);
+    if ((length < 0) || (_d->write(length) < 0)) {
       return -1;
     }
   } while (_d->canUpdate());
@@ -136,5 +136,44 @@ int main() {
   memset(hash3, 0, sizeof(hash3));
 
   delete fm;
+
+  /* Ring of slots, copying buffers */
+  IReaderWriter* fp = new Pit;
+  fp = new Hasher(fp, true, Hasher::md5, hash1);
+  AsyncWriter* fa = new AsyncWriter(fp, true, 3, AsyncWriter::copy);
+  fp = new Top(fa);
+
+  if (fp->open() < 0) return 0;
+  char buffer[sizeof(buffer4)];
+  memcpy(buffer, buffer1, sizeof(buffer1));
+  if (fp->put(buffer, sizeof(buffer1)) < 0) return 0;
+  memcpy(buffer, buffer2, sizeof(buffer2));
+  if (fp->put(buffer, sizeof(buffer2)) < 0) return 0;
+  memcpy(buffer, buffer3, sizeof(buffer3));
+  if (fp->put(buffer, sizeof(buffer3)) < 0) return 0;
+  memcpy(buffer, buffer4, sizeof(buffer4));
+  if (fp->put(buffer, sizeof(buffer4)) < 0) return 0;
+  if (fp->close() < 0) return 0;
+  hlog_regression("offset = '%jd'", fp->offset());
+  hlog_regression("hash1 = '%s'", hash1);
+  AsyncWriter::Stats stats;
+  fa->getStats(&stats);
+  hlog_regression("slots = %zu, used = %zu, max used = %zu, puts = %ju, "
+    "producer waits = %ju", stats.slots, stats.used, stats.max_used,
+    stats.puts, stats.producer_waits);
+
+  /* Donated buffers */
+  fp = new Top(new AsyncWriter(fp, true, 2, AsyncWriter::donate));
+  if (fp->open() < 0) return 0;
+  for (int i = 0; i < 3; ++i) {
+    void* donated = malloc(sizeof(buffer1));
+    memcpy(donated, buffer1, sizeof(buffer1));
+    if (fp->put(donated, sizeof(buffer1)) < 0) return 0;
+  }
+  if (fp->close() < 0) return 0;
+  hlog_regression("offset = '%jd'", fp->offset());
+  hlog_regression("hash1 = '%s'", hash1);
+
+  delete fp;
   return 0;
 }
@@ -0,0 +1,176 @@
+/*
+    Copyright (C) 2011  Hervé Fache
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 3.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <vector>
+#include <string>
+
+#include <report.h>
+#include "nullwriter.h"
+#include "chunker.h"
+
+using namespace htoolbox;
+
+struct Chunk {
+  int64_t     offset;
+  size_t      size;
+  std::string hash;
+};
+
+static int add_chunk(int64_t offset, size_t size, const char* hash,
+    void* user) {
+  std::vector<Chunk>* chunks = static_cast<std::vector<Chunk>*>(user);
+  Chunk chunk;
+  chunk.offset = offset;
+  chunk.size = size;
+  chunk.hash = hash;
+  chunks->push_back(chunk);
+  return 0;
+}
+
+static int fail_chunk(int64_t, size_t, const char*, void*) {
+  errno = ECANCELED;
+  return -1;
+}
+
+// Chunk data, given in pieces of the given size
+static void chunk(const char* data, size_t size, size_t piece,
+    std::vector<Chunk>& chunks) {
+  NullWriter nw;
+  Chunker chunker(&nw, false, Hasher::md5, add_chunk, &chunks);
+  if (chunker.open() < 0) {
+    hlog_error("%s opening", strerror(errno));
+    return;
+  }
+  for (size_t done = 0; done < size; done += piece) {
+    size_t length = size - done < piece ? size - done : piece;
+    if (chunker.put(&data[done], length) < 0) {
+      hlog_error("%s writing", strerror(errno));
+    }
+  }
+  if (chunker.close() < 0) {
+    hlog_error("%s closing", strerror(errno));
+  }
+}
+
+// Check that chunks follow each other, have right sizes and hashes
+static size_t check(const char* data, size_t size,
+    const std::vector<Chunk>& chunks) {
+  size_t errors = 0;
+  int64_t offset = 0;
+  for (size_t i = 0; i < chunks.size(); ++i) {
+    const Chunk& c = chunks[i];
+    if (c.offset != offset) {
+      ++errors;
+    }
+    if ((c.size > 65536) ||
+        ((c.size < 2048) && (i + 1 != chunks.size()))) {
+      ++errors;
+    }
+    NullWriter nw;
+    char hash[129];
+    Hasher hasher(&nw, false, Hasher::md5, hash);
+    hasher.open();
+    hasher.put(&data[c.offset], c.size);
+    hasher.close();
+    if (c.hash != hash) {
+      ++errors;
+    }
+    offset += c.size;
+  }
+  if (offset != static_cast<int64_t>(size)) {
+    ++errors;
+  }
+  return errors;
+}
+
+int main() {
+  report.setLevel(regression);
+
+  const size_t size = 1 << 20;
+  char* data = static_cast<char*>(malloc(size + 100));
+  unsigned int seed = 12345;
+  for (size_t i = 0; i < size; ++i) {
+    seed = seed * 1103515245 + 12345;
+    data[i] = static_cast<char>(seed >> 16);
+  }
+
+  std::vector<Chunk> chunks;
+  chunk(data, size, size, chunks);
+  hlog_regression("%zu chunks, %zu error(s)", chunks.size(),
+    check(data, size, chunks));
+  for (size_t i = 0; i < 5; ++i) {
+    hlog_regression("  %lld %zu %s", static_cast<long long>(chunks[i].offset),
+      chunks[i].size, chunks[i].hash.c_str());
+  }
+
+  // Same boundaries, whatever the size of the pieces
+  const size_t pieces[] = { 1, 63, 4096, 100000 };
+  for (size_t i = 0; i < sizeof(pieces) / sizeof(pieces[0]); ++i) {
+    std::vector<Chunk> others;
+    chunk(data, size, pieces[i], others);
+    size_t differences = others.size() != chunks.size() ? 1 : 0;
+    for (size_t j = 0; (differences == 0) && (j < others.size()); ++j) {
+      if (others[j].hash != chunks[j].hash) {
+        ++differences;
+      }
+    }
+    hlog_regression("pieces of %zu: %zu chunks, %s", pieces[i],
+      others.size(), differences == 0 ? "same" : "different");
+  }
+
+  // Insert data in the middle: only the chunks around change
+  {
+    memmove(&data[500100], &data[500000], size - 500000);
+    memset(&data[500000], 'x', 100);
+    std::vector<Chunk> others;
+    chunk(data, size + 100, size + 100, others);
+    size_t common = 0;
+    for (size_t i = 0; i < others.size(); ++i) {
+      for (size_t j = 0; j < chunks.size(); ++j) {
+        if (others[i].hash == chunks[j].hash) {
+          ++common;
+          break;
+        }
+      }
+    }
+    hlog_regression("after insertion: %zu chunks, %zu error(s), %zu in common",
+      others.size(), check(data, size + 100, others), common);
+  }
+
+  // Callback failure
+  {
+    NullWriter nw;
+    Chunker chunker(&nw, false, Hasher::md5, fail_chunk, NULL);
+    chunker.open();
+    ssize_t rc = chunker.put(data, size);
+    hlog_regression("failing callback: %zd, %s", rc, strerror(errno));
+    hlog_regression("close: %d", chunker.close());
+  }
+
+  // Nothing
+  {
+    std::vector<Chunk> others;
+    chunk(data, 0, 1, others);
+    hlog_regression("empty: %zu chunks", others.size());
+  }
+
+  free(data);
+  return 0;
+}
@@ -0,0 +1,153 @@
+/*
+     Copyright (C) 2011  Hervé Fache
+
+     This program is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License version 2 as
+     published by the Free Software Foundation.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program; if not, write to the Free Software
+     Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include <report.h>
+#include "compact_hash_tree.h"
+
+using namespace htoolbox;
+
+struct TestClass {
+  char h[9];
+  operator const char*() const { return h; }
+};
+
+static void list(const CompactHashTree<TestClass>& tree) {
+  hlog_info("structure:");
+  tree.show();
+  hlog_info("list:");
+  const TestClass* meta = NULL;
+  while ((meta = tree.next(meta)) != NULL) {
+    hlog_info("  meta: %s", meta->h);
+  }
+  hlog_info("-");
+}
+
+static int compare(const void* a, const void* b) {
+  return strcmp(static_cast<const TestClass*>(a)->h,
+    static_cast<const TestClass*>(b)->h);
+}
+
+int main(void) {
+  report.setLevel(debug);
+
+  {
+    CompactHashTree<TestClass> tree;
+    const char* hashes[] = { "abcd", "abce", "0123", "0023", "0000", "FFFF",
+      "ABC0", "0001", "1234", NULL };
+    for (int i = 0; hashes[i] != NULL; ++i) {
+      TestClass* meta = new TestClass;
+      strcpy(meta->h, hashes[i]);
+      hlog_info("adding %s", meta->h);
+      if (tree.add(meta) != NULL) {
+        hlog_error("found self");
+      }
+      if (tree.find(meta) != meta) {
+        hlog_error("not found self");
+      }
+    }
+    list(tree);
+
+    const char* queries[] = { "abcd", "abc0", "ffff", "0002", "FFFE", "5555",
+      NULL };
+    for (int i = 0; queries[i] != NULL; ++i) {
+      TestClass* meta = tree.find(queries[i]);
+      hlog_info("finding %s: %s", queries[i], meta == NULL ? "not found" :
+        meta->h);
+    }
+    hlog_info("after 0003: %s", tree.next("0003")->h);
+    hlog_info("after abcd: %s", tree.next("abcd")->h);
+    hlog_info("after ffff: %s", tree.next("ffff") == NULL ? "none" : "some");
+
+    // Removing 0000 leaves 0001 alone in its node, which gets replaced
+    const char* removals[] = { "1234", "0000", "0023", "abce", "5555", NULL };
+    for (int i = 0; removals[i] != NULL; ++i) {
+      TestClass* meta = tree.remove(removals[i]);
+      hlog_info("removing %s: %s", removals[i], meta == NULL ? "not found" :
+        meta->h);
+      delete meta;
+      list(tree);
+    }
+  }
+
+  // Compare with sorted array
+  {
+    const size_t count = 100000;
+    TestClass* metas = new TestClass[count];
+    unsigned int seed = 12345;
+    for (size_t i = 0; i < count; ++i) {
+      seed = seed * 1103515245 + 12345;
+      sprintf(metas[i].h, "%08x", seed);
+    }
+    CompactHashTree<TestClass> tree;
+    for (size_t i = 0; i < count; ++i) {
+      TestClass* meta = new TestClass(metas[i]);
+      if (tree.add(meta) != NULL) {
+        delete meta;
+      }
+    }
+    qsort(metas, count, sizeof(TestClass), compare);
+    size_t unique = 0;
+    for (size_t i = 0; i < count; ++i) {
+      if ((unique == 0) || (strcmp(metas[i].h, metas[unique - 1].h) != 0)) {
+        metas[unique++] = metas[i];
+      }
+    }
+    hlog_info("%zu objects, %zu unique, %zu in tree", count, unique,
+      tree.size());
+    hlog_info("%zu bytes of nodes", tree.memory());
+    size_t errors = 0;
+    const TestClass* meta = NULL;
+    for (size_t i = 0; i < unique; ++i) {
+      meta = tree.next(meta);
+      if ((meta == NULL) || (strcmp(meta->h, metas[i].h) != 0)) {
+        ++errors;
+        break;
+      }
+    }
+    if (tree.next(meta) != NULL) {
+      ++errors;
+    }
+    hlog_info("list: %zu error(s)", errors);
+    for (size_t i = 0; i < unique; i += 2) {
+      delete tree.remove(metas[i].h);
+    }
+    errors = 0;
+    for (size_t i = 0; i < unique; ++i) {
+      bool found = tree.find(metas[i].h) != NULL;
+      if (found != ((i & 1) != 0)) {
+        ++errors;
+      }
+    }
+    meta = NULL;
+    for (size_t i = 1; i < unique; i += 2) {
+      meta = tree.next(meta);
+      if ((meta == NULL) || (strcmp(meta->h, metas[i].h) != 0)) {
+        ++errors;
+        break;
+      }
+    }
+    hlog_info("after removing half: %zu in tree, %zu error(s)", tree.size(),
+      errors);
+    delete[] metas;
+  }
+
+  return 0;
+}
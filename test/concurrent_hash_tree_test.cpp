@@ -0,0 +1,180 @@
+/*
+     Copyright (C) 2011  Hervé Fache
+
+     This program is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License version 2 as
+     published by the Free Software Foundation.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program; if not, write to the Free Software
+     Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <report.h>
+#include "concurrent_hash_tree.h"
+
+using namespace htoolbox;
+
+struct TestClass {
+  char h[9];
+  operator const char*() const { return h; }
+};
+
+static void list(const ConcurrentHashTree<TestClass>& tree) {
+  hlog_info("structure:");
+  tree.show();
+  hlog_info("list:");
+  const TestClass* meta = NULL;
+  while ((meta = tree.next(meta)) != NULL) {
+    hlog_info("  meta: %s", meta->h);
+  }
+  hlog_info("-");
+}
+
+enum {
+  STABLE = 20000,
+  CHANGING = 20000,
+  READERS = 4
+};
+
+struct Shared {
+  ConcurrentHashTree<TestClass> tree;
+  TestClass*                    stable[STABLE];
+  bool                          done;
+  size_t                        misses[READERS];
+  size_t                        lookups[READERS];
+};
+
+static Shared shared;
+
+static void* reader(void* data) {
+  size_t no = reinterpret_cast<size_t>(data);
+  size_t i = no;
+  while (! __atomic_load_n(&shared.done, __ATOMIC_ACQUIRE)) {
+    if (shared.tree.find(shared.stable[i % STABLE]) == NULL) {
+      ++shared.misses[no];
+    }
+    ++shared.lookups[no];
+    i += 7;
+  }
+  return NULL;
+}
+
+int main(void) {
+  report.setLevel(debug);
+
+  {
+    ConcurrentHashTree<TestClass> tree;
+    const char* hashes[] = { "abcd", "abce", "0123", "0023", "0000", "FFFF",
+      "ABC0", "0001", "1234", NULL };
+    for (int i = 0; hashes[i] != NULL; ++i) {
+      TestClass* meta = new TestClass;
+      strcpy(meta->h, hashes[i]);
+      hlog_info("adding %s", meta->h);
+      if (tree.add(meta) != NULL) {
+        hlog_error("found self");
+      }
+      if (tree.find(meta) != meta) {
+        hlog_error("not found self");
+      }
+    }
+    list(tree);
+
+    const char* queries[] = { "abcd", "abc0", "ffff", "0002", "FFFE", "5555",
+      NULL };
+    for (int i = 0; queries[i] != NULL; ++i) {
+      TestClass* meta = tree.find(queries[i]);
+      hlog_info("finding %s: %s", queries[i], meta == NULL ? "not found" :
+        meta->h);
+    }
+    hlog_info("after 0003: %s", tree.next("0003")->h);
+    hlog_info("after 1234: %s", tree.next("1234")->h);
+    hlog_info("after ffff: %s", tree.next("ffff") == NULL ? "none" : "some");
+
+    const char* removals[] = { "1234", "0000", "0023", "abce", "5555", NULL };
+    for (int i = 0; removals[i] != NULL; ++i) {
+      TestClass* meta = tree.remove(removals[i]);
+      hlog_info("removing %s: %s", removals[i], meta == NULL ? "not found" :
+        meta->h);
+      tree.synchronize();
+      delete meta;
+      list(tree);
+    }
+  }
+
+  // Readers look for objects that stay, while objects come and go
+  {
+    unsigned int seed = 12345;
+    for (size_t i = 0; i < STABLE; ++i) {
+      seed = seed * 1103515245 + 12345;
+      shared.stable[i] = new TestClass;
+      sprintf(shared.stable[i]->h, "%08x", seed);
+      if (shared.tree.add(shared.stable[i]) != NULL) {
+        hlog_error("duplicate");
+      }
+    }
+    pthread_t tids[READERS];
+    for (size_t i = 0; i < READERS; ++i) {
+      pthread_create(&tids[i], NULL, reader, reinterpret_cast<void*>(i));
+    }
+    TestClass** changing = new TestClass*[CHANGING];
+    size_t added = 0;
+    size_t removed = 0;
+    for (int round = 0; round < 5; ++round) {
+      unsigned int round_seed = 54321;
+      for (size_t i = 0; i < CHANGING; ++i) {
+        round_seed = round_seed * 1103515245 + 12345;
+        changing[i] = new TestClass;
+        sprintf(changing[i]->h, "%08x", round_seed ^ 0x5a5a5a5a);
+        if (shared.tree.add(changing[i]) != NULL) {
+          delete changing[i];
+          changing[i] = NULL;
+        } else {
+          ++added;
+        }
+      }
+      for (size_t i = 0; i < CHANGING; ++i) {
+        if (changing[i] != NULL) {
+          if (shared.tree.remove(changing[i]) == changing[i]) {
+            ++removed;
+          }
+        }
+      }
+      // Readers may still be looking at them
+      shared.tree.synchronize();
+      for (size_t i = 0; i < CHANGING; ++i) {
+        delete changing[i];
+      }
+    }
+    delete[] changing;
+    __atomic_store_n(&shared.done, true, __ATOMIC_RELEASE);
+    size_t misses = 0;
+    size_t lookups = 0;
+    for (size_t i = 0; i < READERS; ++i) {
+      pthread_join(tids[i], NULL);
+      misses += shared.misses[i];
+      lookups += shared.lookups[i];
+    }
+    hlog_info("added %zu, removed %zu, readers missed %zu", added, removed,
+      misses);
+    hlog_info("readers looked up: %s", lookups > 0 ? "yes" : "no");
+    size_t count = 0;
+    const TestClass* meta = NULL;
+    while ((meta = shared.tree.next(meta)) != NULL) {
+      ++count;
+    }
+    hlog_info("%zu objects left", count);
+  }
+
+  return 0;
+}
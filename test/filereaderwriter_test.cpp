@@ -22,6 +22,9 @@
 
 #include <report.h>
 #include "filereaderwriter.h"
+#include "hasher.h"
+#include "multiwriter.h"
+#include "nullwriter.h"
 
 using namespace htoolbox;
 
@@ -163,5 +166,294 @@ int main() {
     }
   }
 
+  hlog_regression("Test: reserve and commit");
+  {
+    FileReaderWriter fw("testfile", true);
+    NullWriter nw;
+    char hash1[129];
+    char hash2[129];
+    Hasher hh1(&fw, false, Hasher::md5, hash1);
+    Hasher hh2(&nw, false, Hasher::md5, hash2);
+    MultiWriter mw(&hh1, false);
+    mw.add(&hh2, false);
+    if (mw.open() < 0) {
+      hlog_regression("%s opening file", strerror(errno));
+    } else {
+      for (int i = 0; i < 10; ++i) {
+        void* region;
+        ssize_t rc = mw.reserve(&region, 1000);
+        if (rc < 0) {
+          hlog_regression("%s reserving", strerror(errno));
+          break;
+        }
+        memset(region, 'a' + i, rc);
+        // Only use part of the region every other time
+        rc = mw.commit((i & 1) != 0 ? rc / 2 : rc);
+        hlog_regression("committed %zd bytes (total %jd)", rc, fw.offset());
+      }
+      void* region;
+      mw.reserve(&region, 10);
+      ssize_t rc = mw.commit(11);
+      hlog_regression("commit too much: %zd, %s", rc, strerror(errno));
+      if (mw.close() < 0) {
+        hlog_regression("%s closing file", strerror(errno));
+      }
+      hlog_regression("hashes: %s, %s", hash1, hash2);
+    }
+    (void) system("md5sum testfile");
+    const void* data;
+    ssize_t rc = nw.peek(&data, 10);
+    hlog_regression("peek from writer: %zd, %s", rc, strerror(errno));
+  }
+
+  hlog_regression("Test: peek and advance");
+  {
+    FileReaderWriter fr("testfile", false);
+    char hash[129];
+    Hasher hh(&fr, false, Hasher::md5, hash);
+    if (hh.open() < 0) {
+      hlog_regression("%s opening file", strerror(errno));
+    } else {
+      const void* data;
+      ssize_t rc = hh.peek(&data, 3000);
+      hlog_regression("peeked %zd bytes, '%c...%c' (total %jd)", rc,
+        static_cast<const char*>(data)[0],
+        static_cast<const char*>(data)[rc - 1], fr.offset());
+      rc = hh.advance(rc + 1);
+      hlog_regression("advance too much: %zd, %s", rc, strerror(errno));
+      rc = hh.advance(1500);
+      hlog_regression("advanced %zd bytes (total %jd)", rc, fr.offset());
+      // Reading gets the data peeked but not consumed first
+      char buffer[1000];
+      rc = hh.read(buffer, sizeof(buffer));
+      hlog_regression("read %zd bytes, '%c...%c' (total %jd)", rc, buffer[0],
+        buffer[rc - 1], fr.offset());
+      while ((rc = hh.peek(&data, 1024)) > 0) {
+        hlog_regression("peeked %zd bytes, '%c...%c'", rc,
+          static_cast<const char*>(data)[0],
+          static_cast<const char*>(data)[rc - 1]);
+        hh.advance(rc);
+      }
+      hlog_regression("end: %zd (total %jd)", rc, fr.offset());
+      if (hh.close() < 0) {
+        hlog_regression("%s closing file", strerror(errno));
+      }
+      hlog_regression("hash: %s", hash);
+    }
+  }
+
+  hlog_regression("Test: putv and getv");
+  {
+    // More buffers than writev() takes at once
+    const int count = 2000;
+    struct iovec iov[count];
+    char data[count];
+    for (int i = 0; i < count; ++i) {
+      data[i] = static_cast<char>('a' + i % 26);
+      iov[i].iov_base = &data[i];
+      iov[i].iov_len = (i % 3) == 0 ? 0 : 1;
+    }
+    FileReaderWriter fw("testfile", true);
+    char hash1[129];
+    Hasher hh1(&fw, false, Hasher::md5, hash1);
+    if (hh1.open() < 0) {
+      hlog_regression("%s opening file", strerror(errno));
+    } else {
+      ssize_t rc = hh1.putv(iov, count);
+      hlog_regression("written %zd bytes (total %jd)", rc, fw.offset());
+      if (hh1.close() < 0) {
+        hlog_regression("%s closing file", strerror(errno));
+      }
+    }
+    (void) system("md5sum testfile");
+
+    char out[count];
+    memset(out, 0, sizeof(out));
+    for (int i = 0; i < count; ++i) {
+      iov[i].iov_base = &out[i];
+    }
+    FileReaderWriter fr("testfile", false);
+    char hash2[129];
+    Hasher hh2(&fr, false, Hasher::md5, hash2);
+    if (hh2.open() < 0) {
+      hlog_regression("%s opening file", strerror(errno));
+    } else {
+      // Start with what is peeked
+      const void* peeked;
+      hh2.peek(&peeked, 10);
+      ssize_t rc = hh2.getv(iov, 10);
+      hlog_regression("read %zd bytes (total %jd)", rc, fr.offset());
+      rc = hh2.getv(&iov[10], count - 10);
+      hlog_regression("read %zd bytes (total %jd)", rc, fr.offset());
+      // Past the end
+      rc = hh2.getv(iov, count);
+      hlog_regression("read %zd bytes (total %jd)", rc, fr.offset());
+      if (hh2.close() < 0) {
+        hlog_regression("%s closing file", strerror(errno));
+      }
+    }
+    size_t errors = 0;
+    for (int i = 0; i < count; ++i) {
+      if ((iov[i].iov_len != 0) && (out[i] != data[i])) {
+        ++errors;
+      }
+    }
+    hlog_regression("data: %zu error(s), hashes %s", errors,
+      strcmp(hash1, hash2) == 0 ? "match" : "differ");
+  }
+
+  hlog_regression("Test: mapped");
+  {
+    const size_t size = 1000000;
+    char* buffer = static_cast<char*>(malloc(size));
+    for (size_t i = 0; i < size; ++i) {
+      buffer[i] = static_cast<char>(i * 7 + (i >> 12));
+    }
+    FileReaderWriter fw("testfile", true);
+    fw.setMapped(65536);
+    fw.open();
+    fw.put(buffer, size);
+    fw.close();
+    (void) system("md5sum testfile");
+
+    // Hash in place, window by window
+    {
+      FileReaderWriter fr("testfile", false);
+      fr.setMapped(65536);
+      char hash[129];
+      Hasher hh(&fr, false, Hasher::md5, hash);
+      if (hh.open() < 0) {
+        hlog_regression("%s opening file", strerror(errno));
+      } else {
+        const void* data;
+        ssize_t rc;
+        size_t peeks = 0;
+        size_t errors = 0;
+        while ((rc = hh.peek(&data, 100000)) > 0) {
+          if (memcmp(data, &buffer[fr.offset()], rc) != 0) {
+            ++errors;
+          }
+          hh.advance(rc);
+          ++peeks;
+        }
+        hlog_regression("peeks: %zu, %zu error(s), end: %zd (total %jd)",
+          peeks, errors, rc, fr.offset());
+        if (hh.close() < 0) {
+          hlog_regression("%s closing file", strerror(errno));
+        }
+        hlog_regression("hash: %s", hash);
+      }
+    }
+
+    // Copy across windows, and seek
+    {
+      FileReaderWriter fr("testfile", false);
+      fr.setMapped(4096);
+      fr.seek(size - 100000);
+      if (fr.open() < 0) {
+        hlog_regression("%s opening file", strerror(errno));
+      } else {
+        char* out = static_cast<char*>(malloc(size));
+        ssize_t rc = fr.get(out, 30000);
+        hlog_regression("read %zd bytes (total %jd), %s", rc, fr.offset(),
+          memcmp(out, &buffer[size - 100000], rc) == 0 ? "same" : "different");
+        fr.seek(0);
+        rc = fr.get(out, size + 1);
+        hlog_regression("read %zd bytes (total %jd), %s", rc, fr.offset(),
+          memcmp(out, buffer, rc) == 0 ? "same" : "different");
+        rc = fr.read(out, 10);
+        hlog_regression("read %zd bytes at end", rc);
+        fr.close();
+        free(out);
+      }
+    }
+
+    // Files which cannot be mapped are read
+    for (int mapped = 0; mapped < 2; ++mapped) {
+      FileReaderWriter fr("/proc/self/status", false);
+      if (mapped) {
+        fr.setMapped(65536);
+      }
+      if (fr.open() < 0) {
+        hlog_regression("%s opening file", strerror(errno));
+      } else {
+        ssize_t rc = fr.get(buffer, size);
+        hlog_regression("%s proc file: %s", mapped ? "mapped" : "read",
+          rc > 0 ? "data" : "no data");
+        fr.close();
+      }
+    }
+    free(buffer);
+  }
+
+  hlog_regression("Test: direct");
+  {
+    const size_t size = 1000000;
+    char* buffer = static_cast<char*>(malloc(size));
+    for (size_t i = 0; i < size; ++i) {
+      buffer[i] = static_cast<char>(i * 11 + (i >> 10));
+    }
+    {
+      FileReaderWriter fw("testfile", true);
+      fw.setDirect(65536);
+      if (fw.open() < 0) {
+        hlog_regression("%s opening file", strerror(errno));
+      } else {
+        // Odd sizes, written and lent, across the staging buffer
+        size_t count = 0;
+        for (int i = 0; count < size; ++i) {
+          size_t length = 1000 + 997 * i;
+          if (length > size - count) {
+            length = size - count;
+          }
+          if ((i & 1) == 0) {
+            fw.put(&buffer[count], length);
+            count += length;
+          } else {
+            void* region;
+            ssize_t rc = fw.reserve(&region, length);
+            memcpy(region, &buffer[count], rc);
+            fw.commit(rc);
+            count += rc;
+          }
+        }
+        hlog_regression("written %zu bytes (total %jd)", count, fw.offset());
+        if (fw.close() < 0) {
+          hlog_regression("%s closing file", strerror(errno));
+        }
+      }
+    }
+    FileReaderWriter fr("testfile", false);
+    char* out = static_cast<char*>(malloc(size + 1));
+    fr.open();
+    ssize_t rc = fr.get(out, size + 1);
+    fr.close();
+    hlog_regression("read %zd bytes, %s", rc,
+      memcmp(out, buffer, size) == 0 ? "same" : "different");
+
+    // Resume at an unaligned offset
+    {
+      FileReaderWriter fw("testfile", true);
+      fw.setDirect(65536);
+      fw.seek(size / 2 + 1);
+      if (fw.open() < 0) {
+        hlog_regression("%s opening file", strerror(errno));
+      } else {
+        fw.put(&buffer[size / 2 + 1], size / 2 - 1);
+        hlog_regression("written up to %jd", fw.offset());
+        if (fw.close() < 0) {
+          hlog_regression("%s closing file", strerror(errno));
+        }
+      }
+    }
+    fr.open();
+    rc = fr.get(out, size + 1);
+    fr.close();
+    hlog_regression("read %zd bytes, %s", rc,
+      memcmp(out, buffer, size) == 0 ? "same" : "different");
+    free(out);
+    free(buffer);
+  }
+
   return 0;
 }
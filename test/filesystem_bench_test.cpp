@@ -0,0 +1,98 @@
+/*
+     Copyright (C) 2011 Herve Fache
+
+     This program is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License version 2 as
+     published by the Free Software Foundation.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program; if not, write to the Free Software
+     Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+// Times the import of a list of paths into an FsNode tree, then looking them
+// all up, with and without the directories' hashed index.  Not part of the
+// checks, as it takes a while: run it by hand.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <report.h>
+#include "filesystem.h"
+
+using namespace htoolbox;
+
+static double now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return static_cast<double>(tv.tv_sec) +
+    static_cast<double>(tv.tv_usec) / 1000000.0;
+}
+
+// 10 top directories, each of 10 sub-directories with 1000 files, and one
+// large directory of 100000 files
+static void import(bool use_index, bool use_arena) {
+  FsNodeDir::index_threshold = use_index ? 32 : 0;
+  FsNodeDir* root = FsNode::createRoot("", use_arena);
+  char path[64];
+  double start = now();
+  size_t count = 0;
+  for (int i = 0; i < 10; ++i) {
+    for (int j = 0; j < 10; ++j) {
+      sprintf(path, "/top%d/sub%d", i, j);
+      FsNode* dir = root->getNode(path, true);
+      for (int k = 0; k < 1000; ++k) {
+        sprintf(path, "file%d", k);
+        dir->createChild(path, 'f');
+        ++count;
+      }
+    }
+  }
+  FsNode* big = root->getNode("/big", true);
+  for (int k = 0; k < 100000; ++k) {
+    sprintf(path, "file%d", k);
+    big->createChild(path, 'f');
+    ++count;
+  }
+  double imported = now();
+  size_t found = 0;
+  for (int i = 0; i < 10; ++i) {
+    for (int j = 0; j < 10; ++j) {
+      for (int k = 0; k < 1000; ++k) {
+        sprintf(path, "/top%d/sub%d/file%d", i, j, k);
+        if (root->getNode(path) != NULL) {
+          ++found;
+        }
+      }
+    }
+  }
+  for (int k = 0; k < 100000; ++k) {
+    sprintf(path, "/big/file%d", k);
+    if (root->getNode(path) != NULL) {
+      ++found;
+    }
+  }
+  double looked_up = now();
+  delete root;
+  double deleted = now();
+  hlog_info("index %-3s arena %-3s: %zu/%zu found, import %.3fs, "
+    "look-up %.3fs, delete %.3fs", use_index ? "on" : "off",
+    use_arena ? "on" : "off", found, count, imported - start,
+    looked_up - imported, deleted - looked_up);
+}
+
+int main(void) {
+  report.setLevel(info);
+  import(true, false);
+  import(true, true);
+  import(false, false);
+  return 0;
+}
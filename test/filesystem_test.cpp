@@ -17,6 +17,9 @@
 */
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <limits.h>
 
 #include <report.h>
@@ -40,6 +43,25 @@ void get_subdirs(FsNodeDir* parent, char* path) {
   }
 }
 
+// Count nodes which modes differ, or which do not match the other's tree
+static size_t compare_modes(const FsNode* a, const FsNode* b) {
+  if ((a == NULL) || (b == NULL)) {
+    return a == b ? 0 : 1;
+  }
+  size_t diffs = (a->statMode() != b->statMode()) ||
+    (strcmp(a->name, b->name) != 0) ? 1 : 0;
+  if (S_ISDIR(a->mode) && S_ISDIR(b->mode)) {
+    const FsNode* ca = static_cast<const FsNodeDir*>(a)->children_head;
+    const FsNode* cb = static_cast<const FsNodeDir*>(b)->children_head;
+    while ((ca != NULL) || (cb != NULL)) {
+      diffs += compare_modes(ca, cb);
+      ca = ca == NULL ? NULL : ca->sibling;
+      cb = cb == NULL ? NULL : cb->sibling;
+    }
+  }
+  return diffs;
+}
+
 int main(void) {
   report.setLevel(debug);
 
@@ -67,5 +89,87 @@ int main(void) {
     delete root;
   }
 
+  // Get test1 and sub-dirs using several threads
+  {
+    SharedPath path(current_path, strlen(current_path), "test1");
+    root = FsNode::createRoot(current_path);
+    if (root->readTree(current_path, 0, 3) < 0) {
+      hlog_error("%m reading tree '%s'", current_path);
+    }
+    root->show(1);
+    delete root;
+  }
+
+  // Same, allocating the tree from an arena
+  {
+    SharedPath path(current_path, strlen(current_path), "test1");
+    root = FsNode::createRoot(current_path, true);
+    if (root->readTree(current_path, 0, 3) < 0) {
+      hlog_error("%m reading tree '%s'", current_path);
+    }
+    root->getNode("subdir")->createChild("new link", 'l');
+    static_cast<FsNodeLink*>(root->getNode("subdir/new link"))->string =
+      root->arena->strdup("target");
+    root->show(1);
+    root->clear();
+    hlog_verbose("arena size after clear: %zu", root->arena->size());
+    delete root;
+  }
+
+  // Modes do not depend on where the nodes were allocated
+  {
+    SharedPath path(current_path, strlen(current_path), "test1");
+    FsNodeDir* heap_root = FsNode::createRoot(current_path);
+    root = FsNode::createRoot(current_path, true);
+    if ((heap_root->readTree(current_path, 0, 3) < 0) ||
+        (root->readTree(current_path, 0, 3) < 0)) {
+      hlog_error("%m reading tree '%s'", current_path);
+    }
+    const FsNode* node = root->getNode("subdir");
+    hlog_verbose("arena: mode %o, stat mode %o, %zu difference(s)",
+      node->mode, node->statMode(), compare_modes(heap_root, root));
+    delete heap_root;
+    delete root;
+  }
+
+  // Large directories get indexed, whether read or created
+  {
+    mkdir("many", 0755);
+    char name[16];
+    for (int i = 0; i < 1000; ++i) {
+      sprintf(name, "many/f%04d", i);
+      FILE* file = fopen(name, "w");
+      if (file != NULL) {
+        fclose(file);
+      }
+    }
+    for (int t = 0; t < 2; ++t) {
+      root = FsNode::createRoot("many", t == 0);
+      if (t == 0) {
+        if (root->readTree("many", 0, 2) < 0) {
+          hlog_error("%m reading tree 'many'");
+        }
+      } else {
+        for (int i = 0; i < 1000; ++i) {
+          sprintf(name, "f%04d", i);
+          root->createChild(name, 'f');
+        }
+      }
+      size_t found = 0;
+      for (int i = 999; i >= 0; --i) {
+        sprintf(name, "f%04d", i);
+        FsNode* node = root->getNode(name);
+        if ((node != NULL) && (strcmp(node->name, name) == 0)) {
+          ++found;
+        }
+      }
+      hlog_verbose("%s: %zu children, %s, %zu found, missing %s",
+        t == 0 ? "read" : "created", root->children,
+        root->index != NULL ? "indexed" : "not indexed", found,
+        root->getNode("f1000") == NULL ? "not found" : "found");
+      delete root;
+    }
+  }
+
   return 0;
 }
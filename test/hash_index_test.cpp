@@ -0,0 +1,222 @@
+/*
+     Copyright (C) 2011  Hervé Fache
+
+     This program is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License version 2 as
+     published by the Free Software Foundation.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program; if not, write to the Free Software
+     Foundation, Inc., 59 Temple Place - Suite 330,
+     Boston, MA 02111-1307, USA.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include <report.h>
+#include "hash_index.h"
+
+using namespace htoolbox;
+
+static void list(const HashIndex& index) {
+  hlog_info("structure:");
+  index.show();
+  hlog_info("list (%zu):", index.size());
+  const HashIndex::Record* record = NULL;
+  while ((record = index.next(record)) != NULL) {
+    hlog_info("  record: %s -> '%s'", record->hash(), record->data());
+  }
+  hlog_info("-");
+}
+
+static off_t fileSize(const char* path) {
+  struct stat metadata;
+  if (stat(path, &metadata) < 0) {
+    return -1;
+  }
+  return metadata.st_size;
+}
+
+static int compare(const void* a, const void* b) {
+  return strcmp(static_cast<const char*>(a), static_cast<const char*>(b));
+}
+
+int main(void) {
+  report.setLevel(debug);
+
+  {
+    HashIndex index;
+    if (index.open("index") < 0) {
+      hlog_info("open missing index: %s", strerror(errno));
+    }
+    HashIndexWriter writer;
+    if (writer.open("index") < 0) {
+      hlog_error("open writer: %s", strerror(errno));
+      return 0;
+    }
+    if (index.open("index") < 0) {
+      hlog_error("open empty index: %s", strerror(errno));
+    }
+    list(index);
+    index.close();
+
+    const char* hashes[] = { "abcd", "abce", "0123", "0023", "0000", "FFFF",
+      "ABC0", NULL };
+    for (int i = 0; hashes[i] != NULL; ++i) {
+      char data[16];
+      sprintf(data, "data %d", i);
+      hlog_info("adding %s: %d", hashes[i], writer.add(hashes[i], data));
+    }
+    hlog_info("adding abcd again: %d", writer.add("abcd"));
+    hlog_info("adding ABCD: %d", writer.add("ABCD"));
+    int rc = writer.add("abcde");
+    hlog_info("adding abcde: %d, %s", rc, strerror(errno));
+    if (writer.commit() < 0) {
+      hlog_error("commit: %s", strerror(errno));
+    }
+    if (index.open("index") < 0) {
+      hlog_error("open index: %s", strerror(errno));
+    }
+    list(index);
+
+    const char* queries[] = { "abcd", "abc0", "ffff", "0002", "FFFE", "5555",
+      "abcde", NULL };
+    for (int i = 0; queries[i] != NULL; ++i) {
+      const HashIndex::Record* record = index.find(queries[i]);
+      hlog_info("finding %s: %s", queries[i], record == NULL ? "not found" :
+        record->hash());
+    }
+    hlog_info("after 0003: %s", index.next("0003")->hash());
+    hlog_info("after abcd: %s", index.next("abcd")->hash());
+    hlog_info("after ffff: %s", index.next("ffff") == NULL ? "none" : "some");
+
+    // The index already open is not affected by later commits
+    hlog_info("adding 0001: %d", writer.add("0001", "data 7"));
+    hlog_info("adding 1234: %d", writer.add("1234", "data 8"));
+    hlog_info("size before commit: %zu", writer.size());
+    if (writer.close() < 0) {
+      hlog_error("close: %s", strerror(errno));
+    }
+    hlog_info("old index:");
+    list(index);
+    index.close();
+    if (index.open("index") < 0) {
+      hlog_error("open index: %s", strerror(errno));
+    }
+    hlog_info("new index:");
+    list(index);
+    index.close();
+  }
+
+  // Data left after the last commit is dropped
+  {
+    off_t size = fileSize("index");
+    FILE* file = fopen("index", "a");
+    fprintf(file, "partial commit");
+    fclose(file);
+    hlog_info("size grew: %s", fileSize("index") > size ? "yes" : "no");
+    HashIndexWriter writer;
+    if (writer.open("index") < 0) {
+      hlog_error("open writer: %s", strerror(errno));
+    }
+    hlog_info("size restored: %s", fileSize("index") == size ? "yes" : "no");
+    hlog_info("adding 0001 again: %d", writer.add("0001"));
+    hlog_info("adding 5555: %d", writer.add("5555", "data 9"));
+    // Destructor commits
+  }
+  {
+    HashIndex index;
+    if (index.open("index") < 0) {
+      hlog_error("open index: %s", strerror(errno));
+    }
+    list(index);
+  }
+
+  // Not an index
+  {
+    FILE* file = fopen("not_index", "w");
+    fprintf(file, "this is not an index file, at all");
+    fclose(file);
+    HashIndex index;
+    int rc = index.open("not_index");
+    hlog_info("open not_index: %d, %s", rc, strerror(errno));
+    HashIndexWriter writer;
+    rc = writer.open("not_index");
+    hlog_info("open writer on not_index: %d, %s", rc, strerror(errno));
+  }
+
+  // Compare with sorted array, adding in batches
+  {
+    const size_t count = 100000;
+    const size_t batch = 10000;
+    char (*hashes)[9] = new char[count][9];
+    unsigned int seed = 12345;
+    for (size_t i = 0; i < count; ++i) {
+      seed = seed * 1103515245 + 12345;
+      sprintf(hashes[i], "%08x", seed);
+    }
+    size_t added = 0;
+    for (size_t start = 0; start < count; start += batch) {
+      HashIndexWriter writer;
+      if (writer.open("big_index") < 0) {
+        hlog_error("open writer: %s", strerror(errno));
+        break;
+      }
+      for (size_t i = start; i < start + batch; ++i) {
+        char data[16];
+        sprintf(data, "%zu", i);
+        if (writer.add(hashes[i], data) == 0) {
+          ++added;
+        }
+      }
+    }
+    qsort(hashes, count, sizeof(hashes[0]), compare);
+    size_t unique = 0;
+    for (size_t i = 0; i < count; ++i) {
+      if ((unique == 0) || (strcmp(hashes[i], hashes[unique - 1]) != 0)) {
+        if (unique != i) {
+          strcpy(hashes[unique], hashes[i]);
+        }
+        ++unique;
+      }
+    }
+    HashIndex index;
+    if (index.open("big_index") < 0) {
+      hlog_error("open index: %s", strerror(errno));
+    }
+    hlog_info("%zu hashes, %zu unique, %zu added, %zu in index", count,
+      unique, added, index.size());
+    size_t errors = 0;
+    const HashIndex::Record* record = NULL;
+    for (size_t i = 0; i < unique; ++i) {
+      record = index.next(record);
+      if ((record == NULL) || (strcmp(record->hash(), hashes[i]) != 0)) {
+        ++errors;
+        break;
+      }
+    }
+    if (index.next(record) != NULL) {
+      ++errors;
+    }
+    for (size_t i = 0; i < unique; ++i) {
+      if (index.find(hashes[i]) == NULL) {
+        ++errors;
+      }
+    }
+    hlog_info("list and find: %zu error(s)", errors);
+    hlog_info("file size: %zu bytes", static_cast<size_t>(
+      fileSize("big_index")));
+    delete[] hashes;
+  }
+
+  return 0;
+}
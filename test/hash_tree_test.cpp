@@ -1,3 +1,5 @@
+#include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 
 #include <report.h>
@@ -570,5 +572,178 @@ int main(void) {
   }
   hlog_info("-");
 
+
+  // Load in order, and compare with adding one by one
+  {
+    const char* hashes[] = { "0000", "0001", "0023", "0123", "1234", "ABC0",
+      "abcd", "abce", "FFFF", NULL };
+    HashTree<TestClass> loaded;
+    HashTree<TestClass> added;
+    {
+      HashTree<TestClass>::Loader loader(loaded);
+      for (int i = 0; hashes[i] != NULL; ++i) {
+        meta = new TestClass;
+        strcpy(meta->h, hashes[i]);
+        if (loader.add(meta) != NULL) {
+          hlog_error("not loaded %s", meta->h);
+          delete meta;
+        }
+        meta = new TestClass;
+        strcpy(meta->h, hashes[i]);
+        added.add(meta);
+      }
+      TestClass again;
+      strcpy(again.h, "FFFF");
+      hlog_info("loading %s again: %s", again.h,
+        loader.add(&again) == NULL ? "loaded" : "rejected");
+      strcpy(again.h, "abcf");
+      hlog_info("loading %s after FFFF: %s", again.h,
+        loader.add(&again) == NULL ? "loaded" : "rejected");
+    }
+    hlog_info("loaded structure:");
+    loaded.show();
+    hlog_info("added structure:");
+    added.show();
+    hlog_info("-");
+
+    const char* prefixes[] = { "", "0", "00", "0002", "ab", "ABC", "abcd",
+      "5", "F", NULL };
+    for (int i = 0; prefixes[i] != NULL; ++i) {
+      hlog_info("prefix '%s':", prefixes[i]);
+      HashTree<TestClass>::Iterator it(loaded, prefixes[i]);
+      while ((meta = it.next()) != NULL) {
+        hlog_info("  meta: %s", meta->h);
+      }
+    }
+    hlog_info("-");
+  }
+
+  // Load many, check all are found and listed
+  {
+    struct LongClass {
+      char h[9];
+      operator const char*() const { return h; }
+    };
+    const size_t count = 100000;
+    HashTree<LongClass> tree;
+    {
+      HashTree<LongClass>::Loader loader(tree);
+      for (size_t i = 0; i < count; ++i) {
+        LongClass* hobj = new LongClass;
+        sprintf(hobj->h, "%08zx", i * 40009);
+        if (loader.add(hobj) != NULL) {
+          delete hobj;
+        }
+      }
+    }
+    size_t errors = 0;
+    for (size_t i = 0; i < count; ++i) {
+      char hash[9];
+      sprintf(hash, "%08zx", i * 40009);
+      if (tree.find(hash) == NULL) {
+        ++errors;
+      }
+    }
+    HashTree<LongClass>::Iterator it(tree);
+    LongClass* prev = NULL;
+    LongClass* hobj;
+    size_t listed = 0;
+    while ((hobj = it.next()) != NULL) {
+      if ((prev != NULL) && (strcmp(prev->h, hobj->h) >= 0)) {
+        ++errors;
+      }
+      prev = hobj;
+      ++listed;
+    }
+    size_t in_range = 0;
+    HashTree<LongClass>::Iterator range(tree, "0a");
+    while (range.next() != NULL) {
+      ++in_range;
+    }
+    hlog_info("loaded %zu, listed %zu, %zu in 0a range, %zu error(s)",
+      count, listed, in_range, errors);
+  }
+
+  // Binary keys, compared with the same keys in hexadecimal
+  {
+    struct BinaryClass {
+      char h[20];
+      operator const char*() const { return h; }
+    };
+    struct HexClass {
+      char h[41];
+      operator const char*() const { return h; }
+    };
+    typedef HashTree<BinaryClass, HashTreeBinaryKey<20> > BinaryTree;
+    BinaryTree small;
+    const char* hashes[] = { "ab", "0f", "a0", NULL };
+    for (int i = 0; hashes[i] != NULL; ++i) {
+      BinaryClass* hobj = new BinaryClass;
+      memset(hobj->h, 0x11, sizeof(hobj->h));
+      hobj->h[0] = static_cast<char>(strtol(hashes[i], NULL, 16));
+      small.add(hobj);
+    }
+    hlog_info("binary structure:");
+    small.show();
+    BinaryClass query;
+    memset(query.h, 0x11, sizeof(query.h));
+    query.h[0] = static_cast<char>(0xab);
+    hlog_info("find ab1111...: %s", small.find(&query) != NULL ? "found" :
+      "not found");
+    query.h[19] = 0x12;
+    hlog_info("find ab...1112: %s", small.find(&query) != NULL ? "found" :
+      "not found");
+    char prefix[1] = { static_cast<char>(0xa0) };
+    HashTree<BinaryClass, HashTreeBinaryKey<20> >::Iterator a(small, prefix,
+      1);
+    size_t in_a = 0;
+    while (a.next() != NULL) {
+      ++in_a;
+    }
+    hlog_info("%zu with prefix a", in_a);
+
+    const size_t count = 50000;
+    BinaryTree binary;
+    HashTree<HexClass> hex;
+    unsigned int seed = 12345;
+    for (size_t i = 0; i < count; ++i) {
+      BinaryClass* bobj = new BinaryClass;
+      HexClass* hobj = new HexClass;
+      for (size_t j = 0; j < sizeof(bobj->h); ++j) {
+        seed = seed * 1103515245 + 12345;
+        bobj->h[j] = static_cast<char>(seed >> 16);
+        sprintf(&hobj->h[2 * j], "%02x",
+          static_cast<unsigned char>(bobj->h[j]));
+      }
+      if (binary.add(bobj) != NULL) {
+        delete bobj;
+      }
+      if (hex.add(hobj) != NULL) {
+        delete hobj;
+      }
+    }
+    size_t errors = 0;
+    size_t listed = 0;
+    BinaryTree::Iterator bit(binary);
+    HashTree<HexClass>::Iterator hit(hex);
+    BinaryClass* bobj;
+    while ((bobj = bit.next()) != NULL) {
+      HexClass* hobj = hit.next();
+      char printable[41];
+      if ((hobj == NULL) || (strcmp(hobj->h,
+          HashTreeBinaryKey<20>::print(bobj->h, printable)) != 0)) {
+        ++errors;
+      }
+      if (binary.find(*bobj) != bobj) {
+        ++errors;
+      }
+      ++listed;
+    }
+    if (hit.next() != NULL) {
+      ++errors;
+    }
+    hlog_info("binary: listed %zu, %zu error(s)", listed, errors);
+  }
+
   return 0;
 }
@@ -15,6 +15,7 @@
 */
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
@@ -22,6 +23,7 @@
 #include <report.h>
 #include "hasher.h"
 #include "filereaderwriter.h"
+#include "nullwriter.h"
 
 using namespace htoolbox;
 
@@ -404,5 +406,272 @@ int main() {
     (void) system("sha512sum testfile2");
   }
 
+  // Several digests at once
+  for (int threaded = 0; threaded < 2; ++threaded) {
+    hlog_regression("%s", threaded ? "threaded" : "not threaded");
+    const Hasher::Digest digests[] = {
+      Hasher::md5, Hasher::sha1, Hasher::sha256 };
+    char hashes[3][129];
+    char* hashes_p[] = { hashes[0], hashes[1], hashes[2] };
+    FileReaderWriter frw("testfile3", true);
+    Hasher hh(&frw, false, digests, hashes_p, 3);
+    if (threaded) {
+      hh.setThreaded(65536);
+    }
+    IReaderWriter& fd = hh;
+    if (fd.open() < 0) {
+      hlog_regression("%s opening file", strerror(errno));
+    } else {
+      const size_t size = 1 << 20;
+      char* buffer = static_cast<char*>(malloc(size));
+      for (size_t i = 0; i < size; ++i) {
+        buffer[i] = static_cast<char>(i * 7 + (i >> 8));
+      }
+      // Small buffer, then large one
+      ssize_t rc = fd.put(buffer, 1000);
+      if (rc >= 0) {
+        rc = fd.put(&buffer[1000], size - 1000);
+      }
+      if (rc < 0) {
+        hlog_regression("%s writing file", strerror(errno));
+      }
+      free(buffer);
+      if (fd.close() < 0) {
+        hlog_regression("%s closing file", strerror(errno));
+      } else {
+        for (int i = 0; i < 3; ++i) {
+          hlog_regression("hash = '%s'", hashes[i]);
+        }
+      }
+    }
+    (void) system("md5sum testfile3; sha1sum testfile3; sha256sum testfile3");
+  }
+
+  // Tree hash, checked against hashes computed one by one
+  {
+    const size_t chunk_size = 4096;
+    const size_t size = 2 * chunk_size + 1000;
+    char* buffer = static_cast<char*>(malloc(size));
+    for (size_t i = 0; i < size; ++i) {
+      buffer[i] = static_cast<char>(i * 7 + (i >> 8));
+    }
+    // Expected chunk hashes
+    unsigned char leaves[3][32];
+    char leaves_hex[3][65];
+    for (size_t i = 0; i < 3; ++i) {
+      NullWriter nw;
+      Hasher hh(&nw, false, Hasher::sha256, leaves_hex[i]);
+      hh.open();
+      unsigned char zero = 0;
+      hh.put(&zero, 1);
+      size_t length = i < 2 ? chunk_size : size - 2 * chunk_size;
+      hh.put(&buffer[i * chunk_size], length);
+      hh.close();
+      for (size_t j = 0; j < 32; ++j) {
+        unsigned int byte;
+        sscanf(&leaves_hex[i][2 * j], "%2x", &byte);
+        leaves[i][j] = static_cast<unsigned char>(byte);
+      }
+    }
+    // Expected root: first two chunks together, then with the third
+    char node_hex[65];
+    unsigned char node[32];
+    {
+      NullWriter nw;
+      Hasher hh(&nw, false, Hasher::sha256, node_hex);
+      hh.open();
+      unsigned char one = 1;
+      hh.put(&one, 1);
+      hh.put(leaves[0], 32);
+      hh.put(leaves[1], 32);
+      hh.close();
+      for (size_t j = 0; j < 32; ++j) {
+        unsigned int byte;
+        sscanf(&node_hex[2 * j], "%2x", &byte);
+        node[j] = static_cast<unsigned char>(byte);
+      }
+    }
+    char root_hex[65];
+    {
+      NullWriter nw;
+      Hasher hh(&nw, false, Hasher::sha256, root_hex);
+      hh.open();
+      unsigned char one = 1;
+      hh.put(&one, 1);
+      hh.put(node, 32);
+      hh.put(leaves[2], 32);
+      hh.close();
+    }
+    hlog_regression("expected tree hash = '%s'", root_hex);
+
+    for (size_t threads = 1; threads <= 4; threads += 3) {
+      NullWriter nw;
+      char hash[129];
+      TreeHasher th(&nw, false, Hasher::sha256, chunk_size, hash, threads);
+      if (th.open() < 0) {
+        hlog_regression("%s opening", strerror(errno));
+        continue;
+      }
+      // Across chunk boundaries
+      th.put(buffer, 1000);
+      th.put(&buffer[1000], 5000);
+      th.put(&buffer[6000], size - 6000);
+      if (th.close() < 0) {
+        hlog_regression("%s closing", strerror(errno));
+        continue;
+      }
+      hlog_regression("%zu thread(s): tree hash = '%s', %zu chunks", threads,
+        hash, th.chunks());
+      for (size_t i = 0; i < th.chunks(); ++i) {
+        char chunk_hash[129];
+        th.chunkHash(i, chunk_hash);
+        hlog_regression("  chunk %zu: %s", i,
+          strcmp(chunk_hash, leaves_hex[i]) == 0 ? "ok" : "wrong");
+      }
+    }
+    free(buffer);
+
+    // Many chunks, many threads
+    const size_t big_size = 10 << 20;
+    buffer = static_cast<char*>(malloc(big_size));
+    for (size_t i = 0; i < big_size; ++i) {
+      buffer[i] = static_cast<char>(i * 7 + (i >> 8));
+    }
+    char hashes[2][129];
+    for (size_t threads = 1; threads <= 4; threads += 3) {
+      NullWriter nw;
+      TreeHasher th(&nw, false, Hasher::sha256, 65536, hashes[threads / 4],
+        threads);
+      th.open();
+      th.put(buffer, big_size);
+      th.close();
+      hlog_regression("%zu thread(s): %zu chunks", threads, th.chunks());
+    }
+    hlog_regression("tree hashes %s", strcmp(hashes[0], hashes[1]) == 0 ?
+      "match" : "differ");
+    free(buffer);
+
+    // Nothing
+    NullWriter nw;
+    char hash[129];
+    TreeHasher th(&nw, false, Hasher::sha256, chunk_size, hash, 2);
+    th.open();
+    th.close();
+    hlog_regression("empty: %zu chunk, tree hash = '%s'", th.chunks(), hash);
+    (void) system("printf '\\0' | sha256sum");
+  }
+
+  // Interrupted copy, resumed from saved state
+  {
+    const size_t size = 1 << 20;
+    char* buffer = static_cast<char*>(malloc(size));
+    for (size_t i = 0; i < size; ++i) {
+      buffer[i] = static_cast<char>(i * 13 + (i >> 10));
+    }
+    FileReaderWriter src("resume_src", true);
+    src.open();
+    src.put(buffer, size);
+    src.close();
+    free(buffer);
+
+    Hasher::Digest digests[] = { Hasher::md5, Hasher::sha256 };
+    char hash_md5[129];
+    char hash_sha256[129];
+    char* hashes[] = { hash_md5, hash_sha256 };
+    char state[1024];
+    ssize_t state_size;
+    int64_t offset_saved = 0;
+    char buf[10000];
+    {
+      FileReaderWriter dst("resume_dst", true);
+      Hasher hh(new FileReaderWriter("resume_src", false), true, digests,
+        hashes, 2);
+      hh.setResumable();
+      hh.open();
+      dst.open();
+      // Stop after 30 blocks
+      for (int i = 0; i < 30; ++i) {
+        ssize_t rc = hh.read(buf, sizeof(buf));
+        dst.put(buf, rc);
+      }
+      hlog_regression("state size: %s", hh.stateSize() <= sizeof(state) ?
+        "ok" : "too large");
+      state_size = hh.saveState(state);
+      hlog_regression("state saved at %lld: %s",
+        static_cast<long long>(hh.offset()), state_size > 0 ? "ok" : "failed");
+      // Some more data gets copied, but not in the state
+      ssize_t rc = hh.read(buf, sizeof(buf));
+      dst.put(buf, rc);
+      hh.close();
+      dst.close();
+    }
+    {
+      FileReaderWriter* src = new FileReaderWriter("resume_src", false);
+      FileReaderWriter dst("resume_dst", true);
+      Hasher hh(src, true, digests, hashes, 2);
+      hh.setResumable();
+      int64_t offset = hh.resume(state, state_size);
+      offset_saved = offset;
+      hlog_regression("resuming at %lld", static_cast<long long>(offset));
+      src->seek(offset);
+      dst.seek(offset);
+      if ((hh.open() < 0) || (dst.open() < 0)) {
+        hlog_regression("%s opening", strerror(errno));
+      } else {
+        ssize_t rc;
+        while ((rc = hh.read(buf, sizeof(buf))) > 0) {
+          dst.put(buf, rc);
+        }
+        hh.close();
+        dst.close();
+        hlog_regression("resumed md5 = '%s'", hash_md5);
+        hlog_regression("resumed sha256 = '%s'", hash_sha256);
+      }
+    }
+    (void) system("md5sum resume_src resume_dst");
+    (void) system("sha256sum resume_src");
+
+    // Destination shorter than the saved state: must not be padded
+    {
+      (void) truncate("resume_dst", offset_saved - 1);
+      FileReaderWriter dst("resume_dst", true);
+      dst.seek(offset_saved);
+      int rc = dst.open();
+      hlog_regression("resume shorter file: %d, %s", rc, strerror(errno));
+      FileReaderWriter missing("resume_missing", true);
+      missing.seek(offset_saved);
+      rc = missing.open();
+      hlog_regression("resume missing file: %d, %s", rc, strerror(errno));
+    }
+
+    // States that do not match
+    NullWriter nw;
+    char hash[129];
+    Hasher md5(&nw, false, Hasher::md5, hash);
+    md5.setResumable();
+    int64_t rc = md5.resume(state, state_size);
+    hlog_regression("resume with other digests: %lld, %s",
+      static_cast<long long>(rc), strerror(errno));
+    Hasher both(&nw, false, digests, hashes, 2);
+    both.setResumable();
+    state[0] = 'X';
+    rc = both.resume(state, state_size);
+    hlog_regression("resume with bad state: %lld, %s",
+      static_cast<long long>(rc), strerror(errno));
+    Hasher null(&nw, false, Hasher::md_null, hash);
+    null.setResumable();
+    null.open();
+    state_size = null.saveState(state);
+    hlog_regression("save md_null state: %zd, %s", state_size,
+      strerror(errno));
+    null.close();
+    Hasher plain(&nw, false, Hasher::md5, hash);
+    plain.open();
+    state_size = plain.saveState(state);
+    hlog_regression("save state when not resumable: %zd, %s", state_size,
+      strerror(errno));
+    plain.close();
+  }
+
   return 0;
 }
@@ -14,15 +14,31 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <unistd.h>
+#include <pthread.h>
+
 #include <report.h>
 #include <queue.h>
 
 using namespace htoolbox;
 
+struct BatchPusher {
+  Queue*  queue;
+  void**  items;
+  size_t  n;
+  size_t  pushed;
+};
+
+static void* push_batch(void* data) {
+  BatchPusher* p = static_cast<BatchPusher*>(data);
+  p->pushed = p->queue->pushBatch(p->items, p->n);
+  return NULL;
+}
+
 int main(void) {
   report.setLevel(debug);
-  report.consoleFilter().addCondition(Report::Filter::force,
-    "queue.cpp", 0, 0, regression);
+  size_t queue_cond = report.consoleFilter().addCondition(
+    Report::Filter::force, "queue.cpp", 0, 0, regression);
   report.consoleFilter().addCondition(Report::Filter::force,
     __FILE__, 0, 0, regression);
 
@@ -74,5 +90,59 @@ int main(void) {
       }
     }
   }
+
+  // Batches
+  q1.open();
+  int j[SIZE];
+  void* items[SIZE];
+  for (int k = 0; k < SIZE; ++k) {
+    j[k] = k + 40;
+    items[k] = &j[k];
+  }
+  q1.pushBatch(items, SIZE / 2);
+  hlog_info("size = %zu", q1.size());
+  q1.pushBatch(&items[SIZE / 2], 3);
+  hlog_info("size = %zu", q1.size());
+  void* out[SIZE];
+  size_t got;
+  q1.popBatch(out, 2, &got);
+  for (size_t k = 0; k < got; ++k) {
+    hlog_info("o = %d", *static_cast<int*>(out[k]));
+  }
+  q1.popBatch(out, SIZE, &got);
+  for (size_t k = 0; k < got; ++k) {
+    hlog_info("o = %d", *static_cast<int*>(out[k]));
+  }
+  q1.signal();
+  hlog_info("rc = %d", q1.popBatch(out, SIZE, &got));
+  q1.close();
+  hlog_info("pushed = %zu", q1.pushBatch(items, 1));
+  hlog_info("rc = %d", q1.popBatch(out, SIZE, &got));
+
+  // Closed while pushing a batch: the caller still owns the items not pushed
+  report.consoleFilter().removeCondition(queue_cond);
+  {
+    enum { BATCH = SIZE + SIZE / 2 };
+    Queue q2("q2", SIZE);
+    q2.open();
+    void* batch[BATCH];
+    for (int k = 0; k < BATCH; ++k) {
+      batch[k] = &j[k % SIZE];
+    }
+    hlog_info("pushed = %zu", q2.pushBatch(batch, SIZE / 2));
+    BatchPusher pusher = { &q2, batch, BATCH, 0 };
+    pthread_t tid;
+    pthread_create(&tid, NULL, push_batch, &pusher);
+    usleep(100000);
+    hlog_info("size = %zu", q2.size());
+    q2.close();
+    pthread_join(tid, NULL);
+    hlog_info("pushed = %zu of %d", pusher.pushed, BATCH);
+    size_t popped = 0;
+    while (q2.popBatch(out, SIZE, &got) == 0) {
+      popped += got;
+    }
+    hlog_info("popped = %zu", popped);
+  }
   return 0;
 }
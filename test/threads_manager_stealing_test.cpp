@@ -0,0 +1,89 @@
+/*
+    Copyright (C) 2011  Hervé Fache
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 3.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Which thread runs which job depends on scheduling, so only totals are shown
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include <report.h>
+#include <queue.h>
+#include <threads_manager.h>
+
+using namespace htoolbox;
+
+// Slow enough for the other threads to wake up and steal
+static void* task(void* data, void* user) {
+  uint64_t* total = static_cast<uint64_t*>(user);
+  __sync_add_and_fetch(total, *static_cast<uint64_t*>(data));
+  usleep(20000);
+  return data;
+}
+
+static void run(size_t threads, size_t jobs, bool batch) {
+  hlog_info("%zu threads, %zu jobs%s", threads, jobs,
+    batch ? " in one batch" : "");
+  uint64_t total = 0;
+  uint64_t* values = new uint64_t[jobs];
+  ThreadsManager tm("steal", task, &total, 64);
+  tm.setWorkStealing(true);
+  if (tm.start(threads) != 0) {
+    hlog_error("start failed");
+    delete[] values;
+    return;
+  }
+  hlog_info("%zu thread(s)", tm.threads());
+  // Let all threads wait on the input queue
+  usleep(50000);
+  if (batch) {
+    // One thread fetches them all: the others can only get some by stealing
+    void** items = new void*[jobs];
+    for (size_t i = 0; i < jobs; ++i) {
+      values[i] = i + 1;
+      items[i] = &values[i];
+    }
+    tm.inputQueue().pushBatch(items, jobs);
+    delete[] items;
+  } else {
+    for (size_t i = 0; i < jobs; ++i) {
+      values[i] = i + 1;
+      tm.push(&values[i]);
+    }
+  }
+  // Jobs left when stopping are still run
+  tm.stop();
+  ThreadsManager::Stats stats;
+  tm.getStats(&stats);
+  hlog_info("jobs %llu, total %llu (expected %zu)",
+    static_cast<unsigned long long>(stats.jobs_completed),
+    static_cast<unsigned long long>(total), jobs * (jobs + 1) / 2);
+  // Stealing is only certain when one thread got all the jobs
+  if (batch) {
+    hlog_info("stolen: %s", stats.jobs_stolen > 0 ? "some" : "none");
+  }
+  delete[] values;
+}
+
+int main(void) {
+  report.setLevel(info);
+
+  run(4, 16, true);
+  run(4, 200, false);
+  run(1, 16, true);
+
+  return 0;
+}
@@ -34,6 +34,24 @@ static void* task(void* data, void* user) {
   return data;
 }
 
+static void show_stats(const ThreadsManager& tm) {
+  ThreadsManager::Stats stats;
+  tm.getStats(&stats);
+  hlog_regression("stats: queue %zu, busy %zu, idle %zu, created %llu, "
+    "reaped %llu, jobs %llu", stats.queue_depth, stats.busy_threads,
+    stats.idle_threads, static_cast<unsigned long long>(stats.threads_created),
+    static_cast<unsigned long long>(stats.threads_reaped),
+    static_cast<unsigned long long>(stats.jobs_completed));
+  // Jobs take 1 second to run
+  uint64_t jobs = 0;
+  for (size_t i = 0; i < ThreadsManager::Stats::HISTOGRAM_SIZE; ++i) {
+    jobs += stats.run_histogram[i];
+  }
+  hlog_regression("stats: run time %s, histogram %s",
+    stats.run_us >= stats.jobs_completed * 1000000 ? "ok" : "too short",
+    jobs == stats.jobs_completed ? "ok" : "wrong");
+}
+
 void activity_callback(bool idle, void* user) {
   char* cuser = static_cast<char*>(user);
   hlog_regression("activity callback(%s): user = '%s'",
@@ -153,5 +171,36 @@ int main(void) {
     q_out.wait();
   }
 
+  hlog_regression("thread limit = 3, 2 warm threads, no time out");
+  q_out.open();
+  strcpy(user, "user5");
+  ws.setCpuAffinity(true);
+  if (ws.start(3, 2, 0) != 0) {
+    hlog_error("start failed");
+  } else {
+    hlog_regression("%zu thread(s)", ws.threads());
+    char data1[32] = "data1";
+    ws.push(data1);
+    usleep(1500000);
+    char data2[32] = "data2";
+    ws.push(data2);
+    usleep(1500000);
+    char data3[32] = "data3";
+    ws.push(data3);
+    usleep(100000);
+    hlog_regression("%zu thread(s)", ws.threads());
+    show_stats(ws);
+    ws.stop();
+    show_stats(ws);
+    usleep(50000);
+    char* data_out;
+    hlog_regression("out queue:");
+    q_out.close();
+    while (q_out.pop(reinterpret_cast<void**>(&data_out)) == 0) {
+      hlog_regression("  '%s'", data_out);
+    }
+    q_out.wait();
+  }
+
   return 0;
 }
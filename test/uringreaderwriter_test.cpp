@@ -0,0 +1,211 @@
+/*
+    Copyright (C) 2011  Hervé Fache
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 3.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <report.h>
+#include "filereaderwriter.h"
+#include "uringreaderwriter.h"
+
+using namespace htoolbox;
+
+static const size_t size = 1000000;
+
+// Compare file contents with data
+static const char* compare(const char* path, const char* data) {
+  char* buffer = static_cast<char*>(malloc(size + 1));
+  FileReaderWriter fr(path, false);
+  ssize_t rc = -1;
+  if (fr.open() == 0) {
+    rc = fr.get(buffer, size + 1);
+    fr.close();
+  }
+  bool same = (rc == static_cast<ssize_t>(size)) &&
+    (memcmp(buffer, data, size) == 0);
+  free(buffer);
+  return same ? "same" : "different";
+}
+
+// Pieces of varying sizes, not aligned on the buffers of the ring
+static size_t piece(size_t done) {
+  return 1 + (done * 7) % 9000;
+}
+
+static void test(size_t depth, size_t buffer_size, const char* data) {
+  hlog_info("Test: depth %zu, buffers of %zu bytes", depth,
+    buffer_size);
+  char* buffer = static_cast<char*>(malloc(size));
+
+  // put
+  {
+    UringReaderWriter uw("testfile", true, depth, buffer_size);
+    if (uw.open() < 0) {
+      hlog_info("%s opening file", strerror(errno));
+    } else {
+      size_t done = 0;
+      while (done < size) {
+        size_t length = piece(done);
+        if (length > size - done) {
+          length = size - done;
+        }
+        if (uw.put(&data[done], length) < 0) {
+          hlog_info("%s writing", strerror(errno));
+          break;
+        }
+        done += length;
+      }
+      hlog_info("written %zu bytes, offset %lld", done,
+        static_cast<long long>(uw.offset()));
+      if (uw.close() < 0) {
+        hlog_info("%s closing file", strerror(errno));
+      }
+    }
+    hlog_info("file %s", compare("testfile", data));
+  }
+
+  // read/get
+  {
+    UringReaderWriter ur("testfile", false, depth, buffer_size);
+    if (ur.open() < 0) {
+      hlog_info("%s opening file", strerror(errno));
+    } else {
+      size_t done = 0;
+      ssize_t rc;
+      do {
+        rc = ur.read(&buffer[done], piece(done));
+        if (rc > 0) {
+          done += rc;
+        }
+      } while ((rc > 0) && (done < size / 2));
+      do {
+        rc = ur.get(&buffer[done], size - done < 5000 ? size - done : 5000);
+        if (rc > 0) {
+          done += rc;
+        }
+      } while ((rc > 0) && (done < size));
+      char c;
+      rc = ur.read(&c, 1);
+      hlog_info("read %zu bytes, %s, then %zd", done,
+        memcmp(buffer, data, size) == 0 ? "same" : "different", rc);
+      if (ur.close() < 0) {
+        hlog_info("%s closing file", strerror(errno));
+      }
+    }
+  }
+
+  // peek/advance
+  {
+    UringReaderWriter ur("testfile", false, depth, buffer_size);
+    memset(buffer, 0, size);
+    if (ur.open() < 0) {
+      hlog_info("%s opening file", strerror(errno));
+    } else {
+      size_t done = 0;
+      const void* view;
+      ssize_t rc;
+      while ((rc = ur.peek(&view, piece(done))) > 0) {
+        // Advance first: the view remains valid until the next peek
+        if (ur.advance(rc) != rc) {
+          hlog_info("%s advancing", strerror(errno));
+          break;
+        }
+        memcpy(&buffer[done], view, rc);
+        done += rc;
+      }
+      hlog_info("peeked %zu bytes, %s, offset %lld", done,
+        memcmp(buffer, data, size) == 0 ? "same" : "different",
+        static_cast<long long>(ur.offset()));
+      ur.close();
+    }
+  }
+
+  // reserve/commit
+  {
+    UringReaderWriter uw("testfile", true, depth, buffer_size);
+    if (uw.open() < 0) {
+      hlog_info("%s opening file", strerror(errno));
+    } else {
+      size_t done = 0;
+      while (done < size) {
+        void* region;
+        size_t length = piece(done);
+        if (length > size - done) {
+          length = size - done;
+        }
+        ssize_t rc = uw.reserve(&region, length);
+        if (rc <= 0) {
+          hlog_info("%s reserving", strerror(errno));
+          break;
+        }
+        memcpy(region, &data[done], rc);
+        if (uw.commit(rc) != rc) {
+          hlog_info("%s committing", strerror(errno));
+          break;
+        }
+        done += rc;
+      }
+      hlog_info("committed %zu bytes", done);
+      if (uw.close() < 0) {
+        hlog_info("%s closing file", strerror(errno));
+      }
+    }
+    hlog_info("file %s", compare("testfile", data));
+  }
+
+  free(buffer);
+}
+
+int main() {
+  report.setLevel(info);
+
+  char* data = static_cast<char*>(malloc(size));
+  unsigned int seed = 12345;
+  for (size_t i = 0; i < size; ++i) {
+    seed = seed * 1103515245 + 12345;
+    data[i] = static_cast<char>(seed >> 16);
+  }
+
+  test(4, 65536, data);
+  test(3, 1000, data);
+  test(1, 4096, data);
+  // Synchronous fallback
+  test(0, 4096, data);
+
+  hlog_info("Test: empty file");
+  {
+    UringReaderWriter uw("testfile", true, 4, 4096);
+    uw.open();
+    hlog_info("close: %d", uw.close());
+    UringReaderWriter ur("testfile", false, 4, 4096);
+    ur.open();
+    char c;
+    hlog_info("read: %zd", ur.read(&c, 1));
+    hlog_info("close: %d", ur.close());
+  }
+
+  hlog_info("Test: missing file");
+  {
+    UringReaderWriter ur("does_not_exist", false, 4, 4096);
+    int rc = ur.open();
+    hlog_info("open: %d, %s", rc, strerror(errno));
+  }
+
+  free(data);
+  return 0;
+}
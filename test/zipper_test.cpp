@@ -171,5 +171,107 @@ int main() {
     if (hw.close() < 0) return 0;
     hlog_regression("pu: size = %zu, hash = %s", size, hash);
   }
+  {
+    // Write-compress file using several threads
+    FileReaderWriter fr("random", false);
+    FileReaderWriter fw("random_mt.gz", true);
+    Zipper zw(&fw, false, 5, 4);
+    char hash[129];
+    Hasher hw(&zw, false, Hasher::md5, hash);
+    ssize_t rc;
+    size_t size = 0;
+
+    memset(hash, 0, 129);
+    if (fr.open() < 0) return 0;
+    if (hw.open() < 0) return 0;
+    size_t chunk = 1;
+    do {
+      char buffer[300000];
+      rc = fr.get(buffer, chunk);
+      if (rc < 0) return 0;
+      if (hw.put(buffer, rc) < rc) return 0;
+      size += rc;
+      chunk = chunk * 7 + 1;
+      if (chunk > sizeof(buffer)) {
+        chunk = 1;
+      }
+    } while (rc > 0);
+    if (hw.close() < 0) return 0;
+    if (fr.close() < 0) return 0;
+    hlog_regression("wzt: size = %zu, compressed size = %jd, hash = %s", size,
+      fw.offset(), hash);
+
+    // Read-uncompress file
+    FileReaderWriter fr2("random_mt.gz", false);
+    Zipper ur(&fr2, false);
+    Hasher hr(&ur, false, Hasher::md5, hash);
+    size = 0;
+    memset(hash, 0, 129);
+    if (hr.open() < 0) return 0;
+    do {
+      char buffer[300000];
+      rc = hr.get(buffer, sizeof(buffer));
+      size += rc;
+    } while (rc > 0);
+    if (hr.close() < 0) return 0;
+    hlog_regression("gut: size = %zu, hash = %s", size, hash);
+    hlog_regression("gunzip: rc = %d", system("gunzip -t random_mt.gz"));
+
+    // Empty file
+    FileReaderWriter fe("empty_mt.gz", true);
+    Zipper ze(&fe, false, 5, 4);
+    if (ze.open() < 0) return 0;
+    if (ze.close() < 0) return 0;
+    hlog_regression("empty: compressed size = %jd", fe.offset());
+    hlog_regression("gunzip: rc = %d", system("gunzip -t empty_mt.gz"));
+  }
+  {
+    // Same gzip header as zlib, whatever the level
+    const int levels[] = { 0, 1, 5, 9 };
+    for (size_t l = 0; l < sizeof(levels) / sizeof(levels[0]); ++l) {
+      char headers[2][10];
+      for (size_t threads = 1; threads <= 2; ++threads) {
+        FileReaderWriter fw("header.gz", true);
+        Zipper zw(&fw, false, levels[l], threads);
+        if (zw.open() < 0) return 0;
+        if (zw.put("header", 6) < 0) return 0;
+        if (zw.close() < 0) return 0;
+        FileReaderWriter fr("header.gz", false);
+        if (fr.open() < 0) return 0;
+        if (fr.get(headers[threads - 1], 10) < 10) return 0;
+        if (fr.close() < 0) return 0;
+      }
+      hlog_regression("header, level %d: %s, extra flags = %d", levels[l],
+        memcmp(headers[0], headers[1], 10) == 0 ? "same" : "different",
+        headers[1][8]);
+    }
+  }
+  {
+    // Threads must be stopped even if not closed
+    FileReaderWriter fw("unclosed_mt.gz", true);
+    {
+      Zipper zw(&fw, false, 5, 4);
+      if (zw.open() < 0) return 0;
+      char buffer[300000];
+      memset(buffer, 'a', sizeof(buffer));
+      if (zw.put(buffer, sizeof(buffer)) < 0) return 0;
+    }
+    fw.close();
+    hlog_regression("unclosed: destroyed");
+
+    // Read-compress still possible
+    FileReaderWriter fr("random", false);
+    Zipper zr(&fr, false, 5, 4);
+    if (zr.open() < 0) return 0;
+    size_t size = 0;
+    ssize_t rc;
+    do {
+      char buffer[300000];
+      rc = zr.get(buffer, sizeof(buffer));
+      size += rc;
+    } while (rc > 0);
+    if (zr.close() < 0) return 0;
+    hlog_regression("rzt: compressed size = %zu", size);
+  }
   return 0;
 }